@@ -1,9 +1,11 @@
-!/bin/sh
+#!/bin/sh
 
-CFLAGS="-Wall -Wextra -ggdb"
+CFLAGS="-Wall -Wextra -ggdb -pthread"
 
 set -xe;
 
 mkdir -p ./bin/
 
 clang $CFLAGS -o ./bin/filereader ./examples/reader.c
+clang $CFLAGS -o ./bin/bencode-batch ./examples/batch.c
+clang $CFLAGS -o ./bin/bencode-verify ./examples/verify.c
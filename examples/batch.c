@@ -0,0 +1,112 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#define BENCODE_IMPLEMENTATION
+#include "../stb_bencode.h"
+
+typedef struct {
+  size_t len;
+  size_t cap;
+  char **values;
+} Paths;
+
+void usage(const char *prog) {
+  printf("usage: %s [-j threads] [file...]\n", prog);
+  printf("Reads paths from stdin, one per line, when no file is given.\n");
+}
+
+void print_result(void *ctx, BencodeBatchResult *r) {
+  (void)ctx;
+  if (!r->ok) {
+    return;
+  }
+
+  BencodeType *info = NULL;
+  BencodeType *name = NULL;
+  if (r->value.kind == DICTIONARY) {
+    info = bencode_dict_get(r->value.asDict, "info", 4);
+  }
+  if (info && info->kind == DICTIONARY) {
+    name = bencode_dict_get(info->asDict, "name", 4);
+  }
+
+  if (name && name->kind == BYTESTRING) {
+    printf("ok %s %.*s\n", r->path, (int)name->asString.len,
+           name->asString.str);
+  } else {
+    printf("ok %s\n", r->path);
+  }
+}
+
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+  BencodeBatchOptions opts = {
+      .on_file = print_result,
+  };
+
+  Paths paths = {0};
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-h") == 0) {
+      usage(argv[0]);
+      return 0;
+    } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      opts.threads = strtoul(argv[++i], NULL, 10);
+    } else {
+      Paths *da = &paths;
+      if (da->len == da->cap) {
+        da->cap = da->cap ? da->cap * 2 : 64;
+        da->values = realloc(da->values, da->cap * sizeof(char *));
+      }
+      da->values[da->len++] = argv[i];
+    }
+  }
+
+  if (paths.len == 0) {
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t n;
+    while ((n = getline(&line, &cap, stdin)) > 0) {
+      if (line[n - 1] == '\n') {
+        line[--n] = '\0';
+      }
+      if (n == 0) {
+        continue;
+      }
+
+      Paths *da = &paths;
+      if (da->len == da->cap) {
+        da->cap = da->cap ? da->cap * 2 : 64;
+        da->values = realloc(da->values, da->cap * sizeof(char *));
+      }
+      da->values[da->len++] = strdup(line);
+    }
+    free(line);
+  }
+
+  BencodeBatchResult *results = calloc(paths.len, sizeof(BencodeBatchResult));
+
+  double start = now();
+  size_t ok = parse_batch((const char *const *)paths.values, paths.len, opts,
+                          results);
+  double elapsed = now() - start;
+
+  size_t bytes = 0;
+  for (size_t i = 0; i < paths.len; i++) {
+    bytes += results[i].bytes;
+    if (!results[i].ok) {
+      printf("error %s: %s\n", results[i].path, results[i].error);
+    }
+  }
+
+  fprintf(stderr, "%zu/%zu files ok in %.3fs (%.0f files/s, %.1f MB/s)\n", ok,
+          paths.len, elapsed, paths.len / elapsed, bytes / elapsed / 1e6);
+
+  return ok == paths.len ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,505 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+// Every allocation the library makes goes through these, so each phase can
+// report how many it made.
+size_t bench_allocs = 0;
+size_t bench_alloc_bytes = 0;
+
+void *bench_malloc(size_t size) {
+  bench_allocs++;
+  bench_alloc_bytes += size;
+  return malloc(size);
+}
+
+void *bench_realloc(void *ptr, size_t size) {
+  bench_allocs++;
+  bench_alloc_bytes += size;
+  return realloc(ptr, size);
+}
+
+#define BENCODE_MALLOC(size) bench_malloc(size)
+#define BENCODE_REALLOC(ptr, size) bench_realloc(ptr, size)
+#define HASH_TABLE_MALLOC(size) bench_malloc(size)
+#define HASH_TABLE_REALLOC(ptr, size) bench_realloc(ptr, size)
+#define BENCODE_IMPLEMENTATION
+#include "../stb_bencode.h"
+
+#define BENCH_MIN_SECONDS 0.3
+#define ARRAY_LEN(a) (sizeof(a) / sizeof((a)[0]))
+
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+} Corpus;
+
+typedef struct {
+  const char *corpus;
+  const char *phase;
+  size_t bytes;
+  size_t iterations;
+  double seconds;
+  double best;
+  size_t tokens;
+  size_t allocs;
+  size_t alloc_bytes;
+  long peak_rss_kb;
+} Result;
+
+void corpus_printf(Corpus *c, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  int n = vsnprintf(NULL, 0, fmt, args);
+  va_end(args);
+
+  while (c->len + n + 1 > c->cap) {
+    c->cap = c->cap ? c->cap * 2 : 4096;
+    c->data = realloc(c->data, c->cap);
+  }
+
+  va_start(args, fmt);
+  vsnprintf(c->data + c->len, n + 1, fmt, args);
+  va_end(args);
+  c->len += n;
+}
+
+void corpus_bytes(Corpus *c, char byte, size_t n) {
+  while (c->len + n + 1 > c->cap) {
+    c->cap = c->cap ? c->cap * 2 : 4096;
+    c->data = realloc(c->data, c->cap);
+  }
+
+  memset(c->data + c->len, byte, n);
+  c->len += n;
+}
+
+// A single-file torrent whose pieces string dominates the document.
+Corpus gen_pieces(size_t scale) {
+  Corpus c = {0};
+  size_t pieces = 20 * 50000 * scale;
+  corpus_printf(&c, "d8:announce31:http://tracker.example/announce"
+                    "4:infod6:lengthi%zue4:name8:big.file"
+                    "12:piece lengthi262144e6:pieces%zu:",
+                pieces / 20 * 262144, pieces);
+  corpus_bytes(&c, 'p', pieces);
+  corpus_printf(&c, "ee");
+  return c;
+}
+
+// A multi-file torrent with a long files list.
+Corpus gen_files(size_t scale) {
+  Corpus c = {0};
+  corpus_printf(&c, "d8:announce31:http://tracker.example/announce"
+                    "4:infod5:filesl");
+  for (size_t i = 0; i < 10000 * scale; i++) {
+    corpus_printf(&c, "d6:lengthi%zue4:pathl3:dir9:file%05zuee", i * 977,
+                  i % 100000);
+  }
+  corpus_printf(&c, "e4:name5:files12:piece lengthi262144e6:pieces20:");
+  corpus_bytes(&c, 'p', 20);
+  corpus_printf(&c, "ee");
+  return c;
+}
+
+// Lists nested inside each other, a few levels at a time.
+Corpus gen_nested(size_t scale) {
+  Corpus c = {0};
+  for (size_t round = 0; round < 100 * scale; round++) {
+    corpus_printf(&c, "l");
+    for (size_t depth = 0; depth < 200; depth++) {
+      corpus_printf(&c, "li%zue", depth);
+    }
+    corpus_bytes(&c, 'e', 200);
+    corpus_printf(&c, "e");
+  }
+  // Wrap the rounds so the corpus is a single document.
+  Corpus wrapped = {0};
+  corpus_printf(&wrapped, "l");
+  corpus_printf(&wrapped, "%.*s", (int)c.len, c.data);
+  corpus_printf(&wrapped, "e");
+  free(c.data);
+  return wrapped;
+}
+
+// One dict with many keys, in canonical order.
+Corpus gen_dict_keys(size_t scale) {
+  Corpus c = {0};
+  corpus_printf(&c, "d");
+  for (size_t i = 0; i < 10000 * scale; i++) {
+    corpus_printf(&c, "10:key%07zui%zue", i, i);
+  }
+  corpus_printf(&c, "e");
+  return c;
+}
+
+// A tracker scrape response: nothing but 20-byte hashes and integers.
+Corpus gen_scrape(size_t scale) {
+  Corpus c = {0};
+  corpus_printf(&c, "d5:filesd");
+  for (size_t i = 0; i < 5000 * scale; i++) {
+    corpus_printf(&c, "20:%020zud8:completei%zue10:downloadedi%zue"
+                      "10:incompletei%zuee",
+                  i, i * 31 % 100000, i * 7919 % 10000000, i * 17 % 5000);
+  }
+  corpus_printf(&c, "ee");
+  return c;
+}
+
+// Tracker announce responses with compact peer lists, wrapped in a list.
+// Every response has the same length, so they can be decoded one by one
+// without a skip pass.
+Corpus gen_announce(size_t scale) {
+  Corpus c = {0};
+  corpus_printf(&c, "l");
+  for (size_t i = 0; i < 1000 * scale; i++) {
+    corpus_printf(&c, "d8:completei%05zue10:incompletei%05zue"
+                      "8:intervali1800e5:peers300:",
+                  10000 + i * 31 % 90000, 10000 + i * 17 % 90000);
+    corpus_bytes(&c, 'p', 300);
+    corpus_printf(&c, "6:peers6180:");
+    corpus_bytes(&c, 'q', 180);
+    corpus_printf(&c, "e");
+  }
+  corpus_printf(&c, "e");
+  return c;
+}
+
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Resets the kernel's high-water mark so each phase reports its own peak.
+void reset_peak_rss(void) {
+  FILE *f = fopen("/proc/self/clear_refs", "w");
+  if (f) {
+    fputs("5", f);
+    fclose(f);
+  }
+}
+
+long peak_rss_kb(void) {
+  FILE *f = fopen("/proc/self/status", "r");
+  if (f) {
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+      long kb;
+      if (sscanf(line, "VmHWM: %ld kB", &kb) == 1) {
+        fclose(f);
+        return kb;
+      }
+    }
+    fclose(f);
+  }
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+Parser corpus_parser(Corpus *c) {
+  return new_parser(new_lexer_from_buffer(c->data, c->len));
+}
+
+size_t run_tokenize(Corpus *c) {
+  Lexer l = new_lexer_from_buffer(c->data, c->len);
+  size_t tokens = 0;
+  while (next_token(&l).type != END_OF_FILE) {
+    tokens++;
+  }
+  return tokens;
+}
+
+size_t run_parse(Corpus *c) {
+  Parser p = corpus_parser(c);
+  p.zero_copy = true;
+  BencodeType t = parse_item(&p);
+  bencode_free(&t, false);
+  return 0;
+}
+
+// Looks up every key of the top-level dict, or of the dict held by its
+// only value for corpora that wrap their entries one level down.
+size_t run_lookup(Corpus *c, BencodeType *root) {
+  (void)c;
+  BencodeDict *d = root->asDict;
+  if (d->len == 1 && d->entries[0].value.kind == DICTIONARY) {
+    d = d->entries[0].value.asDict;
+  }
+
+  size_t found = 0;
+  for (size_t i = 0; i < d->len; i++) {
+    BencodeString k = d->entries[i].key;
+    found += bencode_dict_get(d, k.str, k.len) != NULL;
+  }
+  return found;
+}
+
+// Pulls the fields a metadata indexer wants straight from the raw bytes.
+size_t run_query(Corpus *c) {
+  BencodeQuery q[] = {
+      {.path = "announce"},
+      {.path = "info/name"},
+      {.path = "info/piece length"},
+  };
+  return bencode_query(c->data, c->len, q, ARRAY_LEN(q));
+}
+
+#define BENCH_METAINFO(X)                                                      \
+  X(STRING, announce, "announce")                                              \
+  X(RAW, info, "info")
+BENCODE_SCHEMA(BenchMetainfo, BENCH_METAINFO)
+
+#define BENCH_INFO(X)                                                          \
+  X(STRING, name, "name")                                                      \
+  X(INT, piece_length, "piece length")
+BENCODE_SCHEMA(BenchInfo, BENCH_INFO)
+
+// Pulls the same fields as run_query with schema decoders.
+size_t run_schema(Corpus *c) {
+  BenchMetainfo m;
+  BenchInfo info;
+  if (!BenchMetainfo_decode(c->data, c->len, &m) ||
+      !BenchInfo_decode(m.info.str, m.info.len, &info)) {
+    return 0;
+  }
+  return m.has.announce + info.has.name + info.has.piece_length;
+}
+
+// Decodes every announce response into fixed peer arrays, as a tracker
+// client would.
+size_t run_announce(Corpus *c) {
+  struct sockaddr_in peers[64];
+  struct sockaddr_in6 peers6[16];
+  BencodeAnnounce a = {
+      .peers = peers,
+      .peers_cap = ARRAY_LEN(peers),
+      .peers6 = peers6,
+      .peers6_cap = ARRAY_LEN(peers6),
+  };
+
+  size_t record = 1;
+  bencode_skip(c->data, c->len, &record);
+  record -= 1;
+
+  size_t decoded = 0;
+  for (size_t pos = 1; pos + record < c->len; pos += record) {
+    if (bencode_decode_announce(c->data + pos, record, &a)) {
+      decoded += a.peers_len + a.peers6_len;
+    }
+  }
+  return decoded;
+}
+
+typedef enum {
+  PHASE_TOKENIZE,
+  PHASE_PARSE,
+  PHASE_LOOKUP,
+  PHASE_QUERY,
+  PHASE_ANNOUNCE,
+  PHASE_SCHEMA,
+} Phase;
+
+const char *phase_names[] = {"tokenize",   "parse_item", "dict_lookup",
+                             "path_query", "announce",   "schema"};
+
+Result bench(const char *name, Corpus *c, Phase phase, size_t tokens) {
+  BencodeType root = {.kind = ERROR};
+  if (phase == PHASE_LOOKUP) {
+    Parser p = corpus_parser(c);
+    p.zero_copy = true;
+    root = parse_item(&p);
+  }
+
+  reset_peak_rss();
+  bench_allocs = 0;
+  bench_alloc_bytes = 0;
+
+  size_t iterations = 0;
+  double best = 0;
+  double start = now();
+  double elapsed;
+  do {
+    double iteration = now();
+    switch (phase) {
+    case PHASE_TOKENIZE:
+      run_tokenize(c);
+      break;
+    case PHASE_PARSE:
+      run_parse(c);
+      break;
+    case PHASE_LOOKUP:
+      run_lookup(c, &root);
+      break;
+    case PHASE_QUERY:
+      run_query(c);
+      break;
+    case PHASE_ANNOUNCE:
+      run_announce(c);
+      break;
+    case PHASE_SCHEMA:
+      run_schema(c);
+      break;
+    }
+    iterations++;
+    double end = now();
+    if (best == 0 || end - iteration < best) {
+      best = end - iteration;
+    }
+    elapsed = end - start;
+  } while (elapsed < BENCH_MIN_SECONDS);
+
+  Result r = {
+      .corpus = name,
+      .phase = phase_names[phase],
+      .bytes = c->len,
+      .iterations = iterations,
+      .seconds = elapsed,
+      .best = best,
+      .tokens = tokens,
+      .allocs = bench_allocs / iterations,
+      .alloc_bytes = bench_alloc_bytes / iterations,
+      .peak_rss_kb = peak_rss_kb(),
+  };
+
+  if (root.kind != ERROR) {
+    BencodeDict *d = root.asDict;
+    if (d->len == 1 && d->entries[0].value.kind == DICTIONARY) {
+      d = d->entries[0].value.asDict;
+    }
+    if (d->index) {
+      hash_probe_stats_t stats = hash_table_probe_stats(d->index);
+      fprintf(stderr, "%s: %zu keys, %.2f probes/hit, %zu max\n", name,
+              stats.entries, stats.mean_probes, stats.max_probes);
+    }
+    bencode_free(&root, false);
+  }
+  return r;
+}
+
+// Throughput is taken from the fastest iteration, which is far less noisy
+// than the mean on a loaded machine.
+double result_mbps(Result *r) { return r->bytes / r->best / 1e6; }
+
+void print_header(void) {
+  printf("corpus\tphase\tbytes\tMB/s\tns/token\tallocs\talloc_bytes\t"
+         "peak_rss_kb\n");
+}
+
+void print_result(Result *r) {
+  double ns_per_token = r->best * 1e9 / r->tokens;
+  printf("%s\t%s\t%zu\t%.1f\t%.2f\t%zu\t%zu\t%ld\n", r->corpus, r->phase,
+         r->bytes, result_mbps(r), ns_per_token, r->allocs, r->alloc_bytes,
+         r->peak_rss_kb);
+}
+
+// Compares MB/s against a file previously written by this program and
+// reports every phase that got slower by more than threshold.
+int compare_baseline(const char *path, double threshold, Result *results,
+                     size_t n) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    perror("ERROR: could not open baseline");
+    return 2;
+  }
+
+  int regressions = 0;
+  char line[512];
+  while (fgets(line, sizeof(line), f)) {
+    char corpus[64], phase[64];
+    double mbps;
+    if (sscanf(line, "%63s\t%63s\t%*s\t%lf", corpus, phase, &mbps) != 3) {
+      continue;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+      if (strcmp(results[i].corpus, corpus) != 0 ||
+          strcmp(results[i].phase, phase) != 0) {
+        continue;
+      }
+
+      double current = result_mbps(&results[i]);
+      double change = (current - mbps) / mbps;
+      fprintf(stderr, "%-10s %-12s %10.1f -> %10.1f MB/s (%+.1f%%)%s\n",
+              corpus, phase, mbps, current, change * 100,
+              change < -threshold ? "  REGRESSION" : "");
+      regressions += change < -threshold;
+    }
+  }
+
+  fclose(f);
+  return regressions ? 1 : 0;
+}
+
+int main(int argc, char **argv) {
+  const char *baseline = NULL;
+  double threshold = 0.10;
+  size_t scale = 10;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+      baseline = argv[++i];
+    } else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+      threshold = atof(argv[++i]) / 100;
+    } else if (strcmp(argv[i], "--quick") == 0) {
+      scale = 1;
+    } else {
+      printf("usage: %s [--quick] [--baseline results.tsv] [--threshold pct]\n",
+             argv[0]);
+      return 0;
+    }
+  }
+
+  struct {
+    const char *name;
+    Corpus (*gen)(size_t);
+    bool lookup;
+    bool torrent;
+    bool announce;
+  } corpora[] = {
+      {"pieces", gen_pieces, false, true, false},
+      {"files", gen_files, false, true, false},
+      {"nested", gen_nested, false, false, false},
+      {"dict_keys", gen_dict_keys, true, false, false},
+      {"scrape", gen_scrape, true, false, false},
+      {"announce", gen_announce, false, false, true},
+  };
+
+  Result results[ARRAY_LEN(corpora) * 6];
+  size_t n = 0;
+
+  print_header();
+  for (size_t i = 0; i < ARRAY_LEN(corpora); i++) {
+    Corpus c = corpora[i].gen(scale);
+    size_t tokens = run_tokenize(&c);
+
+    for (Phase phase = PHASE_TOKENIZE; phase <= PHASE_SCHEMA; phase++) {
+      if ((phase == PHASE_LOOKUP && !corpora[i].lookup) ||
+          ((phase == PHASE_QUERY || phase == PHASE_SCHEMA) &&
+           !corpora[i].torrent) ||
+          (phase == PHASE_ANNOUNCE && !corpora[i].announce)) {
+        continue;
+      }
+      results[n] = bench(corpora[i].name, &c, phase, tokens);
+      print_result(&results[n]);
+      fflush(stdout);
+      n++;
+    }
+
+    free(c.data);
+  }
+
+  if (baseline) {
+    return compare_baseline(baseline, threshold, results, n);
+  }
+
+  return 0;
+}
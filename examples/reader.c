@@ -1,18 +1,82 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#define BENCODE_STATS
 #define BENCODE_IMPLEMENTATION
 #include "../stb_bencode.h"
 
 void print_bencode(BencodeType t, size_t indent);
 
+typedef struct {
+  hash_table_stats_t total;
+  size_t dicts;
+  // The indexed dict whose lookups took the most probes per key.
+  size_t worst_keys;
+  double worst_probes;
+} IndexStats;
+
+// Looks every key of every indexed dict up, as a reader of the document
+// would, and sums what their hash indexes did.
+void index_stats(BencodeType *t, IndexStats *s) {
+  if (t->kind == LIST) {
+    for (size_t i = 0; i < t->asList.len; i++) {
+      index_stats(&t->asList.values[i], s);
+    }
+    return;
+  }
+  if (t->kind != DICTIONARY) {
+    return;
+  }
+
+  BencodeDict *d = t->asDict;
+  for (size_t i = 0; i < d->len; i++) {
+    BencodeString key = d->entries[i].key;
+    bencode_dict_get(d, key.str, key.len);
+    index_stats(&d->entries[i].value, s);
+  }
+  if (!d->index) {
+    return;
+  }
+
+  hash_table_stats_t *h = &d->index->stats;
+  size_t probes = 0;
+  for (size_t i = 0; i < HASH_TABLE_PROBE_BUCKETS; i++) {
+    probes += (i + 1) * h->probes[i];
+  }
+  double per_key = (double)probes / d->len;
+  if (per_key > s->worst_probes) {
+    s->worst_probes = per_key;
+    s->worst_keys = d->len;
+  }
+  bencode_hash_stats_add(&s->total, h);
+  s->dicts++;
+}
+
+void print_stats(Parser *p, BencodeList *items) {
+  IndexStats s = {0};
+  for (size_t i = 0; i < items->len; i++) {
+    index_stats(&items->values[i], &s);
+  }
+
+  bencode_stats_print(stderr, &p->stats);
+  fprintf(stderr, "indexed dicts: %zu\n", s.dicts);
+  if (s.dicts) {
+    bencode_hash_stats_print(stderr, &s.total);
+    fprintf(stderr, "worst dict: %zu keys, %.2f probes per lookup\n",
+            s.worst_keys, s.worst_probes);
+  }
+}
+
 int main(int argc, char **argv) {
-  if (argc < 2) {
-    printf("usage: %s [filename]\n", argv[0]);
+  bool stats = argc > 2 && strcmp(argv[1], "-s") == 0;
+  if (argc < 2 || (argc > 2 && !stats)) {
+    printf("usage: %s [-s] [filename]\n", argv[0]);
+    printf("  -s  print parser and hash table stats to stderr\n");
     return 0;
   }
 
-  Lexer l = new_lexer(argv[1]);
+  Lexer l = new_lexer(argv[argc - 1]);
   Parser p = new_parser(l);
 
   BencodeList items = parse(&p);
@@ -29,6 +93,10 @@ int main(int argc, char **argv) {
   for (size_t i = 0; i < items.len; i++) {
     print_bencode(items.values[i], 0);
   }
+
+  if (stats) {
+    print_stats(&p, &items);
+  }
 }
 
 void indent(size_t indent) {
@@ -56,13 +124,11 @@ void print_bencode(BencodeType t, size_t indent_size) {
     break;
   case DICTIONARY:
     printf("DICTIONARY: \n");
-    for (size_t i = 0; i < t.asDict.size; i++) {
-      if (t.asDict.values[i].in_use) {
-        indent(indent_size + 2);
-        printf("%s =\n", (char *)t.asDict.values[i].key);
-        BencodeType *value = t.asDict.values[i].value;
-        print_bencode(*value, indent_size + 2);
-      }
+    for (size_t i = 0; i < t.asDict->len; i++) {
+      BencodeDictEntry *e = &t.asDict->entries[i];
+      indent(indent_size + 2);
+      printf("%.*s =\n", (int)e->key.len, e->key.str);
+      print_bencode(e->value, indent_size + 2);
     }
     break;
   default:
@@ -0,0 +1,80 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#define BENCODE_IMPLEMENTATION
+#include "../stb_bencode.h"
+
+void usage(const char *prog) {
+  printf("usage: %s [-j threads] file.torrent [download dir]\n", prog);
+  printf("Checks the downloaded data against the torrent's piece hashes.\n");
+}
+
+void print_piece(void *ctx, size_t piece, bool ok) {
+  (void)ctx;
+  if (!ok) {
+    printf("bad piece %zu\n", piece);
+  }
+}
+
+int main(int argc, char **argv) {
+  BencodeVerifyOptions opts = {
+      .on_piece = print_piece,
+  };
+  const char *torrent = NULL;
+  const char *root = ".";
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-h") == 0) {
+      usage(argv[0]);
+      return 0;
+    } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      opts.threads = strtoul(argv[++i], NULL, 10);
+    } else if (!torrent) {
+      torrent = argv[i];
+    } else {
+      root = argv[i];
+    }
+  }
+
+  if (!torrent) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  Parser p = new_parser(new_lexer_mmap(torrent));
+  p.zero_copy = true;
+  p.fail_fast = true;
+  BencodeType meta = parse_item(&p);
+  if (p.error.code != BENCODE_OK) {
+    fprintf(stderr, "%s: %s at byte %zu\n", torrent,
+            bencode_error_string(p.error.code), p.error.offset);
+    return EXIT_FAILURE;
+  }
+
+  BencodeType *info = NULL;
+  if (meta.kind == DICTIONARY) {
+    info = bencode_dict_get(meta.asDict, "info", 4);
+  }
+
+  BencodeTorrent t;
+  if (!info || !torrent_from_info(info, root, &t)) {
+    fprintf(stderr, "%s: not a valid torrent\n", torrent);
+    return EXIT_FAILURE;
+  }
+
+  bool *ok = calloc(t.pieces_len, sizeof(bool));
+  BencodeVerifyStats stats;
+  torrent_verify(&t, opts, ok, &stats);
+
+  fprintf(stderr, "%zu/%zu pieces ok, %.1f MB in %.3fs (%.1f MB/s)\n",
+          stats.pieces_ok, t.pieces_len, stats.bytes / 1e6, stats.seconds,
+          stats.mb_per_s);
+
+  int status = stats.pieces_ok == t.pieces_len ? EXIT_SUCCESS : EXIT_FAILURE;
+  free(ok);
+  free_torrent(&t);
+  bencode_free(&meta, false);
+  free_lexer(&p.l);
+  return status;
+}
@@ -0,0 +1,11 @@
+#!/bin/sh
+
+CFLAGS="-Wall -Wextra -O2 -pthread"
+
+set -xe;
+
+mkdir -p ./bin/
+
+clang $CFLAGS -o ./bin/bench ./examples/bench.c
+
+./bin/bench "$@"
@@ -1,11 +1,13 @@
 #!/bin/sh
 
-CFLAGS="-Wall -Wextra -ggdb"
+CFLAGS="-Wall -Wextra -ggdb -pthread"
 
 set -xe;
 
 mkdir -p ./bin/
 
 clang $CFLAGS -o ./bin/tests ./tests.c -lunity
+clang $CFLAGS -DBENCODE_STATS -o ./bin/tests-stats ./tests.c -lunity
 
 ./bin/tests
+./bin/tests-stats
@@ -1,11 +1,24 @@
 #ifndef PARSER_H
 #define PARSER_H
 
+// BENCODE_STATS also turns on the hash table counters, so it has to be
+// defined before stb_hashtable.h is first included.
+#ifdef BENCODE_STATS
+#if defined(HASH_TABLE_H) && !defined(HASH_TABLE_STATS)
+#error "define BENCODE_STATS before including stb_hashtable.h"
+#endif
+#define HASH_TABLE_STATS
+#endif
+
 #include "stb_hashtable.h"
+#include <netinet/in.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 typedef enum BencodeKind {
   BYTESTRING,
@@ -15,9 +28,12 @@ typedef enum BencodeKind {
   ERROR,
 } BencodeKind;
 
+// Lengths are 32 bits so a list fits in a node next to its kind.
+#define BENCODE_MAX_LIST_LEN UINT32_MAX
+
 typedef struct BencodeList {
-  size_t len;
-  size_t cap;
+  uint32_t len;
+  uint32_t cap;
   struct BencodeType *values;
 } BencodeList;
 
@@ -26,17 +42,50 @@ typedef struct BencodeString {
   char *str;
 } BencodeString;
 
+// Dictionaries are a flat array of entries kept in key order, which is the
+// order canonical bencode already arrives in. Small dicts are searched
+// linearly, larger ones with a binary search, and only dicts with at least
+// BENCODE_DICT_INDEX_THRESHOLD keys get a hash index, which is kept up to
+// date as keys are added. Keys added out of order stay after the sorted
+// ones until bencode_dict_sort, which the parser calls when a dict is
+// complete and the encoders call before writing one. Lookups never sort or
+// index, so they only read and may run on several threads. Walking
+// entries[0..len) of a sorted dict visits the keys in order.
+typedef struct BencodeDict {
+  size_t len;
+  size_t cap;
+  struct BencodeDictEntry *entries;
+  // entries[0..sorted_len) are in key order, the rest were added after.
+  size_t sorted_len;
+  // Some keys were not interned, see bencode_dict_get_interned.
+  bool mixed_keys;
+  hash_table_t *index;
+  struct BencodeArena *arena;
+  // Set when the dict was parsed with an interner, which owns its keys.
+  struct BencodeInterner *interner;
+  // Info dicts parsed with BENCODE_HASH_INFO_DICT, see bencode_sha1_digest.
+  bool has_sha1_digest;
+  unsigned char sha1_digest[20];
+} BencodeDict;
+
+// A node is its kind and a 16 byte payload, 24 bytes in all, so lists of
+// scalars stay dense. Dicts live behind a pointer, allocated with the
+// tree, and keep their bookkeeping out of every node.
 typedef struct BencodeType {
   BencodeKind kind;
-  unsigned char sha1_digest[20];
   union {
     BencodeString asString;
     long asInt;
     BencodeList asList;
-    hash_table_t asDict;
+    BencodeDict *asDict;
   };
 } BencodeType;
 
+typedef struct BencodeDictEntry {
+  BencodeString key;
+  BencodeType value;
+} BencodeDictEntry;
+
 typedef enum {
   LIST_START,
   DICT_START,
@@ -53,14 +102,38 @@ typedef enum {
 typedef struct {
   TokenType type;
   size_t pos;
+  size_t len;
   union {
     char *asString;
     long asInt;
   };
 } Token;
 
+#ifndef BENCODE_INDEX_BLOCKS
+#define BENCODE_INDEX_BLOCKS 64
+#endif
+
+// Bitmaps over a window of the input, one bit per byte: digits marks
+// '0'-'9' and structural marks the bytes that can open or close a value
+// ('d', 'l', 'i', 'e', ':'). They are filled 64 bytes at a time with
+// SSE2/AVX2 where available. Scanners only consult them outside string
+// payloads, which are skipped by their length prefix and never indexed.
+typedef struct {
+  size_t start;
+  size_t end;
+  uint64_t digits[BENCODE_INDEX_BLOCKS];
+  uint64_t structural[BENCODE_INDEX_BLOCKS];
+} BencodeIndex;
+
+typedef enum {
+  LEXER_BUFFER_BORROWED,
+  LEXER_BUFFER_HEAP,
+  LEXER_BUFFER_MMAP,
+} LexerBufferKind;
+
 typedef struct {
   FILE *input;
+  LexerBufferKind storage;
   char *buf;
   size_t bufsize;
   size_t pos;
@@ -68,328 +141,4731 @@ typedef struct {
   char ch;
   Token prevprev;
   Token prev;
+  // Integers and length prefixes end at the next structural byte, which is
+  // looked up here instead of testing their digits one at a time.
+  BencodeIndex idx;
 } Lexer;
 
+typedef struct BencodeArenaBlock {
+  struct BencodeArenaBlock *next;
+  size_t used;
+  size_t cap;
+  _Alignas(16) unsigned char data[];
+} BencodeArenaBlock;
+
+// Bump allocator that owns every node, list array, dict table and string of
+// the documents parsed into it. Blocks are kept across arena_reset, so a
+// long-running parser stops touching malloc once it has warmed up.
+typedef struct BencodeArena {
+  BencodeArenaBlock *head;
+  BencodeArenaBlock *current;
+  size_t block_size;
+} BencodeArena;
+
+// Dictionary keys stored once per distinct key, each next to its hash.
+// Dicts parsed with an interner share its copies, so a lookup with an
+// interned key compares pointers and reuses the hash. A frozen interner is
+// only read from, so parsers on several threads can share it.
+typedef struct BencodeInterner {
+  hash_table_t table;
+  BencodeArena arena;
+  bool frozen;
+} BencodeInterner;
+
+typedef struct {
+  uint32_t state[5];
+  uint64_t len;
+  unsigned char block[64];
+  size_t used;
+} BencodeSha1;
+
+typedef struct {
+  uint32_t state[8];
+  uint64_t len;
+  unsigned char block[64];
+  size_t used;
+} BencodeSha256;
+
+#define BENCODE_SPAN_SHA1 (1u << 0)
+#define BENCODE_SPAN_SHA256 (1u << 1)
+
+// A key of the top-level dictionary whose raw value bytes should be located
+// and optionally hashed while parsing, e.g. "info" for the info-hash.
+typedef struct {
+  const char *key;
+  size_t key_len;
+  // BENCODE_SPAN_SHA1 and/or BENCODE_SPAN_SHA256.
+  unsigned hashes;
+  // Set once the value has been parsed: its bytes are [start, end) of the
+  // input, and the requested digests are filled in.
+  bool found;
+  size_t start;
+  size_t end;
+  unsigned char sha1[20];
+  unsigned char sha256[32];
+  // Running digests while the value streams through a PushParser.
+  BencodeSha1 sha1_ctx;
+  BencodeSha256 sha256_ctx;
+} BencodeSpan;
+
+typedef enum {
+  BENCODE_OK,
+  BENCODE_ERR_UNEXPECTED_TOKEN,
+  BENCODE_ERR_BAD_INTEGER,
+  BENCODE_ERR_BAD_STRING,
+  BENCODE_ERR_UNTERMINATED,
+  BENCODE_ERR_KEY_NOT_STRING,
+  // Limit violations, see BencodeLimits. These always stop the parse.
+  BENCODE_ERR_DEPTH_LIMIT,
+  BENCODE_ERR_STRING_LIMIT,
+  BENCODE_ERR_ELEMENT_LIMIT,
+  BENCODE_ERR_ALLOC_LIMIT,
+  // An allocation for the tree failed. Also always stops the parse.
+  BENCODE_ERR_OUT_OF_MEMORY,
+} BencodeErrorCode;
+
+// The first error of a parse and the input offset it was detected at.
+typedef struct {
+  BencodeErrorCode code;
+  size_t offset;
+} BencodeError;
+
+// Caps for untrusted input, 0 leaves a limit off, except for max_string_len
+// where 0 means BENCODE_MAX_STRING_LEN. max_elements counts every value
+// including dictionary keys, and max_alloc_bytes covers the string copies
+// and list and dictionary arrays of the parse tree. A list longer than
+// BENCODE_MAX_LIST_LEN fails with BENCODE_ERR_ELEMENT_LIMIT regardless.
+typedef struct {
+  size_t max_depth;
+  size_t max_string_len;
+  size_t max_elements;
+  size_t max_alloc_bytes;
+} BencodeLimits;
+
+#ifdef BENCODE_STATS
+// Where a parse went, kept only when built with BENCODE_STATS. tokens is
+// indexed by TokenType. Cycles are timestamp counter ticks where the CPU
+// has one and nanoseconds elsewhere; build_cycles is the time top-level
+// parse_item calls spent outside the lexer.
+typedef struct {
+  size_t tokens[ILLEGAL + 1];
+  size_t bytes_copied;
+  size_t allocations;
+  size_t bytes_allocated;
+  size_t max_depth;
+  uint64_t lex_cycles;
+  uint64_t build_cycles;
+} BencodeStats;
+#endif
+
 typedef struct {
   Lexer l;
   Token cur_token;
   Token peek_token;
+  // When set, parsed BencodeStrings point straight into the lexer buffer
+  // instead of owning a copy, so they are only valid while the buffer is.
+  bool zero_copy;
+  // When set, the whole parse tree is allocated from this arena instead of
+  // the heap and is released with arena_reset or free_arena.
+  BencodeArena *arena;
+  // Keys of the top-level dictionary to locate and hash, see BencodeSpan.
+  BencodeSpan *spans;
+  size_t spans_len;
+  // When set, dictionary keys are interned here instead of copied. Keys a
+  // frozen interner does not know are copied as usual.
+  BencodeInterner *interner;
+  // When set, the parse stops at the first error and only reports it in
+  // error: no message is formatted or allocated and the partial tree is
+  // released, so the returned value has kind ERROR.
+  bool fail_fast;
+  BencodeLimits limits;
+  BencodeError error;
+  size_t depth;
+  size_t elements;
+  size_t allocated;
+#ifdef BENCODE_STATS
+  BencodeStats stats;
+#endif
   char *errors[500];
   size_t error_index;
 } Parser;
 
+typedef enum {
+  BENCODE_NEED_MORE,
+  BENCODE_VALUE_READY,
+  BENCODE_ERROR,
+} BencodeFeedResult;
+
+typedef enum {
+  PUSH_VALUE,
+  PUSH_INT,
+  PUSH_STRING_SIZE,
+  PUSH_STRING,
+  PUSH_FAILED,
+} PushState;
+
+typedef struct {
+  BencodeType value;
+  BencodeString key;
+  bool has_key;
+} PushFrame;
+
+typedef struct {
+  size_t len;
+  size_t cap;
+  PushFrame *values;
+} PushStack;
+
+// Incremental parser for input that arrives in chunks. All state needed to
+// resume in the middle of an integer, a length prefix or a string payload
+// lives here, so chunks can be fed as they come off the socket.
+typedef struct {
+  PushState state;
+  unsigned long num;
+  bool negative;
+  size_t digits;
+  BencodeString str;
+  size_t str_read;
+  PushStack stack;
+  BencodeArena *arena;
+  // The last complete top-level value, valid after BENCODE_VALUE_READY.
+  BencodeType value;
+  // Bytes of the last chunk consumed by the last call to bencode_feed. When
+  // a value completes mid-chunk, the rest belongs to the next message.
+  size_t consumed;
+  // Total bytes consumed since the parser was created.
+  size_t offset;
+  // Keys of the top-level dictionary to locate and hash, see BencodeSpan.
+  // The value being streamed is hashed from span_from in each chunk.
+  BencodeSpan *spans;
+  size_t spans_len;
+  BencodeSpan *span;
+  size_t span_from;
+  // Checked as bytes arrive, so an oversized string is refused before its
+  // buffer is allocated. error says why BENCODE_ERROR was returned.
+  BencodeLimits limits;
+  BencodeError error;
+  size_t elements;
+  size_t allocated;
+} PushParser;
+
+typedef enum {
+  DECIMAL_OK,
+  DECIMAL_EMPTY,
+  DECIMAL_INVALID,
+  DECIMAL_LEADING_ZERO,
+  DECIMAL_OVERFLOW,
+} DecimalStatus;
+
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+} BencodeBuffer;
+
+// Scatter-gather encoding: structure and short strings are written into one
+// scratch buffer, while string payloads of at least BENCODE_IOV_MIN_STRING
+// bytes are referenced in place, ready for writev.
+typedef struct {
+  struct iovec *iov;
+  size_t iovcnt;
+  size_t iovcap;
+  char *scratch;
+  size_t len;
+} BencodeIov;
+
+typedef struct {
+  // Worker threads to parse with; 0 uses one per online CPU.
+  size_t threads;
+  bool zero_copy;
+  // Applied to each record on its own.
+  BencodeLimits limits;
+} BencodeParallelOptions;
+
+typedef struct {
+  const char *path;
+  bool ok;
+  // Why the file failed, when ok is false.
+  char error[128];
+  size_t bytes;
+  // The parsed document. Only kept when BencodeBatchOptions.keep_values is
+  // set; otherwise it is only valid inside on_file.
+  BencodeType value;
+} BencodeBatchResult;
+
+typedef struct {
+  // Worker threads to parse with; 0 uses one per online CPU.
+  size_t threads;
+  bool keep_values;
+  // Applied to each file on its own.
+  BencodeLimits limits;
+  // Called from a worker thread as soon as each file has been parsed.
+  void (*on_file)(void *ctx, BencodeBatchResult *result);
+  void *ctx;
+} BencodeBatchOptions;
+
+// Event callbacks for parse_events. Every callback is optional and returns
+// false to stop the parse early. Strings are views into the lexer buffer.
+typedef struct {
+  void *ctx;
+  bool (*on_int)(void *ctx, long value);
+  bool (*on_string)(void *ctx, BencodeString value);
+  bool (*on_list_begin)(void *ctx);
+  bool (*on_list_end)(void *ctx);
+  bool (*on_dict_begin)(void *ctx);
+  bool (*on_dict_end)(void *ctx);
+  bool (*on_key)(void *ctx, BencodeString key);
+} BencodeCallbacks;
+
+// A tape is a flat, read-only index of a document: one fixed-size entry per
+// value, in document order. Containers record how many children they have
+// and the index just past their subtree, so skipping a value is a single
+// jump. Strings and integers are not copied; string entries point at their
+// payload in the original buffer.
+typedef struct {
+  uint32_t kind;
+  uint32_t next;
+  size_t offset;
+  union {
+    size_t len;
+    long asInt;
+  };
+} BencodeTapeEntry;
+
+typedef struct {
+  const char *buf;
+  size_t bufsize;
+  BencodeTapeEntry *entries;
+  size_t len;
+  size_t cap;
+} BencodeTape;
+
+// Position on a tape. end is the index just past the enclosing container,
+// so a cursor that has walked off its parent is no longer valid.
+typedef struct {
+  const BencodeTape *tape;
+  size_t index;
+  size_t end;
+} BencodeCursor;
+
+// One value found by a path query: its encoded bytes are buf[start, end),
+// and scalars are decoded in place. Strings are views into the buffer.
+typedef struct {
+  BencodeKind kind;
+  size_t start;
+  size_t end;
+  union {
+    BencodeString asString;
+    long asInt;
+  };
+} BencodeMatch;
+
+// A path such as "info/piece length" or "announce-list/0/0": dictionary
+// keys and list indices separated by '/'. The empty path is the root.
+typedef struct {
+  const char *path;
+  bool found;
+  BencodeMatch match;
+  // Used while querying: segments in path, and how many of them the walk
+  // currently matches.
+  size_t segments;
+  size_t matched;
+} BencodeQuery;
+
+// A tracker announce response. Peers are written into the caller's peers
+// and peers6 arrays, which hold peers_cap and peers6_cap entries. Peers that
+// do not fit, and dict-form peers whose ip is a hostname, are only counted
+// in dropped. Integers the tracker left out are -1, and strings are views
+// into the response.
+typedef struct {
+  struct sockaddr_in *peers;
+  size_t peers_cap;
+  size_t peers_len;
+  struct sockaddr_in6 *peers6;
+  size_t peers6_cap;
+  size_t peers6_len;
+  size_t dropped;
+  long interval;
+  long min_interval;
+  long complete;
+  long incomplete;
+  BencodeString failure_reason;
+  BencodeString warning_message;
+  BencodeString tracker_id;
+} BencodeAnnounce;
+
+typedef struct {
+  char *path;
+  uint64_t length;
+  // Where the file starts in the torrent's concatenated data.
+  uint64_t offset;
+} BencodeTorrentFile;
+
+// The parts of an info dict needed to check data on disk. pieces points at
+// pieces_len 20-byte SHA-1 digests inside the parsed info dict, which must
+// outlive this. Files are in torrent order, single-file torrents have one.
+typedef struct {
+  const unsigned char *pieces;
+  size_t pieces_len;
+  uint64_t piece_length;
+  uint64_t total_length;
+  BencodeTorrentFile *files;
+  size_t files_len;
+} BencodeTorrent;
+
+typedef struct {
+  // Worker threads to hash with; 0 uses one per online CPU.
+  size_t threads;
+  // Called from a worker thread as soon as each piece has been checked.
+  void (*on_piece)(void *ctx, size_t piece, bool ok);
+  void *ctx;
+} BencodeVerifyOptions;
+
+typedef struct {
+  size_t pieces_ok;
+  // Bytes read and hashed; data missing on disk is not counted.
+  uint64_t bytes;
+  double seconds;
+  double mb_per_s;
+} BencodeVerifyStats;
+
 void open_stream(Lexer *l, const char *filename);
 Token next_token(Lexer *l);
 BencodeType parse_item(Parser *p);
+BencodeList parse(Parser *p);
+DecimalStatus decimal_decode(const char *s, size_t n, bool allow_negative,
+                             long *out);
+bool parse_events(Parser *p, const BencodeCallbacks *cb);
 void parser_next_token(Parser *p);
 Parser new_parser(Lexer l);
-bool expect_peek(Parser *p, TokenType expected);
 void parse_error(Parser *p, char *error);
+const char *bencode_error_string(BencodeErrorCode code);
 Lexer new_lexer(char *filename);
+Lexer new_lexer_mmap(const char *filename);
+Lexer new_lexer_from_buffer(const char *buf, size_t len);
+void free_lexer(Lexer *l);
+char *bencode_string_dup(BencodeString s);
+PushParser new_push_parser(void);
+BencodeFeedResult bencode_feed(PushParser *p, const char *chunk, size_t len);
+void free_push_parser(PushParser *p);
+BencodeArena new_arena(size_t block_size);
+void *arena_alloc(BencodeArena *a, size_t size);
+void arena_reset(BencodeArena *a);
+void free_arena(BencodeArena *a);
+void bencode_free(BencodeType *t, bool owns_strings);
+BencodeType *bencode_dict_get(BencodeDict *d, const char *key, size_t len);
+BencodeType *bencode_dict_get_interned(BencodeDict *d, BencodeString key);
+const unsigned char *bencode_sha1_digest(const BencodeType *t);
+BencodeInterner new_interner(void);
+void free_interner(BencodeInterner *in);
+BencodeString interner_intern(BencodeInterner *in, const char *key,
+                              size_t len);
+BencodeString interner_find(BencodeInterner *in, const char *key, size_t len);
+void interner_freeze(BencodeInterner *in);
+void bencode_dict_sort(BencodeDict *d);
+bool bencode_dict_init(BencodeArena *a, BencodeType *dict);
+bool bencode_dict_insert(BencodeArena *a, BencodeType *dict,
+                         BencodeString key, BencodeType value);
+bool bencode_list_append(BencodeArena *a, BencodeList *list,
+                         BencodeType value);
+BencodeType bencode_int(long value);
+BencodeType bencode_str(const char *str, size_t len);
+BencodeType bencode_list(void);
+BencodeType bencode_dict(BencodeArena *a);
+bool bencode_dict_set(BencodeType *dict, const char *key, size_t len,
+                      BencodeType value);
+size_t bencode_encoded_size(BencodeType *t);
+size_t bencode_encode(BencodeType *t, char *out);
+bool bencode_encode_buffer(BencodeBuffer *b, BencodeType *t);
+void free_buffer(BencodeBuffer *b);
+bool bencode_encode_iov(BencodeIov *v, BencodeType *t);
+void free_iov(BencodeIov *v);
+void index_window(BencodeIndex *idx, const char *buf, size_t len,
+                  size_t pos);
+size_t index_digits_end(BencodeIndex *idx, const char *buf, size_t len,
+                        size_t pos);
+size_t index_next_structural(BencodeIndex *idx, const char *buf, size_t len,
+                             size_t pos);
+bool index_is_structural(BencodeIndex *idx, const char *buf, size_t len,
+                         size_t pos);
+bool bencode_skip(const char *buf, size_t len, size_t *pos);
+bool parse_parallel(const char *buf, size_t len, BencodeParallelOptions opts,
+                    BencodeList *out);
+size_t parse_batch(const char *const *paths, size_t n, BencodeBatchOptions opts,
+                   BencodeBatchResult *results);
+bool lexer_map_file(Lexer *l, const char *filename);
+bool tape_build(BencodeTape *t, const char *buf, size_t len);
+void free_tape(BencodeTape *t);
+BencodeCursor tape_root(const BencodeTape *t);
+bool tape_valid(BencodeCursor c);
+BencodeKind tape_kind(BencodeCursor c);
+BencodeCursor tape_child(BencodeCursor c);
+BencodeCursor tape_next_sibling(BencodeCursor c);
+BencodeCursor tape_find_key(BencodeCursor dict, const char *key, size_t len);
+long tape_as_int(BencodeCursor c);
+BencodeString tape_as_string(BencodeCursor c);
+size_t bencode_query(const char *buf, size_t len, BencodeQuery *q, size_t n);
+bool bencode_get(const char *buf, size_t len, const char *path,
+                 BencodeMatch *out);
+bool bencode_decode_announce(const char *buf, size_t len, BencodeAnnounce *a);
+bool torrent_from_info(BencodeType *info, const char *root, BencodeTorrent *t);
+void free_torrent(BencodeTorrent *t);
+const unsigned char *torrent_piece_hash(const BencodeTorrent *t, size_t piece);
+size_t torrent_file_at(const BencodeTorrent *t, uint64_t offset);
+size_t torrent_verify(const BencodeTorrent *t, BencodeVerifyOptions opts,
+                      bool *piece_ok, BencodeVerifyStats *stats);
+void sha1_init(BencodeSha1 *c);
+void sha1_update(BencodeSha1 *c, const void *data, size_t len);
+void sha1_final(BencodeSha1 *c, unsigned char out[20]);
+void bencode_sha1(const void *data, size_t len, unsigned char out[20]);
+void sha256_init(BencodeSha256 *c);
+void sha256_update(BencodeSha256 *c, const void *data, size_t len);
+void sha256_final(BencodeSha256 *c, unsigned char out[32]);
+void bencode_sha256(const void *data, size_t len, unsigned char out[32]);
+bool skip_value(BencodeIndex *idx, const char *buf, size_t len, size_t *pos);
+bool raw_string(BencodeIndex *idx, const char *buf, size_t len, size_t *pos,
+                BencodeString *out);
+bool raw_int(BencodeIndex *idx, const char *buf, size_t len, size_t *pos,
+             long *out);
+bool raw_span(BencodeIndex *idx, const char *buf, size_t len, size_t *pos,
+              BencodeString *out);
+#ifdef BENCODE_STATS
+uint64_t bencode_cycles(void);
+void bencode_stats_print(FILE *f, const BencodeStats *s);
+void bencode_hash_stats_add(hash_table_stats_t *total,
+                            const hash_table_stats_t *s);
+void bencode_hash_stats_print(FILE *f, const hash_table_stats_t *s);
+#endif
+
+// Schema decoders fill a plain struct straight from the raw bytes of a
+// dict, for message shapes known at compile time. A schema is an X-macro
+// of X(kind, field, key) entries, where kind is one of
+//
+//   INT     a long
+//   STRING  a view of a bytestring
+//   RAW     a view of the whole encoded value, to decode with another
+//           schema, walk with bencode_query or hash
+//
+// BENCODE_SCHEMA(Name, FIELDS) defines the struct Name and
+// Name_decode(buf, len, &out). The decoder does not allocate: keys are
+// matched against the literals, unknown keys are jumped over using their
+// length prefixes, and out.has.field is set for every key found. It returns
+// false if the dict is malformed or a known key holds the wrong kind.
+//
+//   #define PEER_FIELDS(X) X(STRING, ip, "ip") X(INT, port, "port")
+//   BENCODE_SCHEMA(Peer, PEER_FIELDS)
+//
+//   Peer peer;
+//   if (Peer_decode(buf, len, &peer) && peer.has.port) { ... }
+#define BENCODE_SCHEMA_CTYPE_INT long
+#define BENCODE_SCHEMA_CTYPE_STRING BencodeString
+#define BENCODE_SCHEMA_CTYPE_RAW BencodeString
+#define BENCODE_SCHEMA_READ_INT raw_int
+#define BENCODE_SCHEMA_READ_STRING raw_string
+#define BENCODE_SCHEMA_READ_RAW raw_span
+
+#define BENCODE_SCHEMA_MEMBER(kind, field, key)                               \
+  BENCODE_SCHEMA_CTYPE_##kind field;
+#define BENCODE_SCHEMA_HAS(kind, field, key) unsigned field : 1;
+
+// Keys are literals, so the length test and the memcmp both have constant
+// sizes and compile down to an integer compare and a few word loads.
+#define BENCODE_SCHEMA_MATCH(kind, field, key)                                \
+  else if (key_.len == sizeof(key) - 1 &&                                     \
+           memcmp(key_.str, key, sizeof(key) - 1) == 0) {                     \
+    ok_ = BENCODE_SCHEMA_READ_##kind(&idx_, buf, len, &i_, &out->field);      \
+    out->has.field = 1;                                                       \
+  }
+
+#define BENCODE_SCHEMA(Name, FIELDS)                                          \
+  typedef struct Name {                                                       \
+    FIELDS(BENCODE_SCHEMA_MEMBER)                                             \
+    struct {                                                                  \
+      FIELDS(BENCODE_SCHEMA_HAS)                                              \
+    } has;                                                                    \
+  } Name;                                                                     \
+                                                                              \
+  static inline bool Name##_decode(const char *buf, size_t len, Name *out) { \
+    *out = (Name){0};                                                         \
+    if (len == 0 || buf[0] != 'd') {                                          \
+      return false;                                                           \
+    }                                                                         \
+                                                                              \
+    BencodeIndex idx_;                                                        \
+    idx_.start = idx_.end = 0;                                                \
+    size_t i_ = 1;                                                            \
+    while (i_ < len && buf[i_] != 'e') {                                      \
+      BencodeString key_;                                                     \
+      bool ok_;                                                               \
+      if (!raw_string(&idx_, buf, len, &i_, &key_)) {                         \
+        return false;                                                         \
+      }                                                                       \
+                                                                              \
+      if (0) {                                                                \
+      }                                                                       \
+      FIELDS(BENCODE_SCHEMA_MATCH)                                            \
+      else {                                                                  \
+        ok_ = skip_value(&idx_, buf, len, &i_);                               \
+      }                                                                       \
+      if (!ok_) {                                                             \
+        return false;                                                         \
+      }                                                                       \
+    }                                                                         \
+                                                                              \
+    return i_ < len;                                                          \
+  }
 
 #endif // PARSER_H
 
 #ifdef BENCODE_IMPLEMENTATION
 #undef BENCODE_IMPLEMENTATION
 
-#ifndef BENCODE_GET_SHA1
-#define BENCODE_GET_SHA1(a, b, c) ""
-#endif
-
+#include <arpa/inet.h>
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(BENCODE_STATS) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
 
 #define HASH_TABLE_IMPLEMENTATION
 #include "stb_hashtable.h"
 
+#ifndef BENCODE_MALLOC
+#define BENCODE_MALLOC(size) malloc(size)
+#endif
+
+#ifndef BENCODE_REALLOC
+#define BENCODE_REALLOC(ptr, size) realloc(ptr, size)
+#endif
+
+#ifndef BENCODE_FREE
+#define BENCODE_FREE(ptr) free(ptr)
+#endif
+
+#ifndef BENCODE_ARENA_BLOCK_SIZE
+#define BENCODE_ARENA_BLOCK_SIZE (64 * 1024)
+#endif
+
+#ifndef BENCODE_DICT_LINEAR_MAX
+#define BENCODE_DICT_LINEAR_MAX 8
+#endif
+
+#ifndef BENCODE_DICT_INDEX_THRESHOLD
+#define BENCODE_DICT_INDEX_THRESHOLD 64
+#endif
+
+#ifndef BENCODE_IOV_MIN_STRING
+#define BENCODE_IOV_MIN_STRING 256
+#endif
+
+// Longest string either parser accepts when BencodeLimits sets none, so a
+// length prefix from the network cannot ask for an arbitrary allocation.
+#ifndef BENCODE_MAX_STRING_LEN
+#define BENCODE_MAX_STRING_LEN (64 * 1024 * 1024)
+#endif
+
+#define BENCODE_ARENA_ALIGN 16
+
 #define da_init(da, size)                                                      \
   do {                                                                         \
-    da->cap = 16;                                                              \
-    da->values = calloc(da->cap, size);                                        \
+    da->values = BENCODE_MALLOC(16 * size);                                    \
+    da->cap = da->values ? 16 : 0;                                             \
     da->len = 0;                                                               \
   } while (0);
 
-#define da_append(da, value)                                                   \
-  do {                                                                         \
-    if (da->len == da->cap) {                                                  \
-      da->cap *= 2;                                                            \
-      da->values = realloc(da->values, da->cap * sizeof(da->values[0]));       \
-    }                                                                          \
-    da->values[da->len++] = value;                                             \
-  } while (0);
+// Doubles the array behind *values, which holds cap elements of size bytes.
+// On failure the array is left as it was.
+bool da_grow(void *values, size_t *cap, size_t size) {
+  void *old;
+  memcpy(&old, values, sizeof(old));
+  size_t new_cap = *cap ? *cap * 2 : 16;
+  if (new_cap > SIZE_MAX / size) {
+    return false;
+  }
 
-BencodeType parse_integer(Parser *p) {
-  BencodeType b;
-  if (!expect_peek(p, INT)) {
-    parse_error(p, "Integer initializer is not followed by an integer value");
+  void *grown = BENCODE_REALLOC(old, new_cap * size);
+  if (!grown) {
+    return false;
   }
 
-  b.kind = INTEGER;
-  b.asInt = p->cur_token.asInt;
+  memcpy(values, &grown, sizeof(grown));
+  *cap = new_cap;
+  return true;
+}
+
+// Evaluates to false if the array could not grow to take value.
+#define da_append(da, value)                                                   \
+  ((da->len < da->cap ||                                                       \
+    da_grow(&da->values, &da->cap, sizeof(da->values[0]))) &&                  \
+   (da->values[da->len++] = (value), true))
+
+BencodeArena new_arena(size_t block_size) {
+  BencodeArena a = {0};
+  a.block_size = block_size ? block_size : BENCODE_ARENA_BLOCK_SIZE;
+  return a;
+}
 
-  if (!expect_peek(p, END)) {
-    parse_error(p, "Unterminated int value");
+BencodeArenaBlock *arena_new_block(size_t cap) {
+  if (cap > SIZE_MAX - sizeof(BencodeArenaBlock)) {
+    return NULL;
   }
 
+  BencodeArenaBlock *b = BENCODE_MALLOC(sizeof(BencodeArenaBlock) + cap);
+  if (!b) {
+    return NULL;
+  }
+  b->next = NULL;
+  b->used = 0;
+  b->cap = cap;
   return b;
 }
 
-BencodeType parse_bytestring(Parser *p) {
-  assert(p->cur_token.type == STRING_SIZE);
-  BencodeType s = {0};
-
-  BencodeString str = {
-      .len = p->cur_token.asInt,
-  };
+// Returns NULL if a new block is needed and cannot be allocated.
+void *arena_alloc(BencodeArena *a, size_t size) {
+  size_t mask = BENCODE_ARENA_ALIGN - 1;
+  if (size > SIZE_MAX - mask) {
+    return NULL;
+  }
+  size = (size + mask) & ~mask;
 
-  if (!expect_peek(p, COLON)) {
-    return s;
+  BencodeArenaBlock *b = a->current;
+  while (b && b->cap - b->used < size) {
+    // Blocks after current are left over from before the last reset.
+    b = b->next;
+    if (b) {
+      b->used = 0;
+    }
   }
 
-  if (!expect_peek(p, STRING)) {
-    parse_error(p, "ERROR: A colon should be followed by a string\n");
-    return s;
+  if (!b) {
+    size_t cap = size > a->block_size ? size : a->block_size;
+    b = arena_new_block(cap);
+    if (!b) {
+      return NULL;
+    }
+    if (a->current) {
+      b->next = a->current->next;
+      a->current->next = b;
+    } else {
+      a->head = b;
+    }
   }
 
-  str.str = p->cur_token.asString;
-  s.asString = str;
+  a->current = b;
+  void *ptr = b->data + b->used;
+  b->used += size;
+  return ptr;
+}
 
-  return s;
+// Grows the most recent allocation in place when possible, which is the
+// common case for a list that is being appended to while it is parsed.
+void *arena_realloc(BencodeArena *a, void *ptr, size_t old_size,
+                    size_t new_size) {
+  BencodeArenaBlock *b = a->current;
+  size_t mask = BENCODE_ARENA_ALIGN - 1;
+  if (new_size > SIZE_MAX - mask) {
+    return NULL;
+  }
+  size_t old_aligned = (old_size + mask) & ~mask;
+  size_t new_aligned = (new_size + mask) & ~mask;
+  if (ptr && b && (unsigned char *)ptr + old_aligned == b->data + b->used) {
+    size_t offset = (unsigned char *)ptr - b->data;
+    if (offset + new_aligned <= b->cap) {
+      b->used = offset + new_aligned;
+      return ptr;
+    }
+  }
+
+  void *new_ptr = arena_alloc(a, new_size);
+  if (new_ptr && ptr) {
+    memcpy(new_ptr, ptr, old_size);
+  }
+  return new_ptr;
 }
 
-BencodeType parse_list(Parser *p) {
-  BencodeType l;
-  l.kind = LIST;
+void arena_reset(BencodeArena *a) {
+  a->current = a->head;
+  if (a->head) {
+    a->head->used = 0;
+  }
+}
 
-  BencodeList *lp = &l.asList;
-  da_init(lp, sizeof(BencodeType));
+void free_arena(BencodeArena *a) {
+  BencodeArenaBlock *b = a->head;
+  while (b) {
+    BencodeArenaBlock *next = b->next;
+    BENCODE_FREE(b);
+    b = next;
+  }
 
-  parser_next_token(p);
+  a->head = NULL;
+  a->current = NULL;
+}
 
-  while (p->cur_token.type != END) {
-    da_append(lp, parse_item(p));
-    parser_next_token(p);
+void *bencode_alloc(BencodeArena *a, size_t size) {
+  if (a) {
+    return arena_alloc(a, size);
   }
 
-  return l;
+  return BENCODE_MALLOC(size);
 }
 
-BencodeType parse_dict(Parser *p) {
-  BencodeType d;
-  d.kind = DICTIONARY;
-  hash_table_init(&d.asDict);
+void *bencode_realloc(BencodeArena *a, void *ptr, size_t old_size,
+                      size_t new_size) {
+  if (a) {
+    return arena_realloc(a, ptr, old_size, new_size);
+  }
 
-  parser_next_token(p);
-  while (p->cur_token.type != END) {
-    BencodeType key = parse_item(p);
-    if (key.kind != BYTESTRING) {
-      parse_error(p, "Dictionary key is not a string\n");
-      return d;
-    }
+  return BENCODE_REALLOC(ptr, new_size);
+}
 
-#ifdef BENCODE_HASH_INFO_DICT
-    bool parsing_info_dict = strcmp(key.asString.str, "info") == 0;
-    size_t start_pos = 0;
-    if (parsing_info_dict) {
-      assert(p->peek_token.type == DICT_START);
-      start_pos = p->peek_token.pos;
-    }
-#endif
+void *arena_hash_alloc(void *ctx, size_t size) {
+  return arena_alloc(ctx, size);
+}
 
-    parser_next_token(p);
-    BencodeType value = parse_item(p);
-    BencodeType *heap_value = malloc(sizeof(BencodeType));
-#ifdef BENCODE_HASH_INFO_DICT
-    if (parsing_info_dict) {
-      assert(p->cur_token.type == END);
-      unsigned char *digest =
-          BENCODE_GET_SHA1(p->l.buf, start_pos, p->cur_token.pos);
-      memcpy(value.sha1_digest, digest, 20);
-    }
-#endif
+// Bencode orders keys as raw byte strings.
+int bencode_key_compare(const char *a, size_t a_len, const char *b,
+                        size_t b_len) {
+  int cmp = memcmp(a, b, a_len < b_len ? a_len : b_len);
+  if (cmp != 0) {
+    return cmp;
+  }
 
-    *heap_value = value;
-    hash_table_insert(&d.asDict, key.asString.str, strlen(key.asString.str),
-                      heap_value);
+  return (a_len > b_len) - (a_len < b_len);
+}
 
-    parser_next_token(p);
+int bencode_entry_compare(const void *a, const void *b) {
+  const BencodeDictEntry *x = a;
+  const BencodeDictEntry *y = b;
+  return bencode_key_compare(x->key.str, x->key.len, y->key.str, y->key.len);
+}
+
+// Returns false, leaving dict an ERROR, if the header cannot be allocated.
+bool bencode_dict_init(BencodeArena *a, BencodeType *dict) {
+  dict->asDict = bencode_alloc(a, sizeof(BencodeDict));
+  if (!dict->asDict) {
+    dict->kind = ERROR;
+    return false;
   }
 
-  return d;
+  dict->kind = DICTIONARY;
+  *dict->asDict = (BencodeDict){
+      .arena = a,
+  };
+  return true;
 }
 
-BencodeType parse_item(Parser *p) {
-  switch (p->cur_token.type) {
-  case INT_START:
-    return parse_integer(p);
-  case LIST_START:
-    return parse_list(p);
-    break;
-  case DICT_START:
-    return parse_dict(p);
-    break;
-  case STRING_SIZE:
-    return parse_bytestring(p);
-  default:
-    parse_error(p, "unexpected token");
-    break;
+void bencode_dict_drop_index(BencodeDict *d) {
+  if (!d->index) {
+    return;
+  }
+
+  if (!d->arena) {
+    hash_table_free(d->index);
+    BENCODE_FREE(d->index);
   }
+  d->index = NULL;
+}
+
+// Capacity a full list or dict array grows to.
+size_t bencode_grown_cap(size_t cap) { return cap ? cap * 2 : 4; }
 
-  BencodeType e;
-  e.kind = ERROR;
+typedef struct {
+  size_t hash;
+  size_t len;
+  char str[];
+} BencodeInternedKey;
 
-  return e;
+BencodeInterner new_interner(void) {
+  BencodeInterner in = {
+      .arena = new_arena(0),
+  };
+  // Not incremental, so lookups never move entries and a frozen interner
+  // can be read from several threads. With stats built in, lookups only
+  // bump the table's atomic counters.
+  hash_table_init_ex(&in.table, (hash_options_t){
+                                    .hasher = wy_hash,
+                                    .comparer = memcmp_comparer,
+                                    .strategy = PROBE_LINEAR,
+                                    .size = 64,
+                                });
+  return in;
 }
 
-void open_stream(Lexer *l, const char *filename) {
-  FILE *f = fopen(filename, "r");
+void free_interner(BencodeInterner *in) {
+  hash_table_free(&in->table);
+  free_arena(&in->arena);
+}
 
-  if (!f) {
-    perror("ERROR: could not open file");
-    exit(EXIT_FAILURE);
-  }
+// Stops the interner from growing, e.g. once it holds the keys of a
+// representative document, so it can be shared between parsers.
+void interner_freeze(BencodeInterner *in) { in->frozen = true; }
 
-  fread(l->buf, l->bufsize, sizeof(char), f);
-  l->input = f;
+// The interned copy of key, or an empty string if it has none.
+BencodeString interner_find(BencodeInterner *in, const char *key, size_t len) {
+  BencodeInternedKey *k = hash_table_lookup(&in->table, key, len);
+  if (!k) {
+    return (BencodeString){0};
+  }
+  return (BencodeString){.len = k->len, .str = k->str};
 }
 
-Lexer new_lexer(char *filename) {
-  Lexer l;
-  l.pos = 0;
-  l.read_pos = 0;
+// The interned copy of key, added if new. Frozen interners only look up,
+// and a key that cannot be stored is not interned either.
+BencodeString interner_intern(BencodeInterner *in, const char *key,
+                              size_t len) {
+  size_t hash = wy_hash(&in->table, key, len);
+  BencodeInternedKey *k =
+      hash_table_lookup_with_hash(&in->table, hash, key, len);
+  if (!k && !in->frozen && len < SIZE_MAX - sizeof(BencodeInternedKey)) {
+    k = arena_alloc(&in->arena, sizeof(BencodeInternedKey) + len + 1);
+    if (k) {
+      k->hash = hash;
+      k->len = len;
+      memcpy(k->str, key, len);
+      k->str[len] = '\0';
+      if (!hash_table_insert_with_hash(&in->table, hash, k->str, len, k)) {
+        k = NULL;
+      }
+    }
+  }
 
-  struct stat st;
-  stat(filename, &st);
-  l.bufsize = st.st_size;
+  if (!k) {
+    return (BencodeString){0};
+  }
+  return (BencodeString){.len = k->len, .str = k->str};
+}
 
-  l.buf = calloc(l.bufsize, sizeof(char));
-  open_stream(&l, filename);
-  return l;
+size_t interned_hash(BencodeString key) {
+  return ((BencodeInternedKey *)(key.str - offsetof(BencodeInternedKey, str)))
+      ->hash;
 }
 
-void free_lexer(Lexer *l) { free(l->buf); }
+// The index maps each key to its entry's position plus one, which, unlike
+// a pointer, survives the entry array growing.
+bool bencode_dict_index_add(BencodeDict *d, size_t i) {
+  BencodeDictEntry *e = &d->entries[i];
+  void *position = (void *)(uintptr_t)(i + 1);
+  if (d->interner && !d->mixed_keys) {
+    return hash_table_insert_with_hash(d->index, interned_hash(e->key),
+                                       e->key.str, e->key.len, position);
+  }
+  return hash_table_insert(d->index, e->key.str, e->key.len, position);
+}
 
-void read_char(Lexer *l) {
-  l->ch = l->buf[l->read_pos];
-  l->pos = l->read_pos;
-  l->read_pos++;
+BencodeType *bencode_dict_index_entry(BencodeDict *d, void *position) {
+  return position ? &d->entries[(uintptr_t)position - 1].value : NULL;
 }
 
-char peek_char(Lexer *l) { return l->buf[l->read_pos]; }
+// Leaves d without an index if it cannot be allocated, and lookups fall
+// back to a binary search.
+void bencode_dict_build_index(BencodeDict *d) {
+  hash_options_t options = {
+      .hasher = wy_hash,
+      .comparer = memcmp_comparer,
+      .strategy = PROBE_LINEAR,
+      .used = d->len,
+  };
+  if (d->arena) {
+    options.allocator = arena_hash_alloc;
+    options.allocator_ctx = d->arena;
+  }
 
-Token next_token(Lexer *l) {
-  Token t = {0};
+  d->index = bencode_alloc(d->arena, sizeof(hash_table_t));
+  if (!d->index) {
+    return;
+  }
+  if (!hash_table_init_ex(d->index, options)) {
+    bencode_dict_drop_index(d);
+    return;
+  }
 
-  read_char(l);
+  for (size_t i = 0; i < d->len; i++) {
+    // The index was sized for every entry up front, so this cannot grow.
+    bencode_dict_index_add(d, i);
+  }
+}
 
-  switch (l->ch) {
-  case ':':
-    t.type = COLON;
+// Returns false, leaving the dict as it was, if its array or its index
+// cannot grow.
+bool bencode_dict_push(BencodeArena *a, BencodeType *dict, BencodeString key,
+                       BencodeType value) {
+  BencodeDict *d = dict->asDict;
+  if (d->len == d->cap) {
+    size_t cap = bencode_grown_cap(d->cap);
+    BencodeDictEntry *entries =
+        cap <= SIZE_MAX / sizeof(BencodeDictEntry)
+            ? bencode_realloc(a, d->entries,
+                              d->cap * sizeof(BencodeDictEntry),
+                              cap * sizeof(BencodeDictEntry))
+            : NULL;
+    if (!entries) {
+      return false;
+    }
+    d->entries = entries;
+    d->cap = cap;
+  }
+
+  size_t i = d->len;
+  d->entries[i] = (BencodeDictEntry){
+      .key = key,
+      .value = value,
+  };
+  if (d->index && !bencode_dict_index_add(d, i)) {
+    return false;
+  }
+
+  d->len++;
+  if (d->sorted_len == i &&
+      (i == 0 || bencode_key_compare(d->entries[i - 1].key.str,
+                                     d->entries[i - 1].key.len, key.str,
+                                     key.len) <= 0)) {
+    d->sorted_len++;
+  }
+  return true;
+}
+
+// Unlike the tree parser, which indexes a dict once it is complete, dicts
+// built by hand get their index as they reach the threshold. One that
+// cannot be allocated is tried again on the next insert.
+bool bencode_dict_insert(BencodeArena *a, BencodeType *dict,
+                         BencodeString key, BencodeType value) {
+  BencodeDict *d = dict->asDict;
+  // A key added by hand does not come from the interner.
+  d->mixed_keys |= d->interner != NULL;
+  if (!bencode_dict_push(a, dict, key, value)) {
+    return false;
+  }
+
+  if (d->len >= BENCODE_DICT_INDEX_THRESHOLD && !d->index) {
+    bencode_dict_build_index(d);
+  }
+  return true;
+}
+
+// Non-canonical input and hand-built dicts may add keys out of order; sort
+// once so iteration and encoding can rely on key order. Entries move, so an
+// index is rebuilt, and left off if that fails.
+void bencode_dict_sort(BencodeDict *d) {
+  if (d->sorted_len == d->len) {
+    return;
+  }
+
+  qsort(d->entries, d->len, sizeof(BencodeDictEntry), bencode_entry_compare);
+  d->sorted_len = d->len;
+  if (d->index) {
+    bencode_dict_drop_index(d);
+    bencode_dict_build_index(d);
+  }
+}
+
+// Called once a parsed dict is complete, so that lookups on a parsed tree
+// never have to sort or index it and only read. Returns false if the index
+// cannot be allocated.
+bool bencode_dict_finish(BencodeDict *d) {
+  bencode_dict_sort(d);
+  if (d->len >= BENCODE_DICT_INDEX_THRESHOLD && !d->index) {
+    bencode_dict_build_index(d);
+    return d->index != NULL;
+  }
+  return true;
+}
+
+// Only reads d, so lookups may run on several threads as long as nothing
+// adds keys meanwhile.
+BencodeType *bencode_dict_get(BencodeDict *d, const char *key, size_t len) {
+  if (d->len <= BENCODE_DICT_LINEAR_MAX) {
+    for (size_t i = 0; i < d->len; i++) {
+      BencodeDictEntry *e = &d->entries[i];
+      if (e->key.len == len && memcmp(e->key.str, key, len) == 0) {
+        return &e->value;
+      }
+    }
+    return NULL;
+  }
+
+  if (d->index) {
+    return bencode_dict_index_entry(d, hash_table_lookup(d->index, key, len));
+  }
+
+  size_t lo = 0;
+  size_t hi = d->sorted_len;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    BencodeDictEntry *e = &d->entries[mid];
+    int cmp = bencode_key_compare(e->key.str, e->key.len, key, len);
+    if (cmp == 0) {
+      return &e->value;
+    }
+    if (cmp < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  for (size_t i = d->sorted_len; i < d->len; i++) {
+    BencodeDictEntry *e = &d->entries[i];
+    if (e->key.len == len && memcmp(e->key.str, key, len) == 0) {
+      return &e->value;
+    }
+  }
+  return NULL;
+}
+
+// Looks up a key interned by the interner d was parsed with. Keys match by
+// pointer and the index reuses the hash stored with the key, so no key
+// bytes are compared or hashed. Dicts with keys from elsewhere fall back to
+// bencode_dict_get.
+BencodeType *bencode_dict_get_interned(BencodeDict *d, BencodeString key) {
+  if (!d->interner || d->mixed_keys) {
+    return key.str ? bencode_dict_get(d, key.str, key.len) : NULL;
+  }
+  // Only keys the interner has ever seen can be in the dict.
+  if (!key.str) {
+    return NULL;
+  }
+
+  if (d->index) {
+    return bencode_dict_index_entry(
+        d, hash_table_lookup_with_hash(d->index, interned_hash(key), key.str,
+                                       key.len));
+  }
+
+  for (size_t i = 0; i < d->len; i++) {
+    if (d->entries[i].key.str == key.str) {
+      return &d->entries[i].value;
+    }
+  }
+  return NULL;
+}
+
+// The SHA-1 of an info dict parsed with BENCODE_HASH_INFO_DICT, or NULL.
+const unsigned char *bencode_sha1_digest(const BencodeType *t) {
+  if (t->kind != DICTIONARY || !t->asDict->has_sha1_digest) {
+    return NULL;
+  }
+  return t->asDict->sha1_digest;
+}
+
+// Returns false, leaving the list as it was, if it already holds
+// BENCODE_MAX_LIST_LEN values or its array cannot grow.
+bool bencode_list_append(BencodeArena *a, BencodeList *list,
+                         BencodeType value) {
+  if (list->len == BENCODE_MAX_LIST_LEN) {
+    return false;
+  }
+  if (list->len == list->cap) {
+    size_t cap = bencode_grown_cap(list->cap);
+    if (cap > BENCODE_MAX_LIST_LEN) {
+      cap = BENCODE_MAX_LIST_LEN;
+    }
+    BencodeType *values = bencode_realloc(a, list->values,
+                                          list->cap * sizeof(BencodeType),
+                                          cap * sizeof(BencodeType));
+    if (!values) {
+      return false;
+    }
+    list->values = values;
+    list->cap = cap;
+  }
+
+  list->values[list->len++] = value;
+  return true;
+}
+
+// The copy's str is NULL if it cannot be allocated.
+BencodeString bencode_string_copy(BencodeArena *a, BencodeString s) {
+  BencodeString copy = {
+      .len = s.len,
+      .str = bencode_alloc(a, s.len + 1),
+  };
+  if (copy.str) {
+    memcpy(copy.str, s.str, s.len);
+    copy.str[s.len] = '\0';
+  }
+  return copy;
+}
+
+// Keys that came from the dict's interner belong to it.
+bool bencode_owns_key(BencodeDict *d, BencodeString key) {
+  if (!d->interner) {
+    return true;
+  }
+  return d->mixed_keys &&
+         interner_find(d->interner, key.str, key.len).str != key.str;
+}
+
+// Releases a heap-allocated tree. Trees parsed into an arena are released
+// with the arena instead. Pass owns_strings = false for trees parsed with
+// zero_copy, whose strings point into the lexer buffer.
+void bencode_free(BencodeType *t, bool owns_strings) {
+  switch (t->kind) {
+  case BYTESTRING:
+    if (owns_strings) {
+      BENCODE_FREE(t->asString.str);
+    }
+    break;
+  case LIST:
+    for (size_t i = 0; i < t->asList.len; i++) {
+      bencode_free(&t->asList.values[i], owns_strings);
+    }
+    BENCODE_FREE(t->asList.values);
+    break;
+  case DICTIONARY:
+    for (size_t i = 0; i < t->asDict->len; i++) {
+      BencodeDictEntry *e = &t->asDict->entries[i];
+      if (owns_strings && bencode_owns_key(t->asDict, e->key)) {
+        BENCODE_FREE(e->key.str);
+      }
+      bencode_free(&e->value, owns_strings);
+    }
+    bencode_dict_drop_index(t->asDict);
+    BENCODE_FREE(t->asDict->entries);
+    BENCODE_FREE(t->asDict);
+    break;
+  default:
+    break;
+  }
+
+  t->kind = ERROR;
+}
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define BENCODE_SWAR_DIGITS
+#endif
+
+#ifdef BENCODE_SWAR_DIGITS
+// True if all 8 bytes of the little-endian word are ASCII digits.
+bool swar_all_digits(uint64_t v) {
+  return ((v & 0xF0F0F0F0F0F0F0F0ULL) |
+          (((v + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4)) ==
+         0x3333333333333333ULL;
+}
+
+// Converts 8 ASCII digits to their value with three multiplies, combining
+// neighbouring digits, then pairs, then quads.
+uint64_t swar_eight_digits(uint64_t v) {
+  v = (v & 0x0F0F0F0F0F0F0F0FULL) * 2561 >> 8;
+  v = (v & 0x00FF00FF00FF00FFULL) * 6553601 >> 16;
+  return (v & 0x0000FFFF0000FFFFULL) * 42949672960001ULL >> 32;
+}
+#endif
+
+// Adds one digit to an accumulator, failing if the result would exceed
+// limit.
+bool decimal_push_digit(unsigned long *acc, unsigned digit,
+                        unsigned long limit) {
+  if (*acc > (limit - digit) / 10) {
+    return false;
+  }
+
+  *acc = *acc * 10 + digit;
+  return true;
+}
+
+// Decodes exactly n bytes as a canonical bencode integer: an optional '-'
+// (when allowed) followed by digits, with no leading zeros and no "-0".
+// Digits are accumulated in one pass, eight at a time where possible, and
+// values that do not fit in a long are rejected.
+DecimalStatus decimal_decode(const char *s, size_t n, bool allow_negative,
+                             long *out) {
+  bool negative = false;
+  if (n > 0 && s[0] == '-' && allow_negative) {
+    negative = true;
+    s++;
+    n--;
+  }
+
+  if (n == 0) {
+    return DECIMAL_EMPTY;
+  }
+
+  if (s[0] == '0' && (n > 1 || negative)) {
+    return DECIMAL_LEADING_ZERO;
+  }
+
+  // 19 digits always fit in 64 bits; the limit check below takes care of
+  // the ones that do not fit in a long.
+  if (n > 19) {
+    for (size_t i = 0; i < n; i++) {
+      if (!isdigit(s[i])) {
+        return DECIMAL_INVALID;
+      }
+    }
+    return DECIMAL_OVERFLOW;
+  }
+
+  uint64_t acc = 0;
+  size_t i = 0;
+#ifdef BENCODE_SWAR_DIGITS
+  for (; i + 8 <= n; i += 8) {
+    uint64_t chunk;
+    memcpy(&chunk, s + i, 8);
+    if (!swar_all_digits(chunk)) {
+      return DECIMAL_INVALID;
+    }
+    acc = acc * 100000000ULL + swar_eight_digits(chunk);
+  }
+#endif
+  for (; i < n; i++) {
+    unsigned digit = (unsigned char)s[i] - '0';
+    if (digit > 9) {
+      return DECIMAL_INVALID;
+    }
+    acc = acc * 10 + digit;
+  }
+
+  uint64_t limit = negative ? (uint64_t)LONG_MAX + 1 : (uint64_t)LONG_MAX;
+  if (acc > limit) {
+    return DECIMAL_OVERFLOW;
+  }
+
+  *out = negative ? (long)(0 - acc) : (long)acc;
+  return DECIMAL_OK;
+}
+
+// Records the first error of the parse. Limit errors replace a recorded
+// syntax error, since they always stop the parse. Only collects a message
+// when the parser is not in fail-fast mode.
+void parser_fail(Parser *p, BencodeErrorCode code, size_t offset,
+                 char *message) {
+  if (p->error.code == BENCODE_OK ||
+      (code >= BENCODE_ERR_DEPTH_LIMIT &&
+       p->error.code < BENCODE_ERR_DEPTH_LIMIT)) {
+    p->error = (BencodeError){code, offset};
+  }
+
+  if (!p->fail_fast) {
+    parse_error(p, message);
+  }
+}
+
+// True once the parse must unwind: any error in fail-fast mode, and limit
+// errors always.
+bool parser_stopped(Parser *p) {
+  return p->error.code != BENCODE_OK &&
+         (p->fail_fast || p->error.code >= BENCODE_ERR_DEPTH_LIMIT);
+}
+
+// Checks that the next token is expected and moves onto it. Otherwise
+// records one error, with message or a generic one if it is NULL, and
+// stays put.
+bool parser_expect(Parser *p, TokenType expected, BencodeErrorCode code,
+                   char *message) {
+  if (p->peek_token.type != expected) {
+    char err[100] = "";
+    if (!message && !p->fail_fast) {
+      sprintf(err, "ERROR: expected token %i", expected);
+    }
+    parser_fail(p, code, p->peek_token.pos, message ? message : err);
+    return false;
+  }
+
+  parser_next_token(p);
+  return true;
+}
+
+// Counts bytes the parse tree is about to take against max_alloc_bytes.
+bool parser_charge(Parser *p, size_t bytes) {
+  p->allocated += bytes;
+#ifdef BENCODE_STATS
+  p->stats.allocations++;
+  p->stats.bytes_allocated += bytes;
+#endif
+  if (p->limits.max_alloc_bytes && p->allocated > p->limits.max_alloc_bytes) {
+    parser_fail(p, BENCODE_ERR_ALLOC_LIMIT, p->cur_token.pos,
+                "Allocation limit exceeded");
+    return false;
+  }
+  return true;
+}
+
+bool parser_enter(Parser *p) {
+  p->depth++;
+#ifdef BENCODE_STATS
+  if (p->depth > p->stats.max_depth) {
+    p->stats.max_depth = p->depth;
+  }
+#endif
+  if (p->limits.max_depth && p->depth > p->limits.max_depth) {
+    parser_fail(p, BENCODE_ERR_DEPTH_LIMIT, p->cur_token.pos,
+                "Nesting depth limit exceeded");
+    return false;
+  }
+  return true;
+}
+
+bool parser_count_element(Parser *p) {
+  p->elements++;
+  if (p->limits.max_elements && p->elements > p->limits.max_elements) {
+    parser_fail(p, BENCODE_ERR_ELEMENT_LIMIT, p->cur_token.pos,
+                "Element limit exceeded");
+    return false;
+  }
+  return true;
+}
+
+// Strings longer than this are refused, with or without a caller limit.
+size_t bencode_string_limit(const BencodeLimits *limits) {
+  return limits->max_string_len ? limits->max_string_len
+                                : BENCODE_MAX_STRING_LEN;
+}
+
+bool parser_check_string(Parser *p, size_t len) {
+  if (len > bencode_string_limit(&p->limits)) {
+    parser_fail(p, BENCODE_ERR_STRING_LIMIT, p->cur_token.pos,
+                "String length limit exceeded");
+    return false;
+  }
+  return true;
+}
+
+void parser_out_of_memory(Parser *p) {
+  parser_fail(p, BENCODE_ERR_OUT_OF_MEMORY, p->cur_token.pos,
+              "Out of memory");
+}
+
+bool parser_list_append(Parser *p, BencodeList *list, BencodeType item) {
+  if (list->len == BENCODE_MAX_LIST_LEN) {
+    parser_fail(p, BENCODE_ERR_ELEMENT_LIMIT, p->cur_token.pos,
+                "List length limit exceeded");
+    return false;
+  }
+  if (!bencode_list_append(p->arena, list, item)) {
+    parser_out_of_memory(p);
+    return false;
+  }
+  return true;
+}
+
+// Arena trees are released with the arena, so only the kind changes here.
+void parser_discard(Parser *p, BencodeType *t) {
+  if (!p->arena) {
+    bencode_free(t, !p->zero_copy);
+  }
+  t->kind = ERROR;
+}
+
+BencodeType parse_integer(Parser *p) {
+  BencodeType b = {.kind = ERROR};
+  if (!parser_expect(p, INT, BENCODE_ERR_BAD_INTEGER,
+                     "Integer initializer is not followed by an integer "
+                     "value")) {
+    return b;
+  }
+
+  long value = p->cur_token.asInt;
+  if (!parser_expect(p, END, BENCODE_ERR_BAD_INTEGER,
+                     "Unterminated int value")) {
+    return b;
+  }
+
+  b.kind = INTEGER;
+  b.asInt = value;
+  return b;
+}
+
+// The current STRING token as a view or an owned copy, as configured.
+BencodeString parser_take_string(Parser *p) {
+  BencodeString view = {
+      .len = p->cur_token.len,
+      .str = p->cur_token.asString,
+  };
+
+  if (p->zero_copy) {
+    return view;
+  }
+  if (!parser_charge(p, view.len + 1)) {
+    return (BencodeString){.len = view.len};
+  }
+#ifdef BENCODE_STATS
+  p->stats.bytes_copied += view.len;
+#endif
+  BencodeString copy = bencode_string_copy(p->arena, view);
+  if (!copy.str) {
+    parser_out_of_memory(p);
+  }
+  return copy;
+}
+
+// An ERROR, with the error recorded, if the string is malformed or cannot
+// be stored.
+BencodeType parse_bytestring(Parser *p) {
+  assert(p->cur_token.type == STRING_SIZE);
+  BencodeType s = {.kind = ERROR};
+
+  if (!parser_check_string(p, p->cur_token.asInt) ||
+      !parser_expect(p, COLON, BENCODE_ERR_BAD_STRING, NULL) ||
+      !parser_expect(p, STRING, BENCODE_ERR_BAD_STRING,
+                     "ERROR: A colon should be followed by a string\n")) {
+    return s;
+  }
+
+  s.asString = parser_take_string(p);
+  if (s.asString.str) {
+    s.kind = BYTESTRING;
+  }
+  return s;
+}
+
+// Dictionary keys go through the parser's interner when it has one. Sets
+// *interned when the returned key belongs to the interner. Like
+// parse_bytestring, a key that fails is an ERROR.
+BencodeType parse_key(Parser *p, bool *interned) {
+  *interned = false;
+  if (!p->interner || p->cur_token.type != STRING_SIZE) {
+    return parse_item(p);
+  }
+
+  BencodeType key = {.kind = ERROR};
+  if (!parser_count_element(p) ||
+      !parser_check_string(p, p->cur_token.asInt) ||
+      !parser_expect(p, COLON, BENCODE_ERR_BAD_STRING, NULL) ||
+      !parser_expect(p, STRING, BENCODE_ERR_BAD_STRING, NULL)) {
+    return key;
+  }
+
+  key.asString = interner_intern(p->interner, p->cur_token.asString,
+                                 p->cur_token.len);
+  if (key.asString.str) {
+    *interned = true;
+  } else {
+    key.asString = parser_take_string(p);
+  }
+  if (key.asString.str) {
+    key.kind = BYTESTRING;
+  }
+  return key;
+}
+
+// A container stopped by an error is returned partially built; parse_item
+// releases it.
+BencodeType parse_list(Parser *p) {
+  BencodeType l;
+  l.kind = LIST;
+
+  l.asList = (BencodeList){0};
+
+  if (!parser_enter(p)) {
+    p->depth--;
+    return l;
+  }
+  parser_next_token(p);
+
+  while (p->cur_token.type != END) {
+    if (p->cur_token.type == END_OF_FILE) {
+      parser_fail(p, BENCODE_ERR_UNTERMINATED, p->cur_token.pos,
+                  "Unterminated list");
+      break;
+    }
+
+    BencodeType item = parse_item(p);
+    BencodeList *list = &l.asList;
+    if (!parser_stopped(p) && list->len == list->cap) {
+      parser_charge(p, (bencode_grown_cap(list->cap) - list->cap) *
+                           sizeof(BencodeType));
+    }
+    if (parser_stopped(p)) {
+      parser_discard(p, &item);
+      break;
+    }
+
+    if (!parser_list_append(p, list, item)) {
+      parser_discard(p, &item);
+      break;
+    }
+    parser_next_token(p);
+  }
+
+  p->depth--;
+  return l;
+}
+
+BencodeSpan *span_find(BencodeSpan *spans, size_t n, BencodeString key) {
+  for (size_t i = 0; i < n; i++) {
+    BencodeSpan *s = &spans[i];
+    if (!s->found && s->key_len == key.len &&
+        memcmp(s->key, key.str, key.len) == 0) {
+      return s;
+    }
+  }
+  return NULL;
+}
+
+void span_begin(BencodeSpan *s, size_t start) {
+  s->start = start;
+  if (s->hashes & BENCODE_SPAN_SHA1) {
+    sha1_init(&s->sha1_ctx);
+  }
+  if (s->hashes & BENCODE_SPAN_SHA256) {
+    sha256_init(&s->sha256_ctx);
+  }
+}
+
+void span_update(BencodeSpan *s, const char *data, size_t len) {
+  if (s->hashes & BENCODE_SPAN_SHA1) {
+    sha1_update(&s->sha1_ctx, data, len);
+  }
+  if (s->hashes & BENCODE_SPAN_SHA256) {
+    sha256_update(&s->sha256_ctx, data, len);
+  }
+}
+
+void span_end(BencodeSpan *s, size_t end) {
+  s->end = end;
+  s->found = true;
+  if (s->hashes & BENCODE_SPAN_SHA1) {
+    sha1_final(&s->sha1_ctx, s->sha1);
+  }
+  if (s->hashes & BENCODE_SPAN_SHA256) {
+    sha256_final(&s->sha256_ctx, s->sha256);
+  }
+}
+
+BencodeType parse_dict(Parser *p) {
+  BencodeType d;
+  if (!bencode_dict_init(p->arena, &d)) {
+    parser_out_of_memory(p);
+    return d;
+  }
+  d.asDict->interner = p->interner;
+
+  if (!parser_enter(p) || !parser_charge(p, sizeof(BencodeDict))) {
+    p->depth--;
+    return d;
+  }
+  parser_next_token(p);
+  while (p->cur_token.type != END) {
+    if (p->cur_token.type == END_OF_FILE) {
+      parser_fail(p, BENCODE_ERR_UNTERMINATED, p->cur_token.pos,
+                  "Unterminated dictionary");
+      break;
+    }
+
+    size_t key_pos = p->cur_token.pos;
+    bool interned;
+    BencodeType key = parse_key(p, &interned);
+    // A failed key has recorded its error and left no string to use.
+    if (parser_stopped(p) || key.kind == ERROR) {
+      parser_discard(p, &key);
+      break;
+    }
+    if (key.kind != BYTESTRING) {
+      parser_discard(p, &key);
+      parser_fail(p, BENCODE_ERR_KEY_NOT_STRING, key_pos,
+                  "Dictionary key is not a string\n");
+      break;
+    }
+
+    BencodeSpan *span = NULL;
+    if (p->depth == 1 && p->spans_len > 0) {
+      span = span_find(p->spans, p->spans_len, key.asString);
+    }
+
+#ifdef BENCODE_HASH_INFO_DICT
+    bool parsing_info_dict =
+        key.asString.len == 4 && memcmp(key.asString.str, "info", 4) == 0;
+    size_t start_pos = p->peek_token.pos;
+    if (parsing_info_dict && p->peek_token.type != DICT_START) {
+      parser_fail(p, BENCODE_ERR_UNEXPECTED_TOKEN, start_pos,
+                  "info is not a dictionary");
+      if (!interned) {
+        parser_discard(p, &key);
+      }
+      break;
+    }
+#endif
+
+    parser_next_token(p);
+    if (span) {
+      span_begin(span, p->cur_token.pos);
+    }
+    BencodeType value = parse_item(p);
+    BencodeDict *dict = d.asDict;
+    if (!parser_stopped(p) && dict->len == dict->cap) {
+      parser_charge(p, (bencode_grown_cap(dict->cap) - dict->cap) *
+                           sizeof(BencodeDictEntry));
+    }
+    if (parser_stopped(p)) {
+      if (!interned) {
+        parser_discard(p, &key);
+      }
+      parser_discard(p, &value);
+      break;
+    }
+
+    if (span && p->error.code == BENCODE_OK) {
+      // Input has no separators, so the value ends where the next token
+      // starts.
+      size_t end = p->peek_token.pos;
+      span_update(span, p->l.buf + span->start, end - span->start);
+      span_end(span, end);
+    }
+#ifdef BENCODE_HASH_INFO_DICT
+    // Without fail_fast, a malformed info dict is kept but not hashed.
+    if (parsing_info_dict && value.kind == DICTIONARY &&
+        p->cur_token.type == END) {
+      BencodeDict *info = value.asDict;
+#ifdef BENCODE_GET_SHA1
+      unsigned char *digest =
+          BENCODE_GET_SHA1(p->l.buf, start_pos, p->cur_token.pos);
+      memcpy(info->sha1_digest, digest, 20);
+#else
+      bencode_sha1(p->l.buf + start_pos, p->cur_token.pos + 1 - start_pos,
+                   info->sha1_digest);
+#endif
+      info->has_sha1_digest = true;
+    }
+#endif
+
+    d.asDict->mixed_keys |= p->interner && !interned;
+    if (!bencode_dict_push(p->arena, &d, key.asString, value)) {
+      parser_out_of_memory(p);
+      if (!interned) {
+        parser_discard(p, &key);
+      }
+      parser_discard(p, &value);
+      break;
+    }
+
+    parser_next_token(p);
+  }
+
+  if (parser_stopped(p)) {
+    bencode_dict_sort(d.asDict);
+  } else if (!bencode_dict_finish(d.asDict)) {
+    parser_out_of_memory(p);
+  }
+  p->depth--;
+  return d;
+}
+
+BencodeType parse_item(Parser *p) {
+  BencodeType item = {.kind = ERROR};
+  if (!parser_count_element(p)) {
+    return item;
+  }
+
+#ifdef BENCODE_STATS
+  bool top = p->depth == 0;
+  uint64_t start = top ? bencode_cycles() : 0;
+  uint64_t lexed = p->stats.lex_cycles;
+#endif
+
+  switch (p->cur_token.type) {
+  case INT_START:
+    item = parse_integer(p);
+    break;
+  case LIST_START:
+    item = parse_list(p);
+    break;
+  case DICT_START:
+    item = parse_dict(p);
+    break;
+  case STRING_SIZE:
+    item = parse_bytestring(p);
+    break;
+  default:
+    parser_fail(p, BENCODE_ERR_UNEXPECTED_TOKEN, p->cur_token.pos,
+                "unexpected token");
+    break;
+  }
+
+  if (parser_stopped(p)) {
+    parser_discard(p, &item);
+  }
+
+#ifdef BENCODE_STATS
+  if (top) {
+    p->stats.build_cycles +=
+        bencode_cycles() - start - (p->stats.lex_cycles - lexed);
+  }
+#endif
+
+  return item;
+}
+
+// Parses every top-level value up to the end of the input, e.g. an
+// append-only log of records. Stops at the first malformed value. Failure
+// is read from p->error rather than the message log, which stops growing
+// once full or when a message cannot be copied.
+BencodeList parse(Parser *p) {
+  BencodeList items = {0};
+
+  while (p->cur_token.type != END_OF_FILE) {
+    BencodeType item = parse_item(p);
+    if (item.kind == ERROR || p->error.code != BENCODE_OK) {
+      if (!p->arena) {
+        bencode_free(&item, !p->zero_copy);
+      }
+      break;
+    }
+
+    if (!parser_list_append(p, &items, item)) {
+      parser_discard(p, &item);
+      break;
+    }
+    parser_next_token(p);
+  }
+
+  return items;
+}
+
+bool events_string(Parser *p, BencodeString *out) {
+  if (!parser_check_string(p, p->cur_token.asInt)) {
+    return false;
+  }
+
+  if (!parser_expect(p, COLON, BENCODE_ERR_BAD_STRING, NULL)) {
+    return false;
+  }
+
+  if (!parser_expect(p, STRING, BENCODE_ERR_BAD_STRING, NULL)) {
+    return false;
+  }
+
+  out->len = p->cur_token.len;
+  out->str = p->cur_token.asString;
+  return true;
+}
+
+bool events_container_open(Parser *p) {
+  if (p->cur_token.type == END_OF_FILE || p->cur_token.type == ILLEGAL) {
+    parser_fail(p, BENCODE_ERR_UNTERMINATED, p->cur_token.pos,
+                "Unterminated container");
+    return false;
+  }
+
+  return true;
+}
+
+bool events_list(Parser *p, const BencodeCallbacks *cb) {
+  if (cb->on_list_begin && !cb->on_list_begin(cb->ctx)) {
+    return false;
+  }
+
+  parser_next_token(p);
+  while (p->cur_token.type != END) {
+    if (!events_container_open(p) || !parse_events(p, cb)) {
+      return false;
+    }
+    parser_next_token(p);
+  }
+
+  return !cb->on_list_end || cb->on_list_end(cb->ctx);
+}
+
+bool events_dict(Parser *p, const BencodeCallbacks *cb) {
+  BencodeString s;
+
+  if (cb->on_dict_begin && !cb->on_dict_begin(cb->ctx)) {
+    return false;
+  }
+
+  parser_next_token(p);
+  while (p->cur_token.type != END) {
+    if (!events_container_open(p)) {
+      return false;
+    }
+
+    if (p->cur_token.type != STRING_SIZE) {
+      parser_fail(p, BENCODE_ERR_KEY_NOT_STRING, p->cur_token.pos,
+                  "Dictionary key is not a string\n");
+      return false;
+    }
+
+    if (!parser_count_element(p) || !events_string(p, &s)) {
+      return false;
+    }
+
+    if (cb->on_key && !cb->on_key(cb->ctx, s)) {
+      return false;
+    }
+
+    parser_next_token(p);
+    if (!events_container_open(p) || !parse_events(p, cb)) {
+      return false;
+    }
+    parser_next_token(p);
+  }
+
+  return !cb->on_dict_end || cb->on_dict_end(cb->ctx);
+}
+
+// Walks one value from the token stream and reports it through cb without
+// building any nodes. Returns false if a callback stopped the parse or the
+// input is malformed; the latter also records a parser error.
+bool parse_events(Parser *p, const BencodeCallbacks *cb) {
+  BencodeString s;
+  bool ok;
+
+  if (!parser_count_element(p)) {
+    return false;
+  }
+
+  switch (p->cur_token.type) {
+  case INT_START: {
+    if (!parser_expect(p, INT, BENCODE_ERR_BAD_INTEGER, NULL)) {
+      return false;
+    }
+    long value = p->cur_token.asInt;
+    if (!parser_expect(p, END, BENCODE_ERR_BAD_INTEGER, NULL)) {
+      return false;
+    }
+    return !cb->on_int || cb->on_int(cb->ctx, value);
+  }
+  case STRING_SIZE:
+    if (!events_string(p, &s)) {
+      return false;
+    }
+    return !cb->on_string || cb->on_string(cb->ctx, s);
+  case LIST_START:
+    ok = parser_enter(p) && events_list(p, cb);
+    p->depth--;
+    return ok;
+  case DICT_START:
+    ok = parser_enter(p) && events_dict(p, cb);
+    p->depth--;
+    return ok;
+  default:
+    parser_fail(p, BENCODE_ERR_UNEXPECTED_TOKEN, p->cur_token.pos,
+                "unexpected token");
+    return false;
+  }
+}
+
+void open_stream(Lexer *l, const char *filename) {
+  FILE *f = fopen(filename, "r");
+
+  if (!f) {
+    perror("ERROR: could not open file");
+    exit(EXIT_FAILURE);
+  }
+
+  fread(l->buf, l->bufsize, sizeof(char), f);
+  l->input = f;
+}
+
+Lexer new_lexer(char *filename) {
+  Lexer l = {0};
+  l.storage = LEXER_BUFFER_HEAP;
+
+  struct stat st;
+  stat(filename, &st);
+  l.bufsize = st.st_size;
+
+  l.buf = BENCODE_MALLOC(l.bufsize);
+  if (!l.buf && l.bufsize > 0) {
+    perror("ERROR: could not allocate file buffer");
+    exit(EXIT_FAILURE);
+  }
+  open_stream(&l, filename);
+  return l;
+}
+
+// Maps the file read-only instead of copying it into the heap, so the
+// parser reads straight from the page cache. Bencode is consumed front to
+// back, so we tell the kernel to read ahead aggressively. Returns false
+// with errno set if the file cannot be mapped.
+bool lexer_map_file(Lexer *l, const char *filename) {
+  *l = (Lexer){0};
+
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return false;
+  }
+
+  l->bufsize = st.st_size;
+  if (l->bufsize == 0) {
+    close(fd);
+    return true;
+  }
+
+  void *map = mmap(NULL, l->bufsize, PROT_READ, MAP_PRIVATE, fd, 0);
+  int err = errno;
+  close(fd);
+  if (map == MAP_FAILED) {
+    errno = err;
+    l->bufsize = 0;
+    return false;
+  }
+
+  madvise(map, l->bufsize, MADV_SEQUENTIAL);
+  madvise(map, l->bufsize, MADV_WILLNEED);
+
+  l->buf = map;
+  l->storage = LEXER_BUFFER_MMAP;
+  return true;
+}
+
+Lexer new_lexer_mmap(const char *filename) {
+  Lexer l;
+  if (!lexer_map_file(&l, filename)) {
+    perror("ERROR: could not map file");
+    exit(EXIT_FAILURE);
+  }
+
+  return l;
+}
+
+// Lexes a caller-owned buffer in place. The buffer is never written to and
+// must outlive the lexer and any zero-copy strings parsed from it.
+Lexer new_lexer_from_buffer(const char *buf, size_t len) {
+  Lexer l = {0};
+  l.buf = (char *)buf;
+  l.bufsize = len;
+  l.storage = LEXER_BUFFER_BORROWED;
+  return l;
+}
+
+void free_lexer(Lexer *l) {
+  switch (l->storage) {
+  case LEXER_BUFFER_HEAP:
+    BENCODE_FREE(l->buf);
+    break;
+  case LEXER_BUFFER_MMAP:
+    munmap(l->buf, l->bufsize);
+    break;
+  case LEXER_BUFFER_BORROWED:
+    break;
+  }
+
+  if (l->input) {
+    fclose(l->input);
+    l->input = NULL;
+  }
+
+  l->buf = NULL;
+  l->bufsize = 0;
+}
+
+void read_char(Lexer *l) {
+  l->ch = l->read_pos < l->bufsize ? l->buf[l->read_pos] : '\0';
+  l->pos = l->read_pos;
+  l->read_pos++;
+}
+
+char peek_char(Lexer *l) {
+  return l->read_pos < l->bufsize ? l->buf[l->read_pos] : '\0';
+}
+
+// Strings are returned as a view into the lexer buffer: the length prefix
+// tells us exactly how far to jump, so the payload is never copied or scanned.
+Token read_string(Lexer *l, size_t n) {
+  Token t = {.pos = l->read_pos};
+
+  if (l->read_pos > l->bufsize || n > l->bufsize - l->read_pos) {
+    t.type = ILLEGAL;
+    return t;
+  }
+
+  t.type = STRING;
+  t.asString = &l->buf[l->read_pos];
+  t.len = n;
+
+  if (n > 0) {
+    l->read_pos += n;
+    l->pos = l->read_pos - 1;
+    l->ch = l->buf[l->pos];
+  }
+
+  return t;
+}
+
+Token next_token(Lexer *l) {
+  Token t = {0};
+
+  if (l->prev.type == COLON && l->prevprev.type == STRING_SIZE) {
+    t = read_string(l, l->prevprev.asInt);
+    l->prevprev = l->prev;
+    l->prev = t;
+    return t;
+  }
+
+  read_char(l);
+  t.pos = l->pos;
+
+  switch (l->ch) {
+  case ':':
+    t.type = COLON;
+    break;
+  case 'd':
+    if (l->prev.type != COLON) {
+      t.type = DICT_START;
+      break;
+    }
+  case 'l':
+    if (l->prev.type != COLON) {
+      t.type = LIST_START;
+      break;
+    }
+  case 'i':
+    if (l->prev.type != COLON) {
+      t.type = INT_START;
+      break;
+    }
+  case 'e':
+    if (l->prev.type != COLON) {
+      t.type = END;
+      break;
+    }
+  default:
+    if (isdigit(l->ch) || l->ch == '-') {
+      // The number runs to the next structural byte, and decimal_decode
+      // rejects anything in between that is not a digit.
+      size_t start = l->pos;
+      size_t end = index_next_structural(&l->idx, l->buf, l->bufsize, start);
+
+      l->read_pos = end;
+      l->pos = end - 1;
+      l->ch = l->buf[l->pos];
+
+      bool is_int = l->prev.type == INT_START;
+      if (is_int && peek_char(l) == 'e') {
+        t.type = INT;
+      } else if (!is_int && peek_char(l) == ':') {
+        t.type = STRING_SIZE;
+      } else {
+        t.type = ILLEGAL;
+      }
+
+      if (decimal_decode(&l->buf[start], end - start, is_int, &t.asInt) !=
+          DECIMAL_OK) {
+        t.type = ILLEGAL;
+      }
+    } else if (l->pos >= l->bufsize) {
+      t.type = END_OF_FILE;
+    } else {
+      t.type = ILLEGAL;
+    }
+  }
+
+  l->prevprev = l->prev;
+  l->prev = t;
+
+  return t;
+}
+
+// Every token the parser reads comes through here, which is where lexing
+// is counted and timed.
+Token parser_lex(Parser *p) {
+#ifdef BENCODE_STATS
+  uint64_t start = bencode_cycles();
+  Token t = next_token(&p->l);
+  p->stats.lex_cycles += bencode_cycles() - start;
+  p->stats.tokens[t.type]++;
+  return t;
+#else
+  return next_token(&p->l);
+#endif
+}
+
+void parser_next_token(Parser *p) {
+  p->cur_token = p->peek_token;
+  p->peek_token = parser_lex(p);
+}
+
+char *bencode_string_dup(BencodeString s) {
+  return bencode_string_copy(NULL, s).str;
+}
+
+// Messages past the capacity of errors are dropped; the first ones are the
+// useful ones.
+void parse_error(Parser *p, char *error) {
+  if (p->error_index < sizeof(p->errors) / sizeof(p->errors[0])) {
+    char *copy = strdup(error);
+    if (copy) {
+      p->errors[p->error_index++] = copy;
+    }
+  }
+}
+
+const char *bencode_error_string(BencodeErrorCode code) {
+  switch (code) {
+  case BENCODE_OK:
+    return "no error";
+  case BENCODE_ERR_UNEXPECTED_TOKEN:
+    return "unexpected token";
+  case BENCODE_ERR_BAD_INTEGER:
+    return "malformed integer";
+  case BENCODE_ERR_BAD_STRING:
+    return "malformed string";
+  case BENCODE_ERR_UNTERMINATED:
+    return "unterminated container";
+  case BENCODE_ERR_KEY_NOT_STRING:
+    return "dictionary key is not a string";
+  case BENCODE_ERR_DEPTH_LIMIT:
+    return "nesting depth limit exceeded";
+  case BENCODE_ERR_STRING_LIMIT:
+    return "string length limit exceeded";
+  case BENCODE_ERR_ELEMENT_LIMIT:
+    return "element limit exceeded";
+  case BENCODE_ERR_ALLOC_LIMIT:
+    return "allocation limit exceeded";
+  case BENCODE_ERR_OUT_OF_MEMORY:
+    return "out of memory";
+  }
+  return "unknown error";
+}
+
+#ifdef BENCODE_STATS
+uint64_t bencode_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+void bencode_stats_print(FILE *f, const BencodeStats *s) {
+  static const char *names[] = {
+      "LIST_START", "DICT_START", "INT_START", "INT",         "END",
+      "STRING_SIZE", "STRING",    "COLON",     "END_OF_FILE", "ILLEGAL",
+  };
+
+  size_t total = 0;
+  for (size_t i = 0; i <= ILLEGAL; i++) {
+    total += s->tokens[i];
+  }
+  fprintf(f, "tokens: %zu\n", total);
+  for (size_t i = 0; i <= ILLEGAL; i++) {
+    if (s->tokens[i]) {
+      fprintf(f, "  %-12s %zu\n", names[i], s->tokens[i]);
+    }
+  }
+  fprintf(f, "bytes copied: %zu\n", s->bytes_copied);
+  fprintf(f, "allocations: %zu (%zu bytes)\n", s->allocations,
+          s->bytes_allocated);
+  fprintf(f, "max depth: %zu\n", s->max_depth);
+  fprintf(f, "lex cycles: %" PRIu64 "\n", s->lex_cycles);
+  fprintf(f, "build cycles: %" PRIu64 "\n", s->build_cycles);
+}
+
+// Sums the counters of several tables, e.g. every dict index of a tree.
+void bencode_hash_stats_add(hash_table_stats_t *total,
+                            const hash_table_stats_t *s) {
+  total->inserts += s->inserts;
+  total->lookups += s->lookups;
+  total->rehashes += s->rehashes;
+  for (size_t i = 0; i < HASH_TABLE_PROBE_BUCKETS; i++) {
+    total->probes[i] += s->probes[i];
+  }
+}
+
+void bencode_hash_stats_print(FILE *f, const hash_table_stats_t *s) {
+  fprintf(f, "hash inserts: %zu\n", s->inserts);
+  fprintf(f, "hash lookups: %zu\n", s->lookups);
+  fprintf(f, "hash rehashes: %zu\n", s->rehashes);
+  fprintf(f, "probe lengths:\n");
+  for (size_t i = 0; i < HASH_TABLE_PROBE_BUCKETS; i++) {
+    if (s->probes[i]) {
+      fprintf(f, "  %2zu%s %zu\n", i + 1,
+              i + 1 == HASH_TABLE_PROBE_BUCKETS ? "+" : " ", s->probes[i]);
+    }
+  }
+}
+#endif
+
+Parser new_parser(Lexer l) {
+  Parser p = {
+      .l = l,
+  };
+  p.cur_token = parser_lex(&p);
+  p.peek_token = parser_lex(&p);
+
+  return p;
+}
+
+PushParser new_push_parser(void) {
+  PushParser p = {0};
+  PushStack *stack = &p.stack;
+  da_init(stack, sizeof(PushFrame));
+  return p;
+}
+
+void free_push_parser(PushParser *p) {
+  // Without an arena, anything still in flight is owned by the parser.
+  if (!p->arena) {
+    for (size_t i = 0; i < p->stack.len; i++) {
+      PushFrame *frame = &p->stack.values[i];
+      bencode_free(&frame->value, true);
+      if (frame->has_key) {
+        BENCODE_FREE(frame->key.str);
+      }
+    }
+
+    if (p->state == PUSH_STRING) {
+      BENCODE_FREE(p->str.str);
+    }
+  }
+
+  BENCODE_FREE(p->stack.values);
+  p->stack.values = NULL;
+  p->stack.len = 0;
+}
+
+// Stops the parser; i is the index in the current chunk where the error was
+// detected.
+void push_fail(PushParser *p, BencodeErrorCode code, size_t i) {
+  p->state = PUSH_FAILED;
+  p->error = (BencodeError){code, p->offset + i};
+}
+
+bool push_charge(PushParser *p, size_t bytes, size_t i) {
+  p->allocated += bytes;
+  if (p->limits.max_alloc_bytes && p->allocated > p->limits.max_alloc_bytes) {
+    push_fail(p, BENCODE_ERR_ALLOC_LIMIT, i);
+    return false;
+  }
+  return true;
+}
+
+// Hands a finished value to the innermost open container. Returns true when
+// the value was a complete top-level document.
+bool push_complete(PushParser *p, BencodeType value, size_t i) {
+  PushStack *stack = &p->stack;
+  if (stack->len == 0) {
+    p->value = value;
+    return true;
+  }
+
+  PushFrame *top = &stack->values[stack->len - 1];
+  if (top->value.kind == LIST) {
+    BencodeList *list = &top->value.asList;
+    if (list->len == list->cap &&
+        !push_charge(p, (bencode_grown_cap(list->cap) - list->cap) *
+                            sizeof(BencodeType), i)) {
+      goto drop;
+    }
+    if (list->len == BENCODE_MAX_LIST_LEN) {
+      push_fail(p, BENCODE_ERR_ELEMENT_LIMIT, i);
+      goto drop;
+    }
+    if (!bencode_list_append(p->arena, list, value)) {
+      push_fail(p, BENCODE_ERR_OUT_OF_MEMORY, i);
+      goto drop;
+    }
+  } else if (!top->has_key) {
+    if (value.kind != BYTESTRING) {
+      push_fail(p, BENCODE_ERR_KEY_NOT_STRING, i);
+      goto drop;
+    }
+    top->key = value.asString;
+    top->has_key = true;
+  } else {
+    BencodeDict *dict = top->value.asDict;
+    if (dict->len == dict->cap &&
+        !push_charge(p, (bencode_grown_cap(dict->cap) - dict->cap) *
+                            sizeof(BencodeDictEntry), i)) {
+      goto drop;
+    }
+    if (!bencode_dict_insert(p->arena, &top->value, top->key, value)) {
+      push_fail(p, BENCODE_ERR_OUT_OF_MEMORY, i);
+      goto drop;
+    }
+    top->has_key = false;
+  }
+
+  return false;
+
+drop:
+  // The parser owns the value now that no container holds it.
+  if (!p->arena) {
+    bencode_free(&value, true);
+  }
+  return false;
+}
+
+// Starts hashing when a requested key's value begins in the top-level dict.
+void push_span_begin(PushParser *p, size_t i) {
+  PushFrame *top = &p->stack.values[0];
+  if (p->span || p->stack.len != 1 || top->value.kind != DICTIONARY ||
+      !top->has_key) {
+    return;
+  }
+
+  p->span = span_find(p->spans, p->spans_len, top->key);
+  if (p->span) {
+    span_begin(p->span, p->offset + i);
+    p->span_from = i;
+  }
+}
+
+// Finishes the span once its value has been stored in the top-level dict.
+// end is the chunk index just past the value's last byte.
+void push_span_check(PushParser *p, const char *chunk, size_t end) {
+  if (!p->span || p->stack.len != 1 || p->stack.values[0].has_key) {
+    return;
+  }
+
+  span_update(p->span, chunk + p->span_from, end - p->span_from);
+  span_end(p->span, p->offset + end);
+  p->span = NULL;
+}
+
+BencodeFeedResult bencode_feed(PushParser *p, const char *chunk, size_t len) {
+  size_t i = 0;
+  bool ready = false;
+
+  while (i < len && !ready && p->state != PUSH_FAILED) {
+    char c = chunk[i];
+
+    switch (p->state) {
+    case PUSH_STRING: {
+      size_t n = p->str.len - p->str_read;
+      if (n > len - i) {
+        n = len - i;
+      }
+
+      memcpy(p->str.str + p->str_read, chunk + i, n);
+      p->str_read += n;
+      i += n;
+
+      if (p->str_read == p->str.len) {
+        p->str.str[p->str.len] = '\0';
+        p->state = PUSH_VALUE;
+        ready = push_complete(p,
+                              (BencodeType){.kind = BYTESTRING,
+                                            .asString = p->str},
+                              i - 1);
+        push_span_check(p, chunk, i);
+      }
+      continue;
+    }
+    case PUSH_INT:
+      if (c == '-' && p->digits == 0 && !p->negative) {
+        p->negative = true;
+      } else if (isdigit(c) && !(p->digits > 0 && p->num == 0) &&
+                 !(p->negative && p->digits == 0 && c == '0') &&
+                 decimal_push_digit(&p->num, c - '0',
+                                    p->negative ? (unsigned long)LONG_MAX + 1
+                                                : LONG_MAX)) {
+        p->digits++;
+      } else if (c == 'e' && p->digits > 0) {
+        p->state = PUSH_VALUE;
+        ready = push_complete(
+            p,
+            (BencodeType){.kind = INTEGER,
+                          .asInt = p->negative ? (long)(0 - p->num)
+                                               : (long)p->num},
+            i);
+      } else {
+        push_fail(p, BENCODE_ERR_BAD_INTEGER, i);
+        continue;
+      }
+      break;
+    case PUSH_STRING_SIZE:
+      if (isdigit(c) && p->num != 0 &&
+          decimal_push_digit(&p->num, c - '0', LONG_MAX)) {
+        break;
+      } else if (c == ':') {
+        if (p->num > bencode_string_limit(&p->limits)) {
+          push_fail(p, BENCODE_ERR_STRING_LIMIT, i);
+          continue;
+        }
+        if (!push_charge(p, p->num + 1, i)) {
+          continue;
+        }
+        p->str.len = p->num;
+        p->str.str = bencode_alloc(p->arena, p->str.len + 1);
+        if (!p->str.str) {
+          push_fail(p, BENCODE_ERR_OUT_OF_MEMORY, i);
+          continue;
+        }
+        p->str_read = 0;
+        p->state = PUSH_STRING;
+        if (p->str.len == 0) {
+          p->str.str[0] = '\0';
+          p->state = PUSH_VALUE;
+          ready = push_complete(p,
+                                (BencodeType){.kind = BYTESTRING,
+                                              .asString = p->str},
+                                i);
+        }
+      } else {
+        push_fail(p, BENCODE_ERR_BAD_STRING, i);
+        continue;
+      }
+      break;
+    case PUSH_VALUE:
+      if (p->spans_len > 0) {
+        push_span_begin(p, i);
+      }
+      p->elements += c != 'e';
+      if (p->limits.max_elements && p->elements > p->limits.max_elements) {
+        push_fail(p, BENCODE_ERR_ELEMENT_LIMIT, i);
+        continue;
+      }
+      if (c == 'i') {
+        p->state = PUSH_INT;
+        p->num = 0;
+        p->digits = 0;
+        p->negative = false;
+      } else if (isdigit(c)) {
+        p->state = PUSH_STRING_SIZE;
+        p->num = c - '0';
+      } else if (c == 'l' || c == 'd') {
+        if (p->limits.max_depth && p->stack.len >= p->limits.max_depth) {
+          push_fail(p, BENCODE_ERR_DEPTH_LIMIT, i);
+          continue;
+        }
+        if (c == 'd' && !push_charge(p, sizeof(BencodeDict), i)) {
+          continue;
+        }
+        PushFrame frame = {0};
+        if (c == 'l') {
+          frame.value.kind = LIST;
+          frame.value.asList = (BencodeList){0};
+        } else if (!bencode_dict_init(p->arena, &frame.value)) {
+          push_fail(p, BENCODE_ERR_OUT_OF_MEMORY, i);
+          continue;
+        }
+        PushStack *stack = &p->stack;
+        if (!da_append(stack, frame)) {
+          if (!p->arena) {
+            bencode_free(&frame.value, true);
+          }
+          push_fail(p, BENCODE_ERR_OUT_OF_MEMORY, i);
+          continue;
+        }
+      } else if (c == 'e' && p->stack.len > 0 &&
+                 !p->stack.values[p->stack.len - 1].has_key) {
+        BencodeType done = p->stack.values[--p->stack.len].value;
+        if (done.kind == DICTIONARY && !bencode_dict_finish(done.asDict)) {
+          if (!p->arena) {
+            bencode_free(&done, true);
+          }
+          push_fail(p, BENCODE_ERR_OUT_OF_MEMORY, i);
+          continue;
+        }
+        ready = push_complete(p, done, i);
+      } else {
+        push_fail(p, BENCODE_ERR_UNEXPECTED_TOKEN, i);
+        continue;
+      }
+      break;
+    case PUSH_FAILED:
+      break;
+    }
+
+    i++;
+    push_span_check(p, chunk, i);
+  }
+
+  if (p->span) {
+    span_update(p->span, chunk + p->span_from, i - p->span_from);
+    p->span_from = 0;
+  }
+
+  p->consumed = i;
+  p->offset += i;
+
+  if (p->state == PUSH_FAILED) {
+    return BENCODE_ERROR;
+  }
+
+  return ready ? BENCODE_VALUE_READY : BENCODE_NEED_MORE;
+}
+
+bool is_structural_char(char c) {
+  return c == 'd' || c == 'l' || c == 'i' || c == 'e' || c == ':';
+}
+
+void index_block_scalar(const char *block, uint64_t *digits,
+                        uint64_t *structural) {
+  uint64_t d = 0;
+  uint64_t s = 0;
+  for (size_t i = 0; i < 64; i++) {
+    d |= (uint64_t)((unsigned char)(block[i] - '0') < 10) << i;
+    s |= (uint64_t)is_structural_char(block[i]) << i;
+  }
+
+  *digits = d;
+  *structural = s;
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__)) &&        \
+    !defined(BENCODE_NO_SIMD)
+#define BENCODE_X86_SIMD
+#include <immintrin.h>
+
+void index_block_sse2(const char *block, uint64_t *digits,
+                      uint64_t *structural) {
+  const __m128i zero = _mm_set1_epi8('0');
+  const __m128i nine = _mm_set1_epi8(9);
+  uint64_t d = 0;
+  uint64_t s = 0;
+
+  for (size_t i = 0; i < 64; i += 16) {
+    __m128i in = _mm_loadu_si128((const __m128i *)(block + i));
+    // Unsigned (c - '0') <= 9 is a digit.
+    __m128i off = _mm_sub_epi8(in, zero);
+    __m128i is_digit = _mm_cmpeq_epi8(_mm_min_epu8(off, nine), off);
+
+    __m128i is_struct = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(in, _mm_set1_epi8('d')),
+                     _mm_cmpeq_epi8(in, _mm_set1_epi8('l'))),
+        _mm_or_si128(_mm_cmpeq_epi8(in, _mm_set1_epi8('i')),
+                     _mm_cmpeq_epi8(in, _mm_set1_epi8('e'))));
+    is_struct = _mm_or_si128(is_struct, _mm_cmpeq_epi8(in, _mm_set1_epi8(':')));
+
+    d |= (uint64_t)(uint16_t)_mm_movemask_epi8(is_digit) << i;
+    s |= (uint64_t)(uint16_t)_mm_movemask_epi8(is_struct) << i;
+  }
+
+  *digits = d;
+  *structural = s;
+}
+
+__attribute__((target("avx2"))) void
+index_block_avx2(const char *block, uint64_t *digits, uint64_t *structural) {
+  const __m256i zero = _mm256_set1_epi8('0');
+  const __m256i nine = _mm256_set1_epi8(9);
+  uint64_t d = 0;
+  uint64_t s = 0;
+
+  for (size_t i = 0; i < 64; i += 32) {
+    __m256i in = _mm256_loadu_si256((const __m256i *)(block + i));
+    __m256i off = _mm256_sub_epi8(in, zero);
+    __m256i is_digit = _mm256_cmpeq_epi8(_mm256_min_epu8(off, nine), off);
+
+    __m256i is_struct = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(in, _mm256_set1_epi8('d')),
+                        _mm256_cmpeq_epi8(in, _mm256_set1_epi8('l'))),
+        _mm256_or_si256(_mm256_cmpeq_epi8(in, _mm256_set1_epi8('i')),
+                        _mm256_cmpeq_epi8(in, _mm256_set1_epi8('e'))));
+    is_struct =
+        _mm256_or_si256(is_struct, _mm256_cmpeq_epi8(in, _mm256_set1_epi8(':')));
+
+    d |= (uint64_t)(uint32_t)_mm256_movemask_epi8(is_digit) << i;
+    s |= (uint64_t)(uint32_t)_mm256_movemask_epi8(is_struct) << i;
+  }
+
+  *digits = d;
+  *structural = s;
+}
+#endif
+
+typedef void (*index_kernel_t)(const char *, uint64_t *, uint64_t *);
+
+index_kernel_t index_kernel = NULL;
+pthread_once_t index_kernel_once = PTHREAD_ONCE_INIT;
+
+// Runs once, whichever thread indexes first, so parsers on several threads
+// never race to set index_kernel.
+void index_select_kernel(void) {
+#ifdef BENCODE_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    index_kernel = index_block_avx2;
+  } else {
+    index_kernel = index_block_sse2;
+  }
+#else
+  index_kernel = index_block_scalar;
+#endif
+}
+
+// Indexes the window of BENCODE_INDEX_BLOCKS blocks that contains pos.
+void index_window(BencodeIndex *idx, const char *buf, size_t len,
+                  size_t pos) {
+  pthread_once(&index_kernel_once, index_select_kernel);
+
+  idx->start = pos & ~(size_t)63;
+  idx->end = idx->start;
+  for (size_t b = 0; b < BENCODE_INDEX_BLOCKS && idx->end < len; b++) {
+    if (len - idx->end >= 64) {
+      index_kernel(buf + idx->end, &idx->digits[b], &idx->structural[b]);
+      idx->end += 64;
+    } else {
+      // Pad the tail with zero bytes, which are neither digits nor
+      // structural.
+      char tail[64] = {0};
+      memcpy(tail, buf + idx->end, len - idx->end);
+      index_kernel(tail, &idx->digits[b], &idx->structural[b]);
+      idx->end = len;
+    }
+  }
+}
+
+// Returns the position of the first non-digit at or after pos, or len.
+size_t index_digits_end(BencodeIndex *idx, const char *buf, size_t len,
+                        size_t pos) {
+  while (pos < len) {
+    if (pos < idx->start || pos >= idx->end) {
+      index_window(idx, buf, len, pos);
+    }
+
+    size_t rel = pos - idx->start;
+    uint64_t non_digits = ~idx->digits[rel / 64] >> (rel % 64);
+    if (non_digits) {
+      size_t end = pos + __builtin_ctzll(non_digits);
+      return end < len ? end : len;
+    }
+
+    pos += 64 - rel % 64;
+  }
+
+  return len;
+}
+
+// Returns the position of the first structural byte at or after pos, or
+// len. Integers and length prefixes end at one, so this finds the end of a
+// digit run without looking at the digits.
+size_t index_next_structural(BencodeIndex *idx, const char *buf, size_t len,
+                             size_t pos) {
+  while (pos < len) {
+    if (pos < idx->start || pos >= idx->end) {
+      index_window(idx, buf, len, pos);
+    }
+
+    size_t rel = pos - idx->start;
+    uint64_t structural = idx->structural[rel / 64] >> (rel % 64);
+    if (structural) {
+      size_t end = pos + __builtin_ctzll(structural);
+      return end < len ? end : len;
+    }
+
+    pos += 64 - rel % 64;
+  }
+
+  return len;
+}
+
+bool index_is_structural(BencodeIndex *idx, const char *buf, size_t len,
+                         size_t pos) {
+  if (pos >= len) {
+    return false;
+  }
+
+  if (pos < idx->start || pos >= idx->end) {
+    index_window(idx, buf, len, pos);
+  }
+
+  size_t rel = pos - idx->start;
+  return (idx->structural[rel / 64] >> (rel % 64)) & 1;
+}
+
+// Reads a decimal number made only of digits (and a leading '-' if allowed)
+// that ends at terminator. The number runs to the next structural byte,
+// and decimal_decode rejects anything but digits before it. On success
+// *pos is left just past the terminator.
+bool scan_decimal(BencodeIndex *idx, const char *buf, size_t len, size_t *pos,
+                  char terminator, bool allow_negative, long *out) {
+  size_t start = *pos;
+  size_t end = index_next_structural(idx, buf, len, start);
+  if (end >= len || buf[end] != terminator) {
+    return false;
+  }
+
+  if (decimal_decode(buf + start, end - start, allow_negative, out) !=
+      DECIMAL_OK) {
+    return false;
+  }
+
+  *pos = end + 1;
+  return true;
+}
+
+// Whether the container open at depth (counting from 1) is a dict. The
+// first 64 levels are bits of low, deeper ones bits of high.
+bool skip_in_dict(uint64_t low, const uint64_t *high, size_t depth) {
+  if (depth == 0) {
+    return false;
+  }
+  size_t level = depth - 1;
+  if (level < 64) {
+    return low >> level & 1;
+  }
+  level -= 64;
+  return high[level / 64] >> (level % 64) & 1;
+}
+
+// Advances *pos past one complete value without building anything. String
+// payloads are jumped over using their length prefix, so this is much
+// cheaper than parsing and is how record boundaries are found. Dicts must
+// alternate string keys and values.
+bool skip_value(BencodeIndex *idx, const char *buf, size_t len, size_t *pos) {
+  uint64_t low = 0;
+  uint64_t *high = NULL;
+  size_t high_cap = 0;
+  size_t i = *pos;
+  size_t depth = 0;
+  bool in_dict = false;
+  // Inside a dict, at the start of a key rather than a value.
+  bool want_key = false;
+  bool ok = false;
+
+  do {
+    if (i >= len) {
+      goto done;
+    }
+
+    char c = buf[i];
+    if (c == 'e') {
+      if (depth == 0 || (in_dict && !want_key)) {
+        goto done;
+      }
+      depth--;
+      i++;
+      // The container just closed was a value, so a dict around it wants
+      // its next key.
+      in_dict = skip_in_dict(low, high, depth);
+      want_key = in_dict;
+      continue;
+    }
+
+    // Keys are strings, which the length prefix check below enforces.
+    if (c == 'l' || c == 'd') {
+      if (want_key) {
+        goto done;
+      }
+
+      uint64_t bit = (uint64_t)(c == 'd');
+      if (depth < 64) {
+        low = (low & ~((uint64_t)1 << depth)) | bit << depth;
+      } else {
+        size_t level = depth - 64;
+        if (level == high_cap) {
+          size_t cap = high_cap ? high_cap * 2 : 256;
+          uint64_t *grown = BENCODE_REALLOC(high, cap / 64 * sizeof(uint64_t));
+          if (!grown) {
+            goto done;
+          }
+          high = grown;
+          high_cap = cap;
+        }
+        uint64_t *word = &high[level / 64];
+        *word = (*word & ~((uint64_t)1 << level % 64)) | bit << level % 64;
+      }
+      depth++;
+      i++;
+      in_dict = c == 'd';
+      want_key = in_dict;
+      continue;
+    }
+
+    if (c == 'i') {
+      long v;
+      if (want_key) {
+        goto done;
+      }
+      i++;
+      if (!scan_decimal(idx, buf, len, &i, 'e', true, &v)) {
+        goto done;
+      }
+    } else {
+      long n;
+      if (!scan_decimal(idx, buf, len, &i, ':', false, &n) ||
+          (size_t)n > len - i) {
+        goto done;
+      }
+      i += n;
+    }
+    if (in_dict) {
+      want_key = !want_key;
+    }
+  } while (depth > 0);
+
+  *pos = i;
+  ok = true;
+
+done:
+  BENCODE_FREE(high);
+  return ok;
+}
+
+bool bencode_skip(const char *buf, size_t len, size_t *pos) {
+  BencodeIndex idx = {0};
+  return skip_value(&idx, buf, len, pos);
+}
+
+bool tape_append(BencodeTape *t, BencodeTapeEntry e) {
+  if (t->len == t->cap) {
+    size_t cap = t->cap ? t->cap * 2 : 64;
+    BencodeTapeEntry *entries =
+        BENCODE_REALLOC(t->entries, cap * sizeof(BencodeTapeEntry));
+    if (!entries) {
+      return false;
+    }
+    t->entries = entries;
+    t->cap = cap;
+  }
+
+  t->entries[t->len++] = e;
+  return true;
+}
+
+typedef struct {
+  size_t len;
+  size_t cap;
+  size_t *values;
+} TapeStack;
+
+// Indexes every top-level value in buf. Returns false if the input is not
+// well-formed bencode or the tape cannot be allocated; the tape is left
+// empty in that case.
+bool tape_build(BencodeTape *t, const char *buf, size_t len) {
+  *t = (BencodeTape){
+      .buf = buf,
+      .bufsize = len,
+  };
+
+  TapeStack open = {0};
+  TapeStack *stack = &open;
+  da_init(stack, sizeof(size_t));
+
+  BencodeIndex idx = {0};
+
+  // Values are back to back, so pos is always at the start of one: a
+  // structural byte, or the first digit of a length prefix. Integers and
+  // length prefixes are crossed by jumping to the structural byte that ends
+  // them, and string payloads by their length.
+  size_t pos = 0;
+  while (pos < len) {
+    char c = buf[pos];
+    if (c == 'e') {
+      if (open.len == 0) {
+        goto fail;
+      }
+      BencodeTapeEntry *closed = &t->entries[open.values[--open.len]];
+      if (closed->kind == DICTIONARY && closed->len % 2 != 0) {
+        goto fail;
+      }
+      closed->next = t->len;
+      pos++;
+      continue;
+    }
+
+    if (open.len > 0) {
+      BencodeTapeEntry *parent = &t->entries[open.values[open.len - 1]];
+      if (parent->kind == DICTIONARY && parent->len % 2 == 0 && !isdigit(c)) {
+        goto fail;
+      }
+      parent->len++;
+    }
+
+    BencodeTapeEntry e = {
+        .offset = pos,
+        .next = t->len + 1,
+    };
+
+    if (c == 'i') {
+      e.kind = INTEGER;
+      pos++;
+      if (!scan_decimal(&idx, buf, len, &pos, 'e', true, &e.asInt)) {
+        goto fail;
+      }
+    } else if (c == 'l' || c == 'd') {
+      e.kind = c == 'l' ? LIST : DICTIONARY;
+      e.len = 0;
+      if (!da_append(stack, t->len)) {
+        goto fail;
+      }
+      pos++;
+    } else {
+      long n;
+      if (!scan_decimal(&idx, buf, len, &pos, ':', false, &n) ||
+          (size_t)n > len - pos) {
+        goto fail;
+      }
+      e.kind = BYTESTRING;
+      e.offset = pos;
+      e.len = n;
+      pos += n;
+    }
+
+    if (!tape_append(t, e)) {
+      goto fail;
+    }
+  }
+
+  if (open.len > 0) {
+    goto fail;
+  }
+
+  BENCODE_FREE(open.values);
+  return true;
+
+fail:
+  BENCODE_FREE(open.values);
+  free_tape(t);
+  return false;
+}
+
+void free_tape(BencodeTape *t) {
+  BENCODE_FREE(t->entries);
+  t->entries = NULL;
+  t->len = 0;
+  t->cap = 0;
+}
+
+BencodeCursor tape_root(const BencodeTape *t) {
+  return (BencodeCursor){
+      .tape = t,
+      .index = 0,
+      .end = t->len,
+  };
+}
+
+bool tape_valid(BencodeCursor c) { return c.tape && c.index < c.end; }
+
+BencodeKind tape_kind(BencodeCursor c) {
+  if (!tape_valid(c)) {
+    return ERROR;
+  }
+
+  return c.tape->entries[c.index].kind;
+}
+
+// First child of a list or dict. For dicts, children alternate between keys
+// and values.
+BencodeCursor tape_child(BencodeCursor c) {
+  BencodeKind kind = tape_kind(c);
+  if (kind != LIST && kind != DICTIONARY) {
+    return (BencodeCursor){0};
+  }
+
+  return (BencodeCursor){
+      .tape = c.tape,
+      .index = c.index + 1,
+      .end = c.tape->entries[c.index].next,
+  };
+}
+
+BencodeCursor tape_next_sibling(BencodeCursor c) {
+  if (!tape_valid(c)) {
+    return (BencodeCursor){0};
+  }
+
+  c.index = c.tape->entries[c.index].next;
+  return c;
+}
+
+BencodeCursor tape_find_key(BencodeCursor dict, const char *key, size_t len) {
+  if (tape_kind(dict) != DICTIONARY) {
+    return (BencodeCursor){0};
+  }
+
+  BencodeCursor k = tape_child(dict);
+  while (tape_valid(k)) {
+    BencodeCursor v = tape_next_sibling(k);
+    const BencodeTapeEntry *e = &k.tape->entries[k.index];
+    if (e->len == len && memcmp(k.tape->buf + e->offset, key, len) == 0) {
+      return v;
+    }
+    k = tape_next_sibling(v);
+  }
+
+  return (BencodeCursor){0};
+}
+
+long tape_as_int(BencodeCursor c) {
+  if (tape_kind(c) != INTEGER) {
+    return 0;
+  }
+
+  return c.tape->entries[c.index].asInt;
+}
+
+BencodeString tape_as_string(BencodeCursor c) {
+  if (tape_kind(c) != BYTESTRING) {
+    return (BencodeString){0};
+  }
+
+  const BencodeTapeEntry *e = &c.tape->entries[c.index];
+  return (BencodeString){
+      .len = e->len,
+      .str = (char *)c.tape->buf + e->offset,
+  };
+}
+
+#define QUERY_DONE SIZE_MAX
+
+typedef struct {
+  BencodeIndex idx;
+  const char *buf;
+  size_t len;
+  BencodeQuery *q;
+  size_t n;
+  size_t pending;
+} QueryWalk;
+
+// Whether segment number depth of the path names this dict key or list
+// index.
+bool query_segment_matches(const char *path, size_t depth, const char *key,
+                           size_t key_len, size_t index, bool is_dict) {
+  const char *seg = path;
+  for (size_t d = 0; d < depth; d++) {
+    seg = strchr(seg, '/') + 1;
+  }
+  const char *slash = strchr(seg, '/');
+  size_t seg_len = slash ? (size_t)(slash - seg) : strlen(seg);
+
+  if (is_dict) {
+    return seg_len == key_len && memcmp(seg, key, key_len) == 0;
+  }
+
+  long i;
+  return decimal_decode(seg, seg_len, false, &i) == DECIMAL_OK &&
+         (size_t)i == index;
+}
+
+void query_done(QueryWalk *w, BencodeQuery *q) {
+  q->matched = QUERY_DONE;
+  w->pending--;
+}
+
+// Walks the value at *pos, reached by matching depth segments. Containers
+// are only entered when a pending path continues into them, everything
+// else is skipped without decoding.
+bool query_value(QueryWalk *w, size_t *pos, size_t depth) {
+  const char *buf = w->buf;
+  size_t len = w->len;
+  size_t start = *pos;
+  if (start >= len) {
+    return false;
+  }
+
+  bool descend = false;
+  for (size_t k = 0; k < w->n; k++) {
+    BencodeQuery *q = &w->q[k];
+    if (q->matched != depth) {
+      continue;
+    }
+    if (q->segments > depth) {
+      descend = true;
+      continue;
+    }
+
+    BencodeMatch *m = &q->match;
+    m->start = start;
+    m->end = start;
+    if (!skip_value(&w->idx, buf, len, &m->end)) {
+      return false;
+    }
+
+    char c = buf[start];
+    if (c == 'd' || c == 'l') {
+      m->kind = c == 'd' ? DICTIONARY : LIST;
+    } else if (c == 'i') {
+      size_t i = start + 1;
+      m->kind = INTEGER;
+      scan_decimal(&w->idx, buf, len, &i, 'e', true, &m->asInt);
+    } else {
+      size_t i = start;
+      long n;
+      scan_decimal(&w->idx, buf, len, &i, ':', false, &n);
+      m->kind = BYTESTRING;
+      m->asString = (BencodeString){.len = n, .str = (char *)buf + i};
+    }
+    q->found = true;
+    query_done(w, q);
+  }
+
+  char c = buf[start];
+  if (!descend || (c != 'd' && c != 'l')) {
+    if (!skip_value(&w->idx, buf, len, pos)) {
+      return false;
+    }
+  } else {
+    bool is_dict = c == 'd';
+    size_t i = start + 1;
+    for (size_t index = 0; i < len && buf[i] != 'e'; index++) {
+      const char *key = NULL;
+      size_t key_len = 0;
+      if (is_dict) {
+        long n;
+        if (!scan_decimal(&w->idx, buf, len, &i, ':', false, &n) ||
+            (size_t)n > len - i) {
+          return false;
+        }
+        key = buf + i;
+        key_len = n;
+        i += n;
+      }
+
+      bool wanted = false;
+      for (size_t k = 0; k < w->n; k++) {
+        BencodeQuery *q = &w->q[k];
+        if (q->matched == depth &&
+            query_segment_matches(q->path, depth, key, key_len, index,
+                                  is_dict)) {
+          q->matched = depth + 1;
+          wanted = true;
+        }
+      }
+
+      if (wanted) {
+        if (!query_value(w, &i, depth + 1)) {
+          return false;
+        }
+        if (w->pending == 0) {
+          return true;
+        }
+      } else if (!skip_value(&w->idx, buf, len, &i)) {
+        return false;
+      }
+    }
+
+    if (i >= len) {
+      return false;
+    }
+    *pos = i + 1;
+  }
+
+  // Whatever was still looking below this value is not in the document.
+  for (size_t k = 0; k < w->n; k++) {
+    if (w->q[k].matched == depth) {
+      query_done(w, &w->q[k]);
+    }
+  }
+  return true;
+}
+
+// Looks up every path in one pass over the raw document, without building
+// a tree, and without allocating unless skipped values nest more than 64
+// deep. The walk stops as soon as all paths are resolved.
+// Returns how many were found; on malformed input, the ones found before
+// the error are kept.
+size_t bencode_query(const char *buf, size_t len, BencodeQuery *q, size_t n) {
+  QueryWalk w = {
+      .buf = buf,
+      .len = len,
+      .q = q,
+      .n = n,
+      .pending = n,
+  };
+
+  for (size_t k = 0; k < n; k++) {
+    q[k].found = false;
+    q[k].match = (BencodeMatch){.kind = ERROR};
+    q[k].matched = 0;
+    q[k].segments = q[k].path[0] != '\0';
+    for (const char *c = q[k].path; *c; c++) {
+      q[k].segments += *c == '/';
+    }
+  }
+
+  size_t pos = 0;
+  if (n > 0) {
+    query_value(&w, &pos, 0);
+  }
+
+  size_t found = 0;
+  for (size_t k = 0; k < n; k++) {
+    found += q[k].found;
+  }
+  return found;
+}
+
+bool bencode_get(const char *buf, size_t len, const char *path,
+                 BencodeMatch *out) {
+  BencodeQuery q = {.path = path};
+  bencode_query(buf, len, &q, 1);
+  *out = q.match;
+  return q.found;
+}
+
+// Reads the string at *pos as a view into buf and moves past it.
+bool raw_string(BencodeIndex *idx, const char *buf, size_t len, size_t *pos,
+                BencodeString *out) {
+  long n;
+  if (*pos >= len || !isdigit(buf[*pos]) ||
+      !scan_decimal(idx, buf, len, pos, ':', false, &n) ||
+      (size_t)n > len - *pos) {
+    return false;
+  }
+
+  *out = (BencodeString){.len = n, .str = (char *)buf + *pos};
+  *pos += n;
+  return true;
+}
+
+bool raw_int(BencodeIndex *idx, const char *buf, size_t len, size_t *pos,
+             long *out) {
+  if (*pos >= len || buf[*pos] != 'i') {
+    return false;
+  }
+
+  (*pos)++;
+  return scan_decimal(idx, buf, len, pos, 'e', true, out);
+}
+
+// Reads any value at *pos as a view of its encoded bytes and moves past it.
+bool raw_span(BencodeIndex *idx, const char *buf, size_t len, size_t *pos,
+              BencodeString *out) {
+  size_t start = *pos;
+  if (!skip_value(idx, buf, len, pos)) {
+    return false;
+  }
+
+  *out = (BencodeString){.len = *pos - start, .str = (char *)buf + start};
+  return true;
+}
+
+bool raw_key_is(BencodeString key, const char *name) {
+  size_t n = strlen(name);
+  return key.len == n && memcmp(key.str, name, n) == 0;
+}
+
+// Compact peers are 4 or 16 address bytes followed by a 2 byte port, both
+// big-endian, which is already the byte order sockaddr_in and sockaddr_in6
+// store them in: decoding is a copy per peer, with no byte swapping.
+bool announce_compact4(BencodeAnnounce *a, BencodeString s) {
+  if (s.len % 6 != 0) {
+    return false;
+  }
+
+  size_t n = s.len / 6;
+  size_t room = a->peers_cap - a->peers_len;
+  size_t take = n < room ? n : room;
+  struct sockaddr_in *out = a->peers + a->peers_len;
+  const unsigned char *in = (const unsigned char *)s.str;
+  for (size_t i = 0; i < take; i++, in += 6) {
+    out[i] = (struct sockaddr_in){.sin_family = AF_INET};
+    memcpy(&out[i].sin_addr, in, 4);
+    memcpy(&out[i].sin_port, in + 4, 2);
+  }
+
+  a->peers_len += take;
+  a->dropped += n - take;
+  return true;
+}
+
+bool announce_compact6(BencodeAnnounce *a, BencodeString s) {
+  if (s.len % 18 != 0) {
+    return false;
+  }
+
+  size_t n = s.len / 18;
+  size_t room = a->peers6_cap - a->peers6_len;
+  size_t take = n < room ? n : room;
+  struct sockaddr_in6 *out = a->peers6 + a->peers6_len;
+  const unsigned char *in = (const unsigned char *)s.str;
+  for (size_t i = 0; i < take; i++, in += 18) {
+    out[i] = (struct sockaddr_in6){.sin6_family = AF_INET6};
+    memcpy(&out[i].sin6_addr, in, 16);
+    memcpy(&out[i].sin6_port, in + 16, 2);
+  }
+
+  a->peers6_len += take;
+  a->dropped += n - take;
+  return true;
+}
+
+// Stores a dict-form peer. ip is text, either address family.
+void announce_peer(BencodeAnnounce *a, BencodeString ip, long port) {
+  char text[INET6_ADDRSTRLEN];
+  if (port < 0 || port > 65535 || ip.len == 0 || ip.len >= sizeof(text)) {
+    a->dropped++;
+    return;
+  }
+  memcpy(text, ip.str, ip.len);
+  text[ip.len] = '\0';
+
+  struct in_addr v4;
+  struct in6_addr v6;
+  if (inet_pton(AF_INET, text, &v4) == 1 && a->peers_len < a->peers_cap) {
+    a->peers[a->peers_len++] = (struct sockaddr_in){
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr = v4,
+    };
+  } else if (inet_pton(AF_INET6, text, &v6) == 1 &&
+             a->peers6_len < a->peers6_cap) {
+    a->peers6[a->peers6_len++] = (struct sockaddr_in6){
+        .sin6_family = AF_INET6,
+        .sin6_port = htons(port),
+        .sin6_addr = v6,
+    };
+  } else {
+    a->dropped++;
+  }
+}
+
+// The original peer list: a list of dicts with "ip", "port" and "peer id".
+bool announce_peer_list(BencodeIndex *idx, const char *buf, size_t len,
+                        size_t *pos, BencodeAnnounce *a) {
+  size_t i = *pos + 1;
+  while (i < len && buf[i] == 'd') {
+    BencodeString ip = {0};
+    long port = -1;
+    i++;
+    while (i < len && buf[i] != 'e') {
+      BencodeString key;
+      if (!raw_string(idx, buf, len, &i, &key)) {
+        return false;
+      }
+
+      bool ok;
+      if (raw_key_is(key, "ip")) {
+        ok = raw_string(idx, buf, len, &i, &ip);
+      } else if (raw_key_is(key, "port")) {
+        ok = raw_int(idx, buf, len, &i, &port);
+      } else {
+        ok = skip_value(idx, buf, len, &i);
+      }
+      if (!ok) {
+        return false;
+      }
+    }
+    if (i >= len) {
+      return false;
+    }
+    i++;
+
+    announce_peer(a, ip, port);
+  }
+
+  if (i >= len || buf[i] != 'e') {
+    return false;
+  }
+  *pos = i + 1;
+  return true;
+}
+
+// Decodes an announce response in one pass over the raw bytes, without
+// building a tree. Fields it does not know are skipped, which only
+// allocates for values nested more than 64 deep.
+// Returns false if the response is malformed; fields decoded before the
+// error are kept.
+bool bencode_decode_announce(const char *buf, size_t len, BencodeAnnounce *a) {
+  a->peers_len = 0;
+  a->peers6_len = 0;
+  a->dropped = 0;
+  a->interval = -1;
+  a->min_interval = -1;
+  a->complete = -1;
+  a->incomplete = -1;
+  a->failure_reason = (BencodeString){0};
+  a->warning_message = (BencodeString){0};
+  a->tracker_id = (BencodeString){0};
+
+  BencodeIndex idx = {0};
+  if (len == 0 || buf[0] != 'd') {
+    return false;
+  }
+
+  size_t i = 1;
+  while (i < len && buf[i] != 'e') {
+    BencodeString key;
+    if (!raw_string(&idx, buf, len, &i, &key) || i >= len) {
+      return false;
+    }
+
+    bool ok;
+    BencodeString peers;
+    if (raw_key_is(key, "peers") && buf[i] == 'l') {
+      ok = announce_peer_list(&idx, buf, len, &i, a);
+    } else if (raw_key_is(key, "peers")) {
+      ok = raw_string(&idx, buf, len, &i, &peers) &&
+           announce_compact4(a, peers);
+    } else if (raw_key_is(key, "peers6")) {
+      ok = raw_string(&idx, buf, len, &i, &peers) &&
+           announce_compact6(a, peers);
+    } else if (raw_key_is(key, "interval")) {
+      ok = raw_int(&idx, buf, len, &i, &a->interval);
+    } else if (raw_key_is(key, "min interval")) {
+      ok = raw_int(&idx, buf, len, &i, &a->min_interval);
+    } else if (raw_key_is(key, "complete")) {
+      ok = raw_int(&idx, buf, len, &i, &a->complete);
+    } else if (raw_key_is(key, "incomplete")) {
+      ok = raw_int(&idx, buf, len, &i, &a->incomplete);
+    } else if (raw_key_is(key, "failure reason")) {
+      ok = raw_string(&idx, buf, len, &i, &a->failure_reason);
+    } else if (raw_key_is(key, "warning message")) {
+      ok = raw_string(&idx, buf, len, &i, &a->warning_message);
+    } else if (raw_key_is(key, "tracker id")) {
+      ok = raw_string(&idx, buf, len, &i, &a->tracker_id);
+    } else {
+      ok = skip_value(&idx, buf, len, &i);
+    }
+    if (!ok) {
+      return false;
+    }
+  }
+
+  return i < len;
+}
+
+BencodeType bencode_int(long value) {
+  return (BencodeType){
+      .kind = INTEGER,
+      .asInt = value,
+  };
+}
+
+// The string is not copied; it must outlive the value.
+BencodeType bencode_str(const char *str, size_t len) {
+  return (BencodeType){
+      .kind = BYTESTRING,
+      .asString = {.len = len, .str = (char *)str},
+  };
+}
+
+BencodeType bencode_list(void) {
+  return (BencodeType){
+      .kind = LIST,
+  };
+}
+
+// An ERROR if the dict cannot be allocated.
+BencodeType bencode_dict(BencodeArena *a) {
+  BencodeType d;
+  bencode_dict_init(a, &d);
+  return d;
+}
+
+// Sets key to value, replacing any previous value. The key is not copied.
+// A replaced value is released with bencode_free(old, false) unless the dict
+// lives in an arena, so its strings stay the caller's. New keys go into the
+// unsorted tail; the encoders sort once. Returns false if a new key could not
+// be added.
+bool bencode_dict_set(BencodeType *dict, const char *key, size_t len,
+                      BencodeType value) {
+  BencodeType *existing = bencode_dict_get(dict->asDict, key, len);
+  if (existing) {
+    if (!dict->asDict->arena) {
+      bencode_free(existing, false);
+    }
+    *existing = value;
+    return true;
+  }
+
+  BencodeString k = {
+      .len = len,
+      .str = (char *)key,
+  };
+  return bencode_dict_insert(dict->asDict->arena, dict, k, value);
+}
+
+size_t decimal_length(long value) {
+  unsigned long v = value < 0 ? 0 - (unsigned long)value : (unsigned long)value;
+  size_t n = value < 0 ? 2 : 1;
+  while (v >= 10) {
+    v /= 10;
+    n++;
+  }
+  return n;
+}
+
+size_t encode_decimal(long value, char *out) {
+  size_t n = decimal_length(value);
+  unsigned long v = value < 0 ? 0 - (unsigned long)value : (unsigned long)value;
+  char *p = out + n;
+  do {
+    *--p = '0' + v % 10;
+    v /= 10;
+  } while (v);
+  if (value < 0) {
+    *--p = '-';
+  }
+  return n;
+}
+
+size_t bencode_encoded_size(BencodeType *t) {
+  switch (t->kind) {
+  case INTEGER:
+    return decimal_length(t->asInt) + 2;
+  case BYTESTRING:
+    return decimal_length(t->asString.len) + 1 + t->asString.len;
+  case LIST: {
+    size_t n = 2;
+    for (size_t i = 0; i < t->asList.len; i++) {
+      n += bencode_encoded_size(&t->asList.values[i]);
+    }
+    return n;
+  }
+  case DICTIONARY: {
+    size_t n = 2;
+    for (size_t i = 0; i < t->asDict->len; i++) {
+      BencodeDictEntry *e = &t->asDict->entries[i];
+      n += decimal_length(e->key.len) + 1 + e->key.len;
+      n += bencode_encoded_size(&e->value);
+    }
+    return n;
+  }
+  default:
+    return 0;
+  }
+}
+
+size_t encode_string_header(size_t len, char *out) {
+  size_t n = encode_decimal(len, out);
+  out[n++] = ':';
+  return n;
+}
+
+// Writes the canonical encoding of t, with dict keys in sorted order, and
+// returns the number of bytes written. out must have room for
+// bencode_encoded_size(t) bytes.
+size_t bencode_encode(BencodeType *t, char *out) {
+  char *p = out;
+
+  switch (t->kind) {
+  case INTEGER:
+    *p++ = 'i';
+    p += encode_decimal(t->asInt, p);
+    *p++ = 'e';
     break;
-  case 'd':
-    if (l->prev.type != COLON) {
-      t.type = DICT_START;
-      t.pos = l->pos;
+  case BYTESTRING:
+    p += encode_string_header(t->asString.len, p);
+    memcpy(p, t->asString.str, t->asString.len);
+    p += t->asString.len;
+    break;
+  case LIST:
+    *p++ = 'l';
+    for (size_t i = 0; i < t->asList.len; i++) {
+      p += bencode_encode(&t->asList.values[i], p);
+    }
+    *p++ = 'e';
+    break;
+  case DICTIONARY:
+    bencode_dict_sort(t->asDict);
+    *p++ = 'd';
+    for (size_t i = 0; i < t->asDict->len; i++) {
+      BencodeDictEntry *e = &t->asDict->entries[i];
+      p += encode_string_header(e->key.len, p);
+      memcpy(p, e->key.str, e->key.len);
+      p += e->key.len;
+      p += bencode_encode(&e->value, p);
+    }
+    *p++ = 'e';
+    break;
+  default:
+    break;
+  }
+
+  return p - out;
+}
+
+// Appends the encoding of t to b, growing it at most once. Returns false,
+// leaving b as it was, if it cannot grow.
+bool bencode_encode_buffer(BencodeBuffer *b, BencodeType *t) {
+  size_t n = bencode_encoded_size(t);
+  if (b->len + n > b->cap) {
+    size_t cap = b->cap ? b->cap : 64;
+    while (cap < b->len + n) {
+      cap *= 2;
+    }
+    char *data = BENCODE_REALLOC(b->data, cap);
+    if (!data) {
+      return false;
+    }
+    b->data = data;
+    b->cap = cap;
+  }
+
+  b->len += bencode_encode(t, b->data + b->len);
+  return true;
+}
+
+void free_buffer(BencodeBuffer *b) {
+  BENCODE_FREE(b->data);
+  *b = (BencodeBuffer){0};
+}
+
+// Counts the scratch bytes and iovec entries encode_iov will need.
+void iov_measure(BencodeType *t, size_t *scratch, size_t *iovcnt) {
+  switch (t->kind) {
+  case BYTESTRING:
+    if (t->asString.len >= BENCODE_IOV_MIN_STRING) {
+      *scratch += decimal_length(t->asString.len) + 1;
+      *iovcnt += 2;
+    } else {
+      *scratch += bencode_encoded_size(t);
+    }
+    break;
+  case LIST:
+    *scratch += 2;
+    for (size_t i = 0; i < t->asList.len; i++) {
+      iov_measure(&t->asList.values[i], scratch, iovcnt);
+    }
+    break;
+  case DICTIONARY:
+    bencode_dict_sort(t->asDict);
+    *scratch += 2;
+    for (size_t i = 0; i < t->asDict->len; i++) {
+      BencodeDictEntry *e = &t->asDict->entries[i];
+      *scratch += decimal_length(e->key.len) + 1 + e->key.len;
+      iov_measure(&e->value, scratch, iovcnt);
+    }
+    break;
+  default:
+    *scratch += bencode_encoded_size(t);
+    break;
+  }
+}
+
+typedef struct {
+  BencodeIov *v;
+  char *pending;
+  char *cursor;
+} IovWriter;
+
+void iov_flush(IovWriter *w) {
+  if (w->cursor > w->pending) {
+    w->v->iov[w->v->iovcnt++] = (struct iovec){
+        .iov_base = w->pending,
+        .iov_len = w->cursor - w->pending,
+    };
+  }
+  w->pending = w->cursor;
+}
+
+void iov_write(IovWriter *w, BencodeType *t) {
+  switch (t->kind) {
+  case BYTESTRING:
+    if (t->asString.len >= BENCODE_IOV_MIN_STRING) {
+      w->cursor += encode_string_header(t->asString.len, w->cursor);
+      iov_flush(w);
+      w->v->iov[w->v->iovcnt++] = (struct iovec){
+          .iov_base = t->asString.str,
+          .iov_len = t->asString.len,
+      };
+    } else {
+      w->cursor += bencode_encode(t, w->cursor);
+    }
+    break;
+  case LIST:
+    *w->cursor++ = 'l';
+    for (size_t i = 0; i < t->asList.len; i++) {
+      iov_write(w, &t->asList.values[i]);
+    }
+    *w->cursor++ = 'e';
+    break;
+  case DICTIONARY:
+    *w->cursor++ = 'd';
+    for (size_t i = 0; i < t->asDict->len; i++) {
+      BencodeDictEntry *e = &t->asDict->entries[i];
+      w->cursor += encode_string_header(e->key.len, w->cursor);
+      memcpy(w->cursor, e->key.str, e->key.len);
+      w->cursor += e->key.len;
+      iov_write(w, &e->value);
+    }
+    *w->cursor++ = 'e';
+    break;
+  default:
+    w->cursor += bencode_encode(t, w->cursor);
+    break;
+  }
+}
+
+// Fills v with an iovec list whose concatenation is the encoding of t.
+// Large string payloads are not copied, so t must outlive v. Returns false,
+// leaving v empty, if the iovecs cannot be allocated.
+bool bencode_encode_iov(BencodeIov *v, BencodeType *t) {
+  size_t scratch = 0;
+  size_t iovcnt = 1;
+  iov_measure(t, &scratch, &iovcnt);
+
+  free_iov(v);
+  v->scratch = BENCODE_MALLOC(scratch);
+  v->iov = BENCODE_MALLOC(iovcnt * sizeof(struct iovec));
+  if ((!v->scratch && scratch > 0) || !v->iov) {
+    free_iov(v);
+    return false;
+  }
+  v->iovcap = iovcnt;
+  v->len = bencode_encoded_size(t);
+
+  IovWriter w = {
+      .v = v,
+      .pending = v->scratch,
+      .cursor = v->scratch,
+  };
+  iov_write(&w, t);
+  iov_flush(&w);
+  return true;
+}
+
+void free_iov(BencodeIov *v) {
+  BENCODE_FREE(v->scratch);
+  BENCODE_FREE(v->iov);
+  *v = (BencodeIov){0};
+}
+
+#ifndef BENCODE_PARALLEL_BATCH
+#define BENCODE_PARALLEL_BATCH 64
+#endif
+
+typedef void (*parallel_fn)(void *ctx, size_t i);
+
+typedef struct {
+  parallel_fn fn;
+  void *ctx;
+  size_t n;
+  size_t batch;
+  size_t next;
+} ParallelFor;
+
+void *parallel_for_worker(void *arg) {
+  ParallelFor *job = arg;
+
+  for (;;) {
+    size_t first =
+        __atomic_fetch_add(&job->next, job->batch, __ATOMIC_RELAXED);
+    if (first >= job->n) {
       break;
     }
-  case 'l':
-    if (l->prev.type != COLON) {
-      t.type = LIST_START;
+
+    size_t last = first + job->batch;
+    if (last > job->n) {
+      last = job->n;
+    }
+
+    for (size_t i = first; i < last; i++) {
+      job->fn(job->ctx, i);
+    }
+  }
+
+  return NULL;
+}
+
+// Calls fn(ctx, i) for every i in [0, n) on up to threads threads (0 means
+// one per online CPU). Idle threads claim the next batch of indices from a
+// shared counter, so uneven work balances itself out.
+void parallel_for(size_t n, size_t batch, size_t threads, parallel_fn fn,
+                  void *ctx) {
+  ParallelFor job = {
+      .fn = fn,
+      .ctx = ctx,
+      .n = n,
+      .batch = batch ? batch : 1,
+  };
+
+  if (threads == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus > 0 ? cpus : 1;
+  }
+  size_t batches = (n + job.batch - 1) / job.batch;
+  if (threads > batches) {
+    threads = batches ? batches : 1;
+  }
+
+  pthread_t *workers = BENCODE_MALLOC(threads * sizeof(pthread_t));
+  size_t started = 0;
+  for (; workers && started + 1 < threads; started++) {
+    if (pthread_create(&workers[started], NULL, parallel_for_worker, &job) !=
+        0) {
       break;
     }
-  case 'i':
-    if (l->prev.type != COLON) {
-      t.type = INT_START;
+  }
+
+  // The calling thread works too, so progress is made even if no thread
+  // could be started.
+  parallel_for_worker(&job);
+  for (size_t i = 0; i < started; i++) {
+    pthread_join(workers[i], NULL);
+  }
+
+  BENCODE_FREE(workers);
+}
+
+void free_parser_errors(Parser *p) {
+  for (size_t i = 0; i < p->error_index; i++) {
+    free(p->errors[i]);
+  }
+  p->error_index = 0;
+}
+
+typedef struct {
+  size_t start;
+  size_t end;
+} RecordSpan;
+
+typedef struct {
+  size_t len;
+  size_t cap;
+  RecordSpan *values;
+} RecordSpans;
+
+typedef struct {
+  const char *buf;
+  const RecordSpans *records;
+  BencodeType *results;
+  bool zero_copy;
+  BencodeLimits limits;
+  bool failed;
+} ParallelJob;
+
+void parse_record(void *ctx, size_t i) {
+  ParallelJob *job = ctx;
+  RecordSpan r = job->records->values[i];
+  Parser p =
+      new_parser(new_lexer_from_buffer(job->buf + r.start, r.end - r.start));
+  p.zero_copy = job->zero_copy;
+  p.fail_fast = true;
+  p.limits = job->limits;
+  job->results[i] = parse_item(&p);
+  if (p.error.code != BENCODE_OK) {
+    __atomic_store_n(&job->failed, true, __ATOMIC_RELAXED);
+  }
+}
+
+// Parses a buffer of back-to-back top-level values on a pool of threads.
+// Record boundaries are found first with one sequential skip pass, then
+// workers claim batches of records and parse them into their slot of out,
+// so results come back in input order. Returns false if any record is
+// malformed; everything before the first unreadable record is still parsed.
+bool parse_parallel(const char *buf, size_t len, BencodeParallelOptions opts,
+                    BencodeList *out) {
+  RecordSpans records = {0};
+  RecordSpans *spans = &records;
+  da_init(spans, sizeof(RecordSpan));
+
+  BencodeIndex idx = {0};
+  size_t pos = 0;
+  bool ok = true;
+  while (pos < len) {
+    size_t start = pos;
+    if (!skip_value(&idx, buf, len, &pos)) {
+      ok = false;
       break;
     }
-  case 'e':
-    if (l->prev.type != COLON) {
-      t.type = END;
-      t.pos = l->pos;
+    if (!da_append(spans, ((RecordSpan){start, pos}))) {
+      ok = false;
       break;
     }
-  default:
-    if (l->prevprev.type == STRING_SIZE) {
-      t.type = STRING;
-      size_t n = l->prevprev.asInt;
-      t.asString = calloc(n, sizeof(char));
-
-      size_t i = 0;
-      for (; i < n - 1; i++, read_char(l)) {
-        t.asString[i] = l->ch;
-      }
-
-      t.asString[i] = l->ch;
-    } else if (isdigit(l->ch) || l->ch == '-') {
-      char buf[500];
-      memset(buf, 0, sizeof(buf));
-      size_t i = 0;
-      while (true) {
-        buf[i] = l->ch;
-        if (!isdigit(buf[i]) && l->ch != '-') {
-          t.type = ILLEGAL;
-          return t;
-        }
+  }
 
-        if (peek_char(l) == 'e' || peek_char(l) == ':') {
-          break;
-        }
+  if (records.len > UINT32_MAX) {
+    BENCODE_FREE(records.values);
+    *out = (BencodeList){0};
+    return false;
+  }
+
+  *out = (BencodeList){
+      .len = records.len,
+      .cap = records.len,
+      .values = BENCODE_MALLOC(records.len * sizeof(BencodeType)),
+  };
+  if (!out->values && records.len > 0) {
+    BENCODE_FREE(records.values);
+    *out = (BencodeList){0};
+    return false;
+  }
+
+  ParallelJob job = {
+      .buf = buf,
+      .records = &records,
+      .results = out->values,
+      .zero_copy = opts.zero_copy,
+      .limits = opts.limits,
+  };
+  parallel_for(records.len, BENCODE_PARALLEL_BATCH, opts.threads,
+               parse_record, &job);
+
+  BENCODE_FREE(records.values);
+  return ok && !job.failed;
+}
+
+typedef struct {
+  const char *const *paths;
+  BencodeBatchOptions opts;
+  BencodeBatchResult *results;
+} BatchJob;
+
+void parse_batch_file(void *ctx, size_t i) {
+  BatchJob *job = ctx;
+  BencodeBatchResult *r = &job->results[i];
+  *r = (BencodeBatchResult){
+      .path = job->paths[i],
+      .value = {.kind = ERROR},
+  };
+
+  Lexer l;
+  if (!lexer_map_file(&l, r->path)) {
+    snprintf(r->error, sizeof(r->error), "%s", strerror(errno));
+  } else {
+    r->bytes = l.bufsize;
+
+    // Without keep_values the tree only lives while the file is mapped, so
+    // there is no need to copy any string out of it.
+    Parser p = new_parser(l);
+    p.zero_copy = !job->opts.keep_values;
+    p.fail_fast = true;
+    p.limits = job->opts.limits;
+    r->value = parse_item(&p);
+
+    if (p.error.code != BENCODE_OK) {
+      snprintf(r->error, sizeof(r->error), "%s at byte %zu",
+               bencode_error_string(p.error.code), p.error.offset);
+    } else if (p.peek_token.type != END_OF_FILE) {
+      snprintf(r->error, sizeof(r->error), "trailing data after value");
+    } else {
+      r->ok = true;
+    }
+
+    if (job->opts.on_file) {
+      job->opts.on_file(job->opts.ctx, r);
+    }
+
+    if (!job->opts.keep_values) {
+      bencode_free(&r->value, false);
+    }
+    free_lexer(&p.l);
+  }
+
+  if (!r->ok) {
+    bencode_free(&r->value, true);
+  }
+}
+
+// Parses many files at once, one file per task, spread over opts.threads
+// threads. results must have room for n entries and receives one per path,
+// in the same order. Returns the number of files that parsed cleanly.
+size_t parse_batch(const char *const *paths, size_t n, BencodeBatchOptions opts,
+                   BencodeBatchResult *results) {
+  BatchJob job = {
+      .paths = paths,
+      .opts = opts,
+      .results = results,
+  };
+  parallel_for(n, 1, opts.threads, parse_batch_file, &job);
+
+  size_t ok = 0;
+  for (size_t i = 0; i < n; i++) {
+    ok += results[i].ok;
+  }
+  return ok;
+}
+
+// A path component from a torrent may not climb out of the download
+// directory.
+bool torrent_safe_component(BencodeType *c) {
+  if (c->kind != BYTESTRING) {
+    return false;
+  }
+
+  BencodeString s = c->asString;
+  return s.len > 0 && !memchr(s.str, '/', s.len) &&
+         !memchr(s.str, '\0', s.len) && !(s.len == 1 && s.str[0] == '.') &&
+         !(s.len == 2 && memcmp(s.str, "..", 2) == 0);
+}
+
+// Joins root, the torrent's name and, for multi-file torrents, the file's
+// path list with '/'. Returns NULL if a component is unsafe or the path
+// cannot be allocated.
+char *torrent_join_path(const char *root, BencodeType *name,
+                        BencodeList *rest) {
+  if (!torrent_safe_component(name)) {
+    return NULL;
+  }
+
+  size_t root_len = strlen(root);
+  size_t len = root_len + 1 + name->asString.len + 1;
+  for (size_t i = 0; rest && i < rest->len; i++) {
+    if (!torrent_safe_component(&rest->values[i])) {
+      return NULL;
+    }
+    len += rest->values[i].asString.len + 1;
+  }
+
+  char *path = BENCODE_MALLOC(len);
+  if (!path) {
+    return NULL;
+  }
+  char *at = path;
+  memcpy(at, root, root_len);
+  at += root_len;
+  *at++ = '/';
+  memcpy(at, name->asString.str, name->asString.len);
+  at += name->asString.len;
+  for (size_t i = 0; rest && i < rest->len; i++) {
+    BencodeString s = rest->values[i].asString;
+    *at++ = '/';
+    memcpy(at, s.str, s.len);
+    at += s.len;
+  }
+  *at = '\0';
+  return path;
+}
+
+// Describes the torrent whose data lives under root from its parsed info
+// dict. Returns false if the info dict is malformed, a file path is unsafe,
+// or the piece count does not match the total length.
+bool torrent_from_info(BencodeType *info, const char *root, BencodeTorrent *t) {
+  *t = (BencodeTorrent){0};
+  if (info->kind != DICTIONARY) {
+    return false;
+  }
+
+  BencodeDict *d = info->asDict;
+  BencodeType *pieces = bencode_dict_get(d, "pieces", 6);
+  BencodeType *piece_length = bencode_dict_get(d, "piece length", 12);
+  BencodeType *name = bencode_dict_get(d, "name", 4);
+  BencodeType *length = bencode_dict_get(d, "length", 6);
+  BencodeType *files = bencode_dict_get(d, "files", 5);
+  if (!pieces || pieces->kind != BYTESTRING ||
+      pieces->asString.len % 20 != 0 || !piece_length ||
+      piece_length->kind != INTEGER || piece_length->asInt <= 0 || !name) {
+    return false;
+  }
+
+  t->pieces = (const unsigned char *)pieces->asString.str;
+  t->pieces_len = pieces->asString.len / 20;
+  t->piece_length = piece_length->asInt;
 
-        i++;
-        read_char(l);
+  if (length) {
+    if (length->kind != INTEGER || length->asInt < 0 ||
+        (uint64_t)length->asInt > SIZE_MAX) {
+      return false;
+    }
+    t->files = BENCODE_MALLOC(sizeof(BencodeTorrentFile));
+    if (!t->files) {
+      return false;
+    }
+    t->files[0] = (BencodeTorrentFile){
+        .path = torrent_join_path(root, name, NULL),
+        .length = length->asInt,
+    };
+    t->files_len = 1;
+    t->total_length = length->asInt;
+    if (!t->files[0].path) {
+      goto fail;
+    }
+  } else if (files && files->kind == LIST && files->asList.len > 0) {
+    BencodeList *list = &files->asList;
+    t->files = BENCODE_MALLOC(list->len * sizeof(BencodeTorrentFile));
+    if (!t->files) {
+      return false;
+    }
+    for (size_t i = 0; i < list->len; i++) {
+      BencodeType *file = &list->values[i];
+      if (file->kind != DICTIONARY) {
+        goto fail;
       }
 
-      if (l->prev.type == INT_START) {
-        t.type = INT;
-      } else if (peek_char(l) == ':') {
-        t.type = STRING_SIZE;
+      BencodeType *file_length = bencode_dict_get(file->asDict, "length", 6);
+      BencodeType *path = bencode_dict_get(file->asDict, "path", 4);
+      if (!file_length || file_length->kind != INTEGER ||
+          file_length->asInt < 0 || !path || path->kind != LIST ||
+          path->asList.len == 0) {
+        goto fail;
+      }
+
+      t->files[t->files_len] = (BencodeTorrentFile){
+          .path = torrent_join_path(root, name, &path->asList),
+          .length = file_length->asInt,
+          .offset = t->total_length,
+      };
+      if (!t->files[t->files_len].path) {
+        goto fail;
+      }
+      t->files_len++;
+      // Hostile lengths could otherwise wrap the total and fake a piece
+      // count that matches.
+      if ((uint64_t)file_length->asInt > SIZE_MAX - t->total_length) {
+        goto fail;
+      }
+      t->total_length += file_length->asInt;
+    }
+  } else {
+    return false;
+  }
+
+  uint64_t expected = t->total_length / t->piece_length +
+                      (t->total_length % t->piece_length != 0);
+  if (expected != t->pieces_len) {
+    goto fail;
+  }
+  return true;
+
+fail:
+  free_torrent(t);
+  return false;
+}
+
+void free_torrent(BencodeTorrent *t) {
+  for (size_t i = 0; i < t->files_len; i++) {
+    BENCODE_FREE(t->files[i].path);
+  }
+  BENCODE_FREE(t->files);
+  *t = (BencodeTorrent){0};
+}
+
+const unsigned char *torrent_piece_hash(const BencodeTorrent *t,
+                                        size_t piece) {
+  return t->pieces + piece * 20;
+}
+
+// Index of the file holding byte offset of the torrent's data. Empty files
+// hold no bytes and are never returned for offsets inside the data.
+size_t torrent_file_at(const BencodeTorrent *t, uint64_t offset) {
+  size_t lo = 0;
+  size_t hi = t->files_len;
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (t->files[mid].offset <= offset) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+typedef struct {
+  const BencodeTorrent *t;
+  BencodeVerifyOptions opts;
+  // Each file's mapping, and how many of its bytes exist on disk.
+  const unsigned char **maps;
+  uint64_t *mapped;
+  bool *piece_ok;
+  size_t pieces_ok;
+  uint64_t bytes;
+} VerifyJob;
+
+void verify_piece(void *ctx, size_t piece) {
+  VerifyJob *job = ctx;
+  const BencodeTorrent *t = job->t;
+  uint64_t start = piece * t->piece_length;
+  uint64_t end = start + t->piece_length;
+  if (end > t->total_length) {
+    end = t->total_length;
+  }
+
+  BencodeSha1 sha;
+  sha1_init(&sha);
+  bool ok = true;
+  uint64_t pos = start;
+  for (size_t f = torrent_file_at(t, start); pos < end && ok; f++) {
+    const BencodeTorrentFile *file = &t->files[f];
+    uint64_t from = pos - file->offset;
+    uint64_t n = file->length - from;
+    if (n > end - pos) {
+      n = end - pos;
+    }
+
+    if (from + n > job->mapped[f]) {
+      ok = false;
+    } else if (n > 0) {
+      sha1_update(&sha, job->maps[f] + from, n);
+      __atomic_fetch_add(&job->bytes, n, __ATOMIC_RELAXED);
+    }
+    pos += n;
+  }
+
+  if (ok) {
+    unsigned char digest[20];
+    sha1_final(&sha, digest);
+    ok = memcmp(digest, torrent_piece_hash(t, piece), 20) == 0;
+  }
+
+  job->piece_ok[piece] = ok;
+  if (ok) {
+    __atomic_fetch_add(&job->pieces_ok, 1, __ATOMIC_RELAXED);
+  }
+  if (job->opts.on_piece) {
+    job->opts.on_piece(job->opts.ctx, piece, ok);
+  }
+}
+
+// Checks every piece against the data on disk, hashing pieces in parallel
+// straight from read-only mappings of the files. piece_ok must have room
+// for t->pieces_len entries. Missing, short or unreadable files fail the
+// pieces they overlap, as does every piece if the file table cannot be
+// allocated. Returns the number of pieces that verified.
+size_t torrent_verify(const BencodeTorrent *t, BencodeVerifyOptions opts,
+                      bool *piece_ok, BencodeVerifyStats *stats) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  double start = ts.tv_sec + ts.tv_nsec / 1e9;
+
+  VerifyJob job = {
+      .t = t,
+      .opts = opts,
+      .maps = BENCODE_MALLOC(t->files_len * sizeof(unsigned char *)),
+      .mapped = BENCODE_MALLOC(t->files_len * sizeof(uint64_t)),
+      .piece_ok = piece_ok,
+  };
+  if (!job.maps || !job.mapped) {
+    BENCODE_FREE(job.maps);
+    BENCODE_FREE(job.mapped);
+    memset(piece_ok, 0, t->pieces_len * sizeof(bool));
+    if (stats) {
+      *stats = (BencodeVerifyStats){0};
+    }
+    return 0;
+  }
+
+  for (size_t f = 0; f < t->files_len; f++) {
+    job.maps[f] = NULL;
+    job.mapped[f] = 0;
+
+    int fd = open(t->files[f].path, O_RDONLY);
+    struct stat st;
+    if (fd < 0) {
+      continue;
+    }
+    // Only map bytes that exist: touching a page past the end of the file
+    // raises SIGBUS.
+    uint64_t n = t->files[f].length;
+    if (fstat(fd, &st) == 0 && (uint64_t)st.st_size < n) {
+      n = st.st_size;
+    }
+    if (n > 0) {
+      void *map = mmap(NULL, n, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map != MAP_FAILED) {
+        madvise(map, n, MADV_SEQUENTIAL);
+        job.maps[f] = map;
+        job.mapped[f] = n;
+      }
+    }
+    close(fd);
+  }
+
+  parallel_for(t->pieces_len, 1, opts.threads, verify_piece, &job);
+
+  for (size_t f = 0; f < t->files_len; f++) {
+    if (job.maps[f]) {
+      munmap((void *)job.maps[f], job.mapped[f]);
+    }
+  }
+  BENCODE_FREE(job.maps);
+  BENCODE_FREE(job.mapped);
+
+  if (stats) {
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    double seconds = ts.tv_sec + ts.tv_nsec / 1e9 - start;
+    *stats = (BencodeVerifyStats){
+        .pieces_ok = job.pieces_ok,
+        .bytes = job.bytes,
+        .seconds = seconds,
+        .mb_per_s = seconds > 0 ? job.bytes / seconds / 1e6 : 0,
+    };
+  }
+  return job.pieces_ok;
+}
+
+// SHA-1 and SHA-256, FIPS 180-4. Whole blocks go through a kernel picked at
+// runtime: the SHA extensions where the CPU has them, portable C otherwise.
+typedef void (*sha1_kernel_t)(uint32_t state[5], const unsigned char *data,
+                              size_t blocks);
+typedef void (*sha256_kernel_t)(uint32_t state[8], const unsigned char *data,
+                                size_t blocks);
+
+uint32_t sha_rotl(uint32_t x, unsigned n) { return (x << n) | (x >> (32 - n)); }
+
+uint32_t sha_rotr(uint32_t x, unsigned n) { return (x >> n) | (x << (32 - n)); }
+
+uint32_t sha_load_be32(const unsigned char *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+         p[3];
+}
+
+void sha_store_be32(unsigned char *p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+void sha1_blocks_scalar(uint32_t state[5], const unsigned char *data,
+                        size_t blocks) {
+  for (; blocks > 0; blocks--, data += 64) {
+    uint32_t w[80];
+    for (int i = 0; i < 16; i++) {
+      w[i] = sha_load_be32(data + i * 4);
+    }
+    for (int i = 16; i < 80; i++) {
+      w[i] = sha_rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3],
+             e = state[4];
+    for (int i = 0; i < 80; i++) {
+      uint32_t f, k;
+      if (i < 20) {
+        f = (b & c) | (~b & d);
+        k = 0x5a827999;
+      } else if (i < 40) {
+        f = b ^ c ^ d;
+        k = 0x6ed9eba1;
+      } else if (i < 60) {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8f1bbcdc;
       } else {
-        t.type = ILLEGAL;
+        f = b ^ c ^ d;
+        k = 0xca62c1d6;
       }
 
-      t.asInt = strtol(buf, NULL, 10);
-    } else if (l->input && feof(l->input)) {
-      t.type = END_OF_FILE;
+      uint32_t t = sha_rotl(a, 5) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = sha_rotl(b, 30);
+      b = a;
+      a = t;
     }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
   }
+}
 
-  l->prevprev = l->prev;
-  l->prev = t;
+const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
 
-  return t;
+void sha256_blocks_scalar(uint32_t state[8], const unsigned char *data,
+                          size_t blocks) {
+  for (; blocks > 0; blocks--, data += 64) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+      w[i] = sha_load_be32(data + i * 4);
+    }
+    for (int i = 16; i < 64; i++) {
+      uint32_t s0 = sha_rotr(w[i - 15], 7) ^ sha_rotr(w[i - 15], 18) ^
+                    (w[i - 15] >> 3);
+      uint32_t s1 = sha_rotr(w[i - 2], 17) ^ sha_rotr(w[i - 2], 19) ^
+                    (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3],
+             e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++) {
+      uint32_t s1 = sha_rotr(e, 6) ^ sha_rotr(e, 11) ^ sha_rotr(e, 25);
+      uint32_t ch = (e & f) ^ (~e & g);
+      uint32_t t1 = h + s1 + ch + sha256_k[i] + w[i];
+      uint32_t s0 = sha_rotr(a, 2) ^ sha_rotr(a, 13) ^ sha_rotr(a, 22);
+      uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+      uint32_t t2 = s0 + maj;
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+  }
 }
 
-void parser_next_token(Parser *p) {
-  p->cur_token = p->peek_token;
-  p->peek_token = next_token(&p->l);
+#ifdef BENCODE_X86_SIMD
+// Four rounds of SHA-1 with the SHA extensions, also scheduling the message
+// words three groups ahead. Registers rotate between groups, so the caller
+// passes them in the order this group needs.
+#define SHA1_NI_ROUNDS(e_use, e_next, m0, m1, m2, m3, f)                       \
+  e_use = _mm_sha1nexte_epu32(e_use, m0);                                      \
+  e_next = abcd;                                                               \
+  m1 = _mm_sha1msg2_epu32(m1, m0);                                             \
+  abcd = _mm_sha1rnds4_epu32(abcd, e_use, f);                                  \
+  m3 = _mm_sha1msg1_epu32(m3, m0);                                             \
+  m2 = _mm_xor_si128(m2, m0);
+
+__attribute__((target("sha,sse4.1"))) void
+sha1_blocks_ni(uint32_t state[5], const unsigned char *data, size_t blocks) {
+  const __m128i mask =
+      _mm_set_epi64x(0x0001020304050607ull, 0x08090a0b0c0d0e0full);
+  __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state),
+                                   0x1b);
+  __m128i e0 = _mm_set_epi32(state[4], 0, 0, 0);
+  __m128i e1;
+
+  for (; blocks > 0; blocks--, data += 64) {
+    __m128i abcd_save = abcd;
+    __m128i e0_save = e0;
+
+    __m128i m0 = _mm_shuffle_epi8(
+        _mm_loadu_si128((const __m128i *)(data + 0)), mask);
+    __m128i m1 = _mm_shuffle_epi8(
+        _mm_loadu_si128((const __m128i *)(data + 16)), mask);
+    __m128i m2 = _mm_shuffle_epi8(
+        _mm_loadu_si128((const __m128i *)(data + 32)), mask);
+    __m128i m3 = _mm_shuffle_epi8(
+        _mm_loadu_si128((const __m128i *)(data + 48)), mask);
+
+    // Rounds 0-11 start the message schedule.
+    e0 = _mm_add_epi32(e0, m0);
+    e1 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+    e1 = _mm_sha1nexte_epu32(e1, m1);
+    e0 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+    m0 = _mm_sha1msg1_epu32(m0, m1);
+
+    e0 = _mm_sha1nexte_epu32(e0, m2);
+    e1 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+    m1 = _mm_sha1msg1_epu32(m1, m2);
+    m0 = _mm_xor_si128(m0, m2);
+
+    SHA1_NI_ROUNDS(e1, e0, m3, m0, m1, m2, 0);
+    SHA1_NI_ROUNDS(e0, e1, m0, m1, m2, m3, 0);
+    SHA1_NI_ROUNDS(e1, e0, m1, m2, m3, m0, 1);
+    SHA1_NI_ROUNDS(e0, e1, m2, m3, m0, m1, 1);
+    SHA1_NI_ROUNDS(e1, e0, m3, m0, m1, m2, 1);
+    SHA1_NI_ROUNDS(e0, e1, m0, m1, m2, m3, 1);
+    SHA1_NI_ROUNDS(e1, e0, m1, m2, m3, m0, 1);
+    SHA1_NI_ROUNDS(e0, e1, m2, m3, m0, m1, 2);
+    SHA1_NI_ROUNDS(e1, e0, m3, m0, m1, m2, 2);
+    SHA1_NI_ROUNDS(e0, e1, m0, m1, m2, m3, 2);
+    SHA1_NI_ROUNDS(e1, e0, m1, m2, m3, m0, 2);
+    SHA1_NI_ROUNDS(e0, e1, m2, m3, m0, m1, 2);
+    SHA1_NI_ROUNDS(e1, e0, m3, m0, m1, m2, 3);
+    SHA1_NI_ROUNDS(e0, e1, m0, m1, m2, m3, 3);
+    SHA1_NI_ROUNDS(e1, e0, m1, m2, m3, m0, 3);
+    SHA1_NI_ROUNDS(e0, e1, m2, m3, m0, m1, 3);
+    SHA1_NI_ROUNDS(e1, e0, m3, m0, m1, m2, 3);
+
+    e0 = _mm_sha1nexte_epu32(e0, e0_save);
+    abcd = _mm_add_epi32(abcd, abcd_save);
+  }
+
+  _mm_storeu_si128((__m128i *)state, _mm_shuffle_epi32(abcd, 0x1b));
+  state[4] = _mm_extract_epi32(e0, 3);
 }
 
-bool expect_peek(Parser *p, TokenType expected) {
-  if (p->peek_token.type != expected) {
-    char err[100];
-    sprintf(err, "ERROR: expected token %i", expected);
-    parse_error(p, err);
-    return false;
+// Four rounds of SHA-256 with the SHA extensions. m0 holds this group's
+// message words; m1 and m3 are the next and previous groups'.
+#define SHA256_NI_ROUNDS(m0, m1, m3, k)                                        \
+  msg = _mm_add_epi32(m0, _mm_loadu_si128((const __m128i *)&sha256_k[k]));     \
+  cdgh = _mm_sha256rnds2_epu32(cdgh, abef, msg);                               \
+  m1 = _mm_add_epi32(m1, _mm_alignr_epi8(m0, m3, 4));                          \
+  m1 = _mm_sha256msg2_epu32(m1, m0);                                           \
+  abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(msg, 0x0e));      \
+  m3 = _mm_sha256msg1_epu32(m3, m0);
+
+__attribute__((target("sha,sse4.1"))) void
+sha256_blocks_ni(uint32_t state[8], const unsigned char *data, size_t blocks) {
+  const __m128i mask =
+      _mm_set_epi64x(0x0c0d0e0f08090a0bull, 0x0405060700010203ull);
+  __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state),
+                                  0xb1);
+  __m128i cdgh = _mm_shuffle_epi32(
+      _mm_loadu_si128((const __m128i *)(state + 4)), 0x1b);
+  __m128i abef = _mm_alignr_epi8(tmp, cdgh, 8);
+  cdgh = _mm_blend_epi16(cdgh, tmp, 0xf0);
+
+  for (; blocks > 0; blocks--, data += 64) {
+    __m128i abef_save = abef;
+    __m128i cdgh_save = cdgh;
+    __m128i msg;
+
+    __m128i m0 = _mm_shuffle_epi8(
+        _mm_loadu_si128((const __m128i *)(data + 0)), mask);
+    __m128i m1 = _mm_shuffle_epi8(
+        _mm_loadu_si128((const __m128i *)(data + 16)), mask);
+    __m128i m2 = _mm_shuffle_epi8(
+        _mm_loadu_si128((const __m128i *)(data + 32)), mask);
+    __m128i m3 = _mm_shuffle_epi8(
+        _mm_loadu_si128((const __m128i *)(data + 48)), mask);
+
+    // Rounds 0-11 start the message schedule.
+    msg = _mm_add_epi32(m0, _mm_loadu_si128((const __m128i *)&sha256_k[0]));
+    cdgh = _mm_sha256rnds2_epu32(cdgh, abef, msg);
+    abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(msg, 0x0e));
+
+    msg = _mm_add_epi32(m1, _mm_loadu_si128((const __m128i *)&sha256_k[4]));
+    cdgh = _mm_sha256rnds2_epu32(cdgh, abef, msg);
+    abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(msg, 0x0e));
+    m0 = _mm_sha256msg1_epu32(m0, m1);
+
+    msg = _mm_add_epi32(m2, _mm_loadu_si128((const __m128i *)&sha256_k[8]));
+    cdgh = _mm_sha256rnds2_epu32(cdgh, abef, msg);
+    abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(msg, 0x0e));
+    m1 = _mm_sha256msg1_epu32(m1, m2);
+
+    SHA256_NI_ROUNDS(m3, m0, m2, 12);
+    SHA256_NI_ROUNDS(m0, m1, m3, 16);
+    SHA256_NI_ROUNDS(m1, m2, m0, 20);
+    SHA256_NI_ROUNDS(m2, m3, m1, 24);
+    SHA256_NI_ROUNDS(m3, m0, m2, 28);
+    SHA256_NI_ROUNDS(m0, m1, m3, 32);
+    SHA256_NI_ROUNDS(m1, m2, m0, 36);
+    SHA256_NI_ROUNDS(m2, m3, m1, 40);
+    SHA256_NI_ROUNDS(m3, m0, m2, 44);
+    SHA256_NI_ROUNDS(m0, m1, m3, 48);
+    SHA256_NI_ROUNDS(m1, m2, m0, 52);
+    SHA256_NI_ROUNDS(m2, m3, m1, 56);
+    SHA256_NI_ROUNDS(m3, m0, m2, 60);
+
+    abef = _mm_add_epi32(abef, abef_save);
+    cdgh = _mm_add_epi32(cdgh, cdgh_save);
   }
 
-  parser_next_token(p);
-  return true;
+  tmp = _mm_shuffle_epi32(abef, 0x1b);
+  cdgh = _mm_shuffle_epi32(cdgh, 0xb1);
+  _mm_storeu_si128((__m128i *)state, _mm_blend_epi16(tmp, cdgh, 0xf0));
+  _mm_storeu_si128((__m128i *)(state + 4), _mm_alignr_epi8(cdgh, tmp, 8));
 }
+#endif
 
-void parse_error(Parser *p, char *error) {
-  p->errors[p->error_index++] = strdup(error);
+sha1_kernel_t sha1_kernel = NULL;
+sha256_kernel_t sha256_kernel = NULL;
+pthread_once_t sha_kernels_once = PTHREAD_ONCE_INIT;
+
+// Runs once, from the first sha1_init or sha256_init on any thread.
+void sha_select_kernels(void) {
+  sha1_kernel = sha1_blocks_scalar;
+  sha256_kernel = sha256_blocks_scalar;
+#ifdef BENCODE_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1")) {
+    sha1_kernel = sha1_blocks_ni;
+    sha256_kernel = sha256_blocks_ni;
+  }
+#endif
 }
 
-Parser new_parser(Lexer l) {
-  Parser p = {
-      .l = l,
+// Buffers partial blocks and hands whole ones to the kernel. Both hashes use
+// the same 64-byte block and length padding.
+void sha_absorb(unsigned char *block, size_t *used, uint64_t *total,
+                const unsigned char *data, size_t len,
+                void (*blocks)(void *, const unsigned char *, size_t),
+                void *state) {
+  *total += len;
+  if (*used > 0) {
+    size_t n = 64 - *used < len ? 64 - *used : len;
+    memcpy(block + *used, data, n);
+    *used += n;
+    data += n;
+    len -= n;
+    if (*used < 64) {
+      return;
+    }
+    blocks(state, block, 1);
+    *used = 0;
+  }
+
+  if (len >= 64) {
+    blocks(state, data, len / 64);
+    data += len / 64 * 64;
+    len %= 64;
+  }
+
+  memcpy(block, data, len);
+  *used = len;
+}
+
+void sha_pad(unsigned char *block, size_t used, uint64_t total,
+             void (*blocks)(void *, const unsigned char *, size_t),
+             void *state) {
+  block[used++] = 0x80;
+  if (used > 56) {
+    memset(block + used, 0, 64 - used);
+    blocks(state, block, 1);
+    used = 0;
+  }
+  memset(block + used, 0, 56 - used);
+
+  uint64_t bits = total * 8;
+  for (int i = 0; i < 8; i++) {
+    block[63 - i] = bits >> (i * 8);
+  }
+  blocks(state, block, 1);
+}
+
+void sha1_run_kernel(void *state, const unsigned char *data, size_t blocks) {
+  sha1_kernel(state, data, blocks);
+}
+
+void sha256_run_kernel(void *state, const unsigned char *data, size_t blocks) {
+  sha256_kernel(state, data, blocks);
+}
+
+void sha1_init(BencodeSha1 *c) {
+  pthread_once(&sha_kernels_once, sha_select_kernels);
+
+  *c = (BencodeSha1){
+      .state = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0},
   };
-  p.cur_token = next_token(&p.l);
-  p.peek_token = next_token(&p.l);
+}
 
-  return p;
+void sha1_update(BencodeSha1 *c, const void *data, size_t len) {
+  sha_absorb(c->block, &c->used, &c->len, data, len, sha1_run_kernel,
+             c->state);
+}
+
+void sha1_final(BencodeSha1 *c, unsigned char out[20]) {
+  sha_pad(c->block, c->used, c->len, sha1_run_kernel, c->state);
+  for (int i = 0; i < 5; i++) {
+    sha_store_be32(out + i * 4, c->state[i]);
+  }
+}
+
+void bencode_sha1(const void *data, size_t len, unsigned char out[20]) {
+  BencodeSha1 c;
+  sha1_init(&c);
+  sha1_update(&c, data, len);
+  sha1_final(&c, out);
+}
+
+void sha256_init(BencodeSha256 *c) {
+  pthread_once(&sha_kernels_once, sha_select_kernels);
+
+  *c = (BencodeSha256){
+      .state = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f,
+                0x9b05688c, 0x1f83d9ab, 0x5be0cd19},
+  };
+}
+
+void sha256_update(BencodeSha256 *c, const void *data, size_t len) {
+  sha_absorb(c->block, &c->used, &c->len, data, len, sha256_run_kernel,
+             c->state);
+}
+
+void sha256_final(BencodeSha256 *c, unsigned char out[32]) {
+  sha_pad(c->block, c->used, c->len, sha256_run_kernel, c->state);
+  for (int i = 0; i < 8; i++) {
+    sha_store_be32(out + i * 4, c->state[i]);
+  }
+}
+
+void bencode_sha256(const void *data, size_t len, unsigned char out[32]) {
+  BencodeSha256 c;
+  sha256_init(&c);
+  sha256_update(&c, data, len);
+  sha256_final(&c, out);
 }
 
 #endif // BENCODE_IMPLEMENTATION
@@ -10,9 +10,16 @@
 
 typedef size_t (*hasher_t)(void *, const void *, size_t);
 typedef bool (*comparer_t)(const void *, size_t, const void *, size_t);
+typedef void *(*allocator_t)(void *ctx, size_t size);
+typedef void (*deallocator_t)(void *ctx, void *ptr);
 
 typedef struct hash_position_t {
   bool in_use;
+  // Deleted slot that lookups must probe past. Only the quadratic and double
+  // hash strategies leave these; linear probing shifts entries back instead.
+  bool tombstone;
+  // Full hasher output, so probing and rehashing rarely touch the key.
+  size_t hash;
   const void *key;
   size_t key_len;
   void *value;
@@ -20,7 +27,7 @@ typedef struct hash_position_t {
 
 typedef enum {
   PROBE_LINEAR,
-  PROBE_QUADRATIC, // TODO: implement
+  PROBE_QUADRATIC,
   PROBE_DOUBLE_HASH,
 } probe_strategy;
 
@@ -29,10 +36,36 @@ typedef struct hash_options_t {
   hasher_t double_hasher;
   comparer_t comparer;
   probe_strategy strategy;
+  // Minimum number of slots, rounded up to a power of two.
   size_t size;
+  // Number of entries the table should hold before it first grows.
   size_t used;
+  // Grow by moving a few slots on every operation instead of all at once.
+  bool incremental;
+  // Optional allocator for the slot array and deleted values. When unset,
+  // HASH_TABLE_MALLOC and HASH_TABLE_FREE are used.
+  allocator_t allocator;
+  deallocator_t deallocator;
+  void *allocator_ctx;
 } hash_options_t;
 
+#ifdef HASH_TABLE_STATS
+#ifndef HASH_TABLE_PROBE_BUCKETS
+#define HASH_TABLE_PROBE_BUCKETS 16
+#endif
+
+// Operation counts, kept only when built with HASH_TABLE_STATS. probes[n-1]
+// counts searches that looked at n slots; the last bucket also takes every
+// longer one. Counters are bumped with relaxed atomic adds, so a table that
+// is only read can still be shared between threads.
+typedef struct hash_table_stats_t {
+  size_t inserts;
+  size_t lookups;
+  size_t rehashes;
+  size_t probes[HASH_TABLE_PROBE_BUCKETS];
+} hash_table_stats_t;
+#endif
+
 typedef struct hash_table_t {
   probe_strategy strategy;
   hasher_t hasher;
@@ -42,14 +75,50 @@ typedef struct hash_table_t {
   size_t p;
   hash_position_t *values;
   size_t used;
+  size_t tombstones;
+  bool incremental;
+  // While an incremental resize is in progress, entries at or past
+  // old_migrated in old_values have not been moved to values yet.
+  hash_position_t *old_values;
+  size_t old_size;
+  size_t old_migrated;
+  // An incremental resize first clears its new array, next_zeroed slots at
+  // a time, while the table keeps using values; then it starts migrating.
+  hash_position_t *next_values;
+  size_t next_size;
+  size_t next_zeroed;
+  allocator_t allocator;
+  deallocator_t deallocator;
+  void *allocator_ctx;
+#ifdef HASH_TABLE_STATS
+  hash_table_stats_t stats;
+#endif
 } hash_table_t;
 
+typedef struct hash_probe_stats_t {
+  size_t entries;
+  size_t total_probes;
+  size_t max_probes;
+  double mean_probes;
+} hash_probe_stats_t;
+
 void *hash_table_lookup(hash_table_t *table, const void *key, size_t key_len);
 void hash_table_delete(hash_table_t *table, const void *key, size_t key_len);
-void hash_table_insert(hash_table_t *table, const void *key, size_t key_len,
+bool hash_table_insert(hash_table_t *table, const void *key, size_t key_len,
                        void *value);
-void hash_table_init(hash_table_t *table);
-void hash_table_init_ex(hash_table_t *table, hash_options_t options);
+bool hash_table_insert_with_hash(hash_table_t *table, size_t hash,
+                                 const void *key, size_t key_len,
+                                 void *value);
+void *hash_table_lookup_with_hash(hash_table_t *table, size_t hash,
+                                  const void *key, size_t key_len);
+bool hash_table_init(hash_table_t *table);
+bool hash_table_init_ex(hash_table_t *table, hash_options_t options);
+void hash_table_free(hash_table_t *table);
+bool hash_table_reserve(hash_table_t *table, size_t n);
+hash_probe_stats_t hash_table_probe_stats(hash_table_t *table);
+
+size_t wy_hash(void *table, const void *key, size_t len);
+size_t fnv_hash(void *table, const void *key, size_t len);
 
 bool memcmp_comparer(const void *a, size_t a_len, const void *b, size_t b_len);
 
@@ -73,31 +142,127 @@ bool memcmp_comparer(const void *a, size_t a_len, const void *b, size_t b_len);
 #define HASH_TABLE_LOAD_FACTOR_THRESHOLD 0.65f
 #endif
 
-int buf_as_int(const void *key, size_t size) {
-  const uint8_t *s = (const uint8_t *)key;
-  int acc = 1;
-  for (size_t i = 0; i < size; i++) {
-    acc *= s[i] + i;
+// Old slots moved per operation while an incremental resize is in progress.
+#ifndef HASH_TABLE_REHASH_STEP
+#define HASH_TABLE_REHASH_STEP 64
+#endif
+
+void *hash_table_alloc(hash_table_t *table, size_t size) {
+  if (table->allocator) {
+    return table->allocator(table->allocator_ctx, size);
   }
 
-  return acc;
+  return HASH_TABLE_MALLOC(size);
 }
 
-// "Introduction to Algorithms, third edition", Cormen et al., 13.3.2 p:263
-// "The Art of Computer Programming, Volume 3, Sorting and Searching", D.E.
-// Knuth, 6.4 p:516
-size_t knuth_hash(void *t, const void *key, size_t len) {
-  hash_table_t *table = t;
-  size_t knuth = 2654435769L;
-  size_t key_as_int = buf_as_int(key, len);
-  size_t hash = (key_as_int * knuth) >> (32 - table->p);
+void hash_table_dealloc(hash_table_t *table, void *ptr) {
+  if (table->allocator) {
+    if (table->deallocator) {
+      table->deallocator(table->allocator_ctx, ptr);
+    }
+    return;
+  }
+
+  HASH_TABLE_FREE(ptr);
+}
+
+#ifdef HASH_TABLE_STATS
+#define HASH_TABLE_COUNT(table, counter)                                       \
+  ((void)__atomic_fetch_add(&(table)->stats.counter, 1, __ATOMIC_RELAXED))
+#else
+#define HASH_TABLE_COUNT(table, counter) ((void)0)
+#endif
+
+void hash_table_count_probes(hash_table_t *table, size_t n) {
+#ifdef HASH_TABLE_STATS
+  size_t bucket = n < HASH_TABLE_PROBE_BUCKETS ? n : HASH_TABLE_PROBE_BUCKETS;
+  __atomic_fetch_add(&table->stats.probes[bucket - 1], 1, __ATOMIC_RELAXED);
+#else
+  (void)table;
+  (void)n;
+#endif
+}
+
+#ifndef HASH_TABLE_SEED
+#define HASH_TABLE_SEED 0
+#endif
 
-  return hash % table->size;
+uint64_t wy_read8(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+uint64_t wy_read4(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+uint64_t wy_mix(uint64_t a, uint64_t b) {
+  __uint128_t r = (__uint128_t)a * b;
+  return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+// https://github.com/wangyi-fudan/wyhash (final version 4)
+// Hashers return the full 64-bit hash; the table reduces it to a slot.
+size_t wy_hash(void *t, const void *key, size_t len) {
+  (void)t;
+  static const uint64_t secret[4] = {
+      0xa0761d6478bd642full,
+      0xe7037ed1a0b428dbull,
+      0x8ebc6af09c88c6e3ull,
+      0x589965cc75374cc3ull,
+  };
+  const uint8_t *p = (const uint8_t *)key;
+  uint64_t seed =
+      HASH_TABLE_SEED ^ wy_mix(HASH_TABLE_SEED ^ secret[0], secret[1]);
+  uint64_t a, b;
+
+  if (len <= 16) {
+    if (len >= 4) {
+      a = (wy_read4(p) << 32) | wy_read4(p + ((len >> 3) << 2));
+      b = (wy_read4(p + len - 4) << 32) |
+          wy_read4(p + len - 4 - ((len >> 3) << 2));
+    } else if (len > 0) {
+      a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    size_t i = len;
+    if (i > 48) {
+      uint64_t see1 = seed, see2 = seed;
+      do {
+        seed = wy_mix(wy_read8(p) ^ secret[1], wy_read8(p + 8) ^ seed);
+        see1 = wy_mix(wy_read8(p + 16) ^ secret[2], wy_read8(p + 24) ^ see1);
+        see2 = wy_mix(wy_read8(p + 32) ^ secret[3], wy_read8(p + 40) ^ see2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= see1 ^ see2;
+    }
+    while (i > 16) {
+      seed = wy_mix(wy_read8(p) ^ secret[1], wy_read8(p + 8) ^ seed);
+      i -= 16;
+      p += 16;
+    }
+    a = wy_read8(p + i - 16);
+    b = wy_read8(p + i - 8);
+  }
+
+  a ^= secret[1];
+  b ^= seed;
+  __uint128_t r = (__uint128_t)a * b;
+  a = (uint64_t)r;
+  b = (uint64_t)(r >> 64);
+  return wy_mix(a ^ secret[0] ^ len, b ^ secret[1]);
 }
 
 // https://en.wikipedia.org/wiki/Fowler%E2%80%93Noll%E2%80%93Vo_hash_function
 size_t fnv_hash(void *t, const void *key, size_t len) {
-  hash_table_t *table = t;
+  (void)t;
   size_t fnv_prime = 1099511628211U;
   size_t fnv_offset = 14695981039346656037U;
 
@@ -110,14 +275,43 @@ size_t fnv_hash(void *t, const void *key, size_t len) {
     hash ^= s[i];
   }
 
-  return hash % table->size;
+  return hash;
+}
+
+// Smallest power of two that holds n entries under the load factor.
+size_t hash_table_capacity_for(size_t n) {
+  size_t size = 8;
+  while ((double)n > size * (double)HASH_TABLE_LOAD_FACTOR_THRESHOLD) {
+    size <<= 1;
+  }
+  return size;
+}
+
+// The slots are not cleared; see hash_table_alloc_slots.
+hash_position_t *hash_table_alloc_slots_raw(hash_table_t *table,
+                                            size_t size) {
+  if (size > SIZE_MAX / sizeof(hash_position_t)) {
+    return NULL;
+  }
+
+  return hash_table_alloc(table, size * sizeof(hash_position_t));
+}
+
+hash_position_t *hash_table_alloc_slots(hash_table_t *table, size_t size) {
+  hash_position_t *values = hash_table_alloc_slots_raw(table, size);
+  if (values) {
+    memset(values, 0, size * sizeof(hash_position_t));
+  }
+  return values;
 }
 
-void hash_table_init_ex(hash_table_t *table, hash_options_t options) {
+// Returns false if the slot array cannot be allocated. The table is still
+// usable: lookups miss, and the first insert tries to allocate it again.
+bool hash_table_init_ex(hash_table_t *table, hash_options_t options) {
   if (options.hasher) {
     table->hasher = options.hasher;
   } else {
-    table->hasher = knuth_hash;
+    table->hasher = wy_hash;
   }
 
   if (options.strategy == PROBE_DOUBLE_HASH) {
@@ -128,20 +322,63 @@ void hash_table_init_ex(hash_table_t *table, hash_options_t options) {
     }
   }
   table->strategy = options.strategy;
-  table->p = rand() % 32;
-  table->size = options.size;
-  table->values = HASH_TABLE_MALLOC(options.size * sizeof(hash_position_t));
-  table->comparer = options.comparer;
-  memset(table->values, 0, options.size * sizeof(hash_position_t));
+  // Probing masks hashes with size - 1, so the size is always a power of two.
+  size_t size = hash_table_capacity_for(options.used);
+  table->p = 3;
+  while (((size_t)1 << table->p) < options.size ||
+         ((size_t)1 << table->p) < size) {
+    table->p++;
+  }
+  table->size = (size_t)1 << table->p;
+  table->used = 0;
+  table->tombstones = 0;
+  table->incremental = options.incremental;
+  table->old_values = NULL;
+  table->old_size = 0;
+  table->old_migrated = 0;
+  table->next_values = NULL;
+  table->next_size = 0;
+  table->next_zeroed = 0;
+  table->allocator = options.allocator;
+  table->deallocator = options.deallocator;
+  table->allocator_ctx = options.allocator_ctx;
+  table->values = hash_table_alloc_slots(table, table->size);
+#ifdef HASH_TABLE_STATS
+  table->stats = (hash_table_stats_t){0};
+#endif
+  if (options.comparer) {
+    table->comparer = options.comparer;
+  } else {
+    table->comparer = memcmp_comparer;
+  }
+  return table->values != NULL;
 }
 
+void hash_table_free(hash_table_t *table) {
+  hash_table_dealloc(table, table->values);
+  if (table->old_values) {
+    hash_table_dealloc(table, table->old_values);
+  }
+  if (table->next_values) {
+    hash_table_dealloc(table, table->next_values);
+  }
+  table->values = NULL;
+  table->old_values = NULL;
+  table->next_values = NULL;
+  table->size = 0;
+  table->old_size = 0;
+  table->used = 0;
+  table->tombstones = 0;
+}
+
+// Interned keys are the same pointer, so that is checked before the bytes.
 bool memcmp_comparer(const void *a, size_t a_len, const void *b, size_t b_len) {
-  return a_len == b_len && (memcmp(a, b, a_len) == 0);
+  return a_len == b_len && (a == b || memcmp(a, b, a_len) == 0);
 }
 
-void hash_table_init(hash_table_t *table) {
+bool hash_table_init(hash_table_t *table) {
   hash_options_t default_options = {
-      .hasher = knuth_hash,
+      .hasher = wy_hash,
       .comparer = memcmp_comparer,
       .strategy = PROBE_LINEAR,
       .size = 1 << 10,
@@ -149,96 +386,333 @@ void hash_table_init(hash_table_t *table) {
   return hash_table_init_ex(table, default_options);
 }
 
-size_t linear_probe(hash_table_t *table, int hash, size_t i) {
-  return (hash + i) % table->size;
+size_t linear_probe(size_t size, size_t hash, size_t i) {
+  return (hash + i) & (size - 1);
+}
+
+// Triangular numbers (0, 1, 3, 6, ...) visit every slot of a power of two
+// sized table exactly once.
+size_t quadratic_probe(size_t size, size_t hash, size_t i) {
+  return (hash + i * (i + 1) / 2) & (size - 1);
 }
 
 // "Introduction to Algorithms, third edition", Cormen et al., 13.3.2 p:272
-// Assuming that the table size is always a power of two, we modify the second
-// hash to always return an odd number, such that the second hash and the table
-// size are coprime to each other. That guarantees that the whole table will be
+// The table size is always a power of two, so we modify the second hash to
+// always return an odd number, such that the second hash and the table size
+// are coprime to each other. That guarantees that the whole table will be
 // searched.
-size_t double_hash(hash_table_t *table, int hash, const char *key,
-                   size_t key_len, size_t i) {
+size_t double_hash(hash_table_t *table, size_t size, size_t hash,
+                   const char *key, size_t key_len, size_t i) {
   assert(table->double_hasher &&
          "To use double hash, you must provide a second hash function");
-  int second_hash = table->double_hasher(table, key, key_len) |
-                    1; // Always use an odd second hash
-  return (hash + (i * second_hash)) % table->size;
+  size_t second_hash = table->double_hasher(table, key, key_len) |
+                       1; // Always use an odd second hash
+  return (hash + (i * second_hash)) & (size - 1);
 }
 
-size_t probe(hash_table_t *table, int hash, const char *key, size_t key_len,
-             size_t i) {
+// Slot of the i-th probe in a slot array of the given size, which is either
+// the table's current array or, during a resize, the old one.
+size_t probe(hash_table_t *table, size_t size, size_t hash, const char *key,
+             size_t key_len, size_t i) {
   switch (table->strategy) {
   case PROBE_LINEAR:
-    return linear_probe(table, hash, i);
+    return linear_probe(size, hash, i);
+  case PROBE_QUADRATIC:
+    return quadratic_probe(size, hash, i);
   case PROBE_DOUBLE_HASH:
-    return double_hash(table, hash, key, key_len, i);
+    return double_hash(table, size, hash, key, key_len, i);
   default:
     assert(0 && "not implemented");
+    return 0;
   }
 }
 
-double load_factor(hash_table_t *t) {
-  return (double)t->used / (double)t->size;
+// How far a linearly probed entry sits from its home slot.
+size_t probe_distance(size_t size, size_t hash, size_t idx) {
+  return (idx - hash) & (size - 1);
 }
 
-void rehash(hash_table_t *t) {
-  hash_position_t *old_values = t->values;
-  size_t old_size = t->size;
-  t->size *= 2;
-  t->used = 0;
+double load_factor(hash_table_t *t) {
+  return (double)(t->used + t->tombstones) / (double)t->size;
+}
 
-  t->values = HASH_TABLE_MALLOC(t->size * sizeof(hash_position_t));
-  memset(t->values, 0, t->size * sizeof(hash_position_t));
+// Robin Hood insertion: an entry that is closer to its home slot than the
+// one being inserted gives up its slot and moves further along. That keeps
+// probe lengths even, and lets lookups stop as soon as they pass an entry
+// closer to home than the key they are looking for.
+void robin_hood_insert(hash_table_t *table, hash_position_t entry) {
+  size_t idx = entry.hash & (table->size - 1);
+  size_t distance = 0;
+  for (;;) {
+    hash_position_t *position = &table->values[idx];
+    if (!position->in_use) {
+      *position = entry;
+      return;
+    }
 
-  for (size_t i = 0; i < old_size; i++) {
-    if (old_values[i].in_use) {
-      hash_table_insert(t, old_values[i].key, old_values[i].key_len,
-                        old_values[i].value);
+    size_t existing = probe_distance(table->size, position->hash, idx);
+    if (existing < distance) {
+      hash_position_t displaced = *position;
+      *position = entry;
+      entry = displaced;
+      distance = existing;
     }
-  }
 
-  HASH_TABLE_FREE(old_values);
+    idx = (idx + 1) & (table->size - 1);
+    distance++;
+  }
 }
 
-void hash_table_insert(hash_table_t *table, const void *key, size_t key_len,
-                       void *value) {
-  if (load_factor(table) > HASH_TABLE_LOAD_FACTOR_THRESHOLD) {
-    rehash(table);
+// Places an entry in the current slot array. Callers account for used.
+void hash_table_place(hash_table_t *table, hash_position_t entry) {
+  if (table->strategy == PROBE_LINEAR) {
+    robin_hood_insert(table, entry);
+    return;
   }
 
-  int hash = table->hasher(table, key, key_len);
   for (size_t i = 0; i < table->size; i++) {
-    size_t idx = probe(table, hash, key, key_len, i);
+    size_t idx =
+        probe(table, table->size, entry.hash, entry.key, entry.key_len, i);
     hash_position_t *position = &table->values[idx];
     if (!position->in_use) {
-      position->in_use = true;
-      position->key = key;
-      position->key_len = key_len;
-      position->value = value;
-      table->used++;
-      break;
+      if (position->tombstone) {
+        table->tombstones--;
+      }
+      *position = entry;
+      return;
     }
   }
 }
 
-hash_position_t *hash_table_lookup_internal(hash_table_t *table,
-                                            const void *key, size_t key_len) {
-  int hash = table->hasher(table, key, key_len);
+// Makes a cleared slot array current, keeping the previous one as
+// old_values until its entries have been moved over.
+void hash_table_switch(hash_table_t *t, hash_position_t *values, size_t size) {
+  t->old_values = t->values;
+  t->old_size = t->size;
+  t->old_migrated = 0;
+  t->size = size;
+  t->p = 0;
+  while (((size_t)1 << t->p) < size) {
+    t->p++;
+  }
+  t->tombstones = 0;
+  t->values = values;
+}
 
-  for (size_t i = 0; i < table->size; i++) {
-    size_t idx = probe(table, hash, key, key_len, i);
-    hash_position_t *current = &table->values[idx];
+// Does up to n slots of resize work: clearing the pending array, then
+// moving old slots into the current one. A moved slot becomes a tombstone
+// rather than empty, so probe chains through the old array stay intact for
+// the entries that have not been moved yet.
+void hash_table_migrate(hash_table_t *t, size_t n) {
+  if (t->next_values) {
+    size_t left = t->next_size - t->next_zeroed;
+    size_t step = n < left ? n : left;
+    memset(t->next_values + t->next_zeroed, 0,
+           step * sizeof(hash_position_t));
+    t->next_zeroed += step;
+    n -= step;
+    if (t->next_zeroed < t->next_size) {
+      return;
+    }
+
+    hash_table_switch(t, t->next_values, t->next_size);
+    t->next_values = NULL;
+    t->next_size = 0;
+    t->next_zeroed = 0;
+  }
+
+  if (!t->old_values) {
+    return;
+  }
+
+  for (; n > 0 && t->old_migrated < t->old_size; n--) {
+    hash_position_t *old = &t->old_values[t->old_migrated++];
+    if (old->in_use) {
+      hash_table_place(t, *old);
+      *old = (hash_position_t){.tombstone = true};
+    }
+  }
+
+  if (t->old_migrated == t->old_size) {
+    hash_table_dealloc(t, t->old_values);
+    t->old_values = NULL;
+    t->old_size = 0;
+    t->old_migrated = 0;
+  }
+}
+
+// Switches to a new slot array of the given size and moves the old entries
+// over, all at once unless the table is incremental. An incremental table
+// also clears the new array a step at a time, so no single operation pays
+// for the whole of it. Returns false, leaving the table as it was, if the
+// new array cannot be allocated.
+bool hash_table_resize(hash_table_t *t, size_t size) {
+  // A resize that starts before the previous one finished completes it first.
+  hash_table_migrate(t, SIZE_MAX);
+
+  if (t->incremental) {
+    hash_position_t *values = hash_table_alloc_slots_raw(t, size);
+    if (!values) {
+      return false;
+    }
+
+    t->next_values = values;
+    t->next_size = size;
+    t->next_zeroed = 0;
+    return true;
+  }
+
+  hash_position_t *values = hash_table_alloc_slots(t, size);
+  if (!values) {
+    return false;
+  }
+
+  hash_table_switch(t, values, size);
+  hash_table_migrate(t, SIZE_MAX);
+  return true;
+}
+
+// Retries the slot array hash_table_init_ex could not allocate.
+bool hash_table_ensure_slots(hash_table_t *table) {
+  if (!table->values) {
+    table->values = hash_table_alloc_slots(table, table->size);
+  }
+  return table->values != NULL;
+}
+
+// Doubles the table, unless it is mostly tombstones, in which case
+// rebuilding it at the same size is enough to clear them.
+bool rehash(hash_table_t *t) {
+  HASH_TABLE_COUNT(t, rehashes);
+  size_t size = t->size;
+  if (t->tombstones < t->used) {
+    size *= 2;
+  }
+  return hash_table_resize(t, size);
+}
+
+bool hash_table_reserve(hash_table_t *table, size_t n) {
+  size_t size = hash_table_capacity_for(n);
+  if (size > table->size) {
+    if (!hash_table_ensure_slots(table) || !hash_table_resize(table, size)) {
+      return false;
+    }
+    hash_table_migrate(table, SIZE_MAX);
+  }
+  return true;
+}
+
+void hash_table_insert_hashed(hash_table_t *table, size_t hash,
+                              const void *key, size_t key_len, void *value) {
+  hash_table_place(table, (hash_position_t){
+                              .in_use = true,
+                              .hash = hash,
+                              .key = key,
+                              .key_len = key_len,
+                              .value = value,
+                          });
+  table->used++;
+  HASH_TABLE_COUNT(table, inserts);
+}
+
+// For callers that already know the key's hash. It must be what the
+// table's hasher returns for the key. Returns false, without inserting, if
+// the table needed to grow and could not.
+bool hash_table_insert_with_hash(hash_table_t *table, size_t hash,
+                                 const void *key, size_t key_len,
+                                 void *value) {
+  if (!hash_table_ensure_slots(table)) {
+    return false;
+  }
+
+  hash_table_migrate(table, HASH_TABLE_REHASH_STEP);
+  if (table->next_values) {
+    // The current array keeps taking inserts while the new one is cleared.
+    // At the default step that ends long before it fills, but a small
+    // HASH_TABLE_REHASH_STEP could fall behind, so finish it if it has to.
+    if (load_factor(table) > 0.9) {
+      hash_table_migrate(table, SIZE_MAX);
+    }
+  } else if (load_factor(table) > HASH_TABLE_LOAD_FACTOR_THRESHOLD &&
+             !rehash(table)) {
+    return false;
+  }
+
+  hash_table_insert_hashed(table, hash, key, key_len, value);
+  return true;
+}
+
+bool hash_table_insert(hash_table_t *table, const void *key, size_t key_len,
+                       void *value) {
+  size_t hash = table->hasher(table, key, key_len);
+  return hash_table_insert_with_hash(table, hash, key, key_len, value);
+}
+
+// Misses stop at the first empty slot, or for linear probing, at the first
+// entry that is closer to its home slot than the key would be.
+hash_position_t *hash_table_find(hash_table_t *table, hash_position_t *values,
+                                 size_t size, size_t hash, const void *key,
+                                 size_t key_len) {
+  for (size_t i = 0; i < size; i++) {
+    size_t idx = probe(table, size, hash, key, key_len, i);
+    hash_position_t *current = &values[idx];
     if (!current->in_use) {
-      continue;
+      if (current->tombstone) {
+        continue;
+      }
+      hash_table_count_probes(table, i + 1);
+      return NULL;
+    }
+
+    if (table->strategy == PROBE_LINEAR &&
+        probe_distance(size, current->hash, idx) < i) {
+      hash_table_count_probes(table, i + 1);
+      return NULL;
     }
 
-    if (table->comparer(current->key, current->key_len, key, key_len)) {
+    if (current->hash == hash &&
+        table->comparer(current->key, current->key_len, key, key_len)) {
+      hash_table_count_probes(table, i + 1);
       return current;
     }
   }
 
+  hash_table_count_probes(table, size);
+  return NULL;
+}
+
+hash_position_t *hash_table_lookup_hashed(hash_table_t *table, size_t hash,
+                                          const void *key, size_t key_len) {
+  if (!table->values) {
+    return NULL;
+  }
+
+  hash_table_migrate(table, HASH_TABLE_REHASH_STEP);
+  HASH_TABLE_COUNT(table, lookups);
+
+  hash_position_t *found =
+      hash_table_find(table, table->values, table->size, hash, key, key_len);
+  if (!found && table->old_values) {
+    found = hash_table_find(table, table->old_values, table->old_size, hash,
+                            key, key_len);
+  }
+
+  return found;
+}
+
+hash_position_t *hash_table_lookup_internal(hash_table_t *table,
+                                            const void *key, size_t key_len) {
+  size_t hash = table->hasher(table, key, key_len);
+  return hash_table_lookup_hashed(table, hash, key, key_len);
+}
+
+void *hash_table_lookup_with_hash(hash_table_t *table, size_t hash,
+                                  const void *key, size_t key_len) {
+  hash_position_t *val = hash_table_lookup_hashed(table, hash, key, key_len);
+  if (val) {
+    return val->value;
+  }
+
   return NULL;
 }
 
@@ -251,17 +725,86 @@ void *hash_table_lookup(hash_table_t *table, const void *key, size_t key_len) {
   return NULL;
 }
 
+// Linear probing removes entries by shifting the rest of the cluster back
+// one slot, so no tombstones are needed and lookups can keep stopping early.
+// Entries still waiting in the old array of a resize are always tombstoned,
+// since shifting them could move them behind the migration cursor.
 void hash_table_delete(hash_table_t *table, const void *key, size_t key_len) {
   hash_position_t *node = hash_table_lookup_internal(table, key, key_len);
   if (!node) {
     return;
   }
 
-  node->in_use = false;
-  HASH_TABLE_FREE(node->value);
-  node->value = NULL;
-  node->key = 0;
+  hash_table_dealloc(table, node->value);
   table->used--;
+
+  bool in_old = table->old_values && node >= table->old_values &&
+                node < table->old_values + table->old_size;
+  if (in_old) {
+    *node = (hash_position_t){.tombstone = true};
+    return;
+  }
+
+  if (table->strategy != PROBE_LINEAR) {
+    *node = (hash_position_t){.tombstone = true};
+    table->tombstones++;
+    return;
+  }
+
+  size_t idx = node - table->values;
+  for (;;) {
+    size_t next = (idx + 1) & (table->size - 1);
+    hash_position_t *position = &table->values[next];
+    if (!position->in_use ||
+        probe_distance(table->size, position->hash, next) == 0) {
+      break;
+    }
+
+    table->values[idx] = *position;
+    idx = next;
+  }
+  table->values[idx] = (hash_position_t){0};
+}
+
+void hash_table_probe_stats_add(hash_table_t *table, hash_position_t *values,
+                                size_t size, hash_probe_stats_t *stats) {
+  for (size_t idx = 0; idx < size; idx++) {
+    hash_position_t *position = &values[idx];
+    if (!position->in_use) {
+      continue;
+    }
+
+    size_t probes = 1;
+    while (probe(table, size, position->hash, position->key,
+                 position->key_len, probes - 1) != idx) {
+      probes++;
+    }
+
+    stats->entries++;
+    stats->total_probes += probes;
+    if (probes > stats->max_probes) {
+      stats->max_probes = probes;
+    }
+  }
+}
+
+// Number of probes a successful lookup needs for each entry, i.e. how far
+// entries sit from their home slot.
+hash_probe_stats_t hash_table_probe_stats(hash_table_t *table) {
+  hash_probe_stats_t stats = {0};
+  if (!table->values) {
+    return stats;
+  }
+  hash_table_probe_stats_add(table, table->values, table->size, &stats);
+  if (table->old_values) {
+    hash_table_probe_stats_add(table, table->old_values, table->old_size,
+                               &stats);
+  }
+
+  if (stats.entries) {
+    stats.mean_probes = (double)stats.total_probes / stats.entries;
+  }
+  return stats;
 }
 
 #endif // HASH_TABLE_IMPLEMENTATION
@@ -1,15 +1,33 @@
-#include "stb_hashtable.h"
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <unity/unity.h>
 #include <unity/unity_internals.h>
 
-#define BENCODE_GET_SHA1(a,b,c) "this is a test"
+// test_out_of_memory sets this to fail the allocation that many calls
+// from now; it is off while negative.
+long fail_alloc_in = -1;
+
+bool fail_alloc(void) { return fail_alloc_in >= 0 && fail_alloc_in-- == 0; }
+
+#define BENCODE_MALLOC(size) (fail_alloc() ? NULL : malloc(size))
+#define BENCODE_REALLOC(ptr, size) (fail_alloc() ? NULL : realloc(ptr, size))
+#define HASH_TABLE_MALLOC(size) (fail_alloc() ? NULL : malloc(size))
+
 #define BENCODE_HASH_INFO_DICT
 #define BENCODE_IMPLEMENTATION
 #include "stb_bencode.h"
 
+char *digest_hex(const unsigned char *digest, size_t n, char *out) {
+  for (size_t i = 0; i < n; i++) {
+    sprintf(out + i * 2, "%02x", digest[i]);
+  }
+  return out;
+}
+
 #define MAKE_STR(xs)                                                           \
   (BencodeString) { .len = strlen(xs), .str = xs }
 
@@ -23,7 +41,7 @@ void validate_type(BencodeType *expected, BencodeType *actual);
 
 void validate_list(BencodeList *expected, BencodeList *actual) {
   if (expected->len != actual->len) {
-    printf("expected %ld elements, got %ld\n", expected->len, actual->len);
+    printf("expected %u elements, got %u\n", expected->len, actual->len);
   }
 
   for (size_t i = 0; i < expected->len; i++) {
@@ -113,7 +131,9 @@ void test_lexer() {
       TEST_ASSERT_EQUAL_INT_MESSAGE(expected_t.asInt, t.asInt, msg);
       break;
     case STRING:
-      TEST_ASSERT_EQUAL_STRING_MESSAGE(expected_t.asString, t.asString, msg);
+      TEST_ASSERT_EQUAL_INT_MESSAGE(strlen(expected_t.asString), t.len, msg);
+      TEST_ASSERT_EQUAL_STRING_LEN_MESSAGE(expected_t.asString, t.asString,
+                                           t.len, msg);
       break;
     default:
       break;
@@ -254,7 +274,7 @@ void test_dict() {
   TEST_ASSERT_EQUAL(DICTIONARY, type.kind);
 
   for (size_t i = 0; i < ARRAY_LEN(expected_keys); i++) {
-    BencodeType *t = hash_table_lookup(&type.asDict, expected_keys[i],
+    BencodeType *t = bencode_dict_get(type.asDict, expected_keys[i],
                                        strlen(expected_keys[i]));
     char msg[100];
     sprintf(msg, "expected key %s to be in the dict at i = %ld\n",
@@ -296,10 +316,36 @@ void test_get_info_dict_digest() {
     BencodeType first_dict = parse_item(&p);
     TEST_ASSERT_EQUAL(DICTIONARY, first_dict.kind);
 
-    BencodeType *info_dict = hash_table_lookup(&first_dict.asDict, "info", 4);
+    BencodeType *info_dict = bencode_dict_get(first_dict.asDict, "info", 4);
     TEST_ASSERT_NOT_NULL(info_dict);
     TEST_ASSERT_EQUAL(DICTIONARY, info_dict->kind);
-    TEST_ASSERT_EQUAL_STRING("this is a test", info_dict->sha1_digest);
+    const unsigned char *digest = bencode_sha1_digest(info_dict);
+    TEST_ASSERT_NOT_NULL(digest);
+    TEST_ASSERT_NULL(bencode_sha1_digest(&first_dict));
+    char hex[41];
+    TEST_ASSERT_EQUAL_STRING("668499503154e7a907f293b0fdfd65310c661f8e",
+                             digest_hex(digest, 20, hex));
+}
+
+void test_node_layout() {
+    TEST_ASSERT_TRUE(sizeof(BencodeList) <= 16);
+    TEST_ASSERT_TRUE(sizeof(BencodeString) <= 16);
+    // 24 rather than 16 bytes, see the layout notes in the README.
+    TEST_ASSERT_EQUAL(24, sizeof(BencodeType));
+
+    // A full list refuses another value instead of growing past 32 bits.
+    BencodeList full = {.len = BENCODE_MAX_LIST_LEN,
+                        .cap = BENCODE_MAX_LIST_LEN};
+    TEST_ASSERT_FALSE(bencode_list_append(NULL, &full, bencode_int(1)));
+    TEST_ASSERT_EQUAL(BENCODE_MAX_LIST_LEN, full.len);
+
+    // Dict headers count against the allocation limit like their entries.
+    Parser p = get_parser("d1:ad1:bi1eee");
+    p.fail_fast = true;
+    p.limits.max_alloc_bytes = sizeof(BencodeDict) + 8;
+    BencodeType value = parse_item(&p);
+    TEST_ASSERT_EQUAL(ERROR, value.kind);
+    TEST_ASSERT_EQUAL(BENCODE_ERR_ALLOC_LIMIT, p.error.code);
 }
 
 void test_string_with_numbers() {
@@ -312,6 +358,1901 @@ void test_string_with_numbers() {
     TEST_ASSERT_EQUAL_STRING("12345", str.asString.str);
 }
 
+void test_zero_copy_strings() {
+  char *test = "l4:spam0:4:eggse";
+  Parser p = get_parser(test);
+  p.zero_copy = true;
+
+  BencodeType list = parse_item(&p);
+  TEST_ASSERT_EQUAL(LIST, list.kind);
+  TEST_ASSERT_EQUAL(3, list.asList.len);
+
+  BencodeString spam = list.asList.values[0].asString;
+  TEST_ASSERT_EQUAL(4, spam.len);
+  TEST_ASSERT_EQUAL_PTR(test + 3, spam.str);
+
+  TEST_ASSERT_EQUAL(0, list.asList.values[1].asString.len);
+
+  BencodeString eggs = list.asList.values[2].asString;
+  TEST_ASSERT_EQUAL(4, eggs.len);
+  TEST_ASSERT_EQUAL_PTR(test + 11, eggs.str);
+
+  char *owned = bencode_string_dup(spam);
+  TEST_ASSERT_EQUAL_STRING("spam", owned);
+  free(owned);
+}
+
+void test_lexer_from_buffer() {
+  // Deliberately not NUL-terminated: the lexer must stop at len.
+  char input[] = {'l', '4', ':', 's', 'p', 'a', 'm', 'i', '7', 'e', 'e'};
+  Parser p = new_parser(new_lexer_from_buffer(input, sizeof(input)));
+
+  BencodeType list = parse_item(&p);
+  TEST_ASSERT_EQUAL(0, p.error_index);
+  TEST_ASSERT_EQUAL(LIST, list.kind);
+  TEST_ASSERT_EQUAL(2, list.asList.len);
+  TEST_ASSERT_EQUAL_STRING("spam", list.asList.values[0].asString.str);
+  TEST_ASSERT_EQUAL(7, list.asList.values[1].asInt);
+  TEST_ASSERT_EQUAL(END_OF_FILE, p.peek_token.type);
+
+  free_lexer(&p.l);
+}
+
+void test_lexer_mmap() {
+  char path[] = "/tmp/bencode-test-XXXXXX";
+  int fd = mkstemp(path);
+  TEST_ASSERT_TRUE(fd >= 0);
+  char *contents = "d8:announce3:url4:infod6:lengthi42eee";
+  TEST_ASSERT_EQUAL(strlen(contents), write(fd, contents, strlen(contents)));
+  close(fd);
+
+  Parser p = new_parser(new_lexer_mmap(path));
+  TEST_ASSERT_EQUAL(LEXER_BUFFER_MMAP, p.l.storage);
+  p.zero_copy = true;
+
+  BencodeType dict = parse_item(&p);
+  TEST_ASSERT_EQUAL(DICTIONARY, dict.kind);
+  BencodeType *announce = bencode_dict_get(dict.asDict, "announce", 8);
+  TEST_ASSERT_NOT_NULL(announce);
+  TEST_ASSERT_EQUAL_STRING_LEN("url", announce->asString.str, 3);
+  TEST_ASSERT_EQUAL_PTR(p.l.buf + 13, announce->asString.str);
+
+  free_lexer(&p.l);
+  TEST_ASSERT_NULL(p.l.buf);
+  unlink(path);
+}
+
+void test_push_parser_byte_at_a_time() {
+  char *test = "d4:spaml1:a2:bce3:numi-42ee";
+  PushParser p = new_push_parser();
+
+  BencodeFeedResult result = BENCODE_NEED_MORE;
+  size_t len = strlen(test);
+  for (size_t i = 0; i < len; i++) {
+    result = bencode_feed(&p, test + i, 1);
+    TEST_ASSERT_EQUAL(i == len - 1 ? BENCODE_VALUE_READY : BENCODE_NEED_MORE,
+                      result);
+  }
+
+  TEST_ASSERT_EQUAL(DICTIONARY, p.value.kind);
+  BencodeType *spam = bencode_dict_get(p.value.asDict, "spam", 4);
+  TEST_ASSERT_NOT_NULL(spam);
+  TEST_ASSERT_EQUAL(LIST, spam->kind);
+  TEST_ASSERT_EQUAL(2, spam->asList.len);
+  TEST_ASSERT_EQUAL_STRING("bc", spam->asList.values[1].asString.str);
+
+  BencodeType *num = bencode_dict_get(p.value.asDict, "num", 3);
+  TEST_ASSERT_NOT_NULL(num);
+  TEST_ASSERT_EQUAL(-42, num->asInt);
+
+  free_push_parser(&p);
+}
+
+void test_push_parser_multiple_values_per_chunk() {
+  char *first = "i12";
+  char *second = "3e5:hel";
+  char *third = "loi7e";
+  PushParser p = new_push_parser();
+
+  TEST_ASSERT_EQUAL(BENCODE_NEED_MORE, bencode_feed(&p, first, 3));
+  TEST_ASSERT_EQUAL(BENCODE_VALUE_READY, bencode_feed(&p, second, 7));
+  TEST_ASSERT_EQUAL(123, p.value.asInt);
+  TEST_ASSERT_EQUAL(2, p.consumed);
+
+  TEST_ASSERT_EQUAL(BENCODE_NEED_MORE,
+                    bencode_feed(&p, second + p.consumed, 7 - p.consumed));
+  TEST_ASSERT_EQUAL(BENCODE_VALUE_READY, bencode_feed(&p, third, 5));
+  TEST_ASSERT_EQUAL(BYTESTRING, p.value.kind);
+  TEST_ASSERT_EQUAL_STRING("hello", p.value.asString.str);
+  TEST_ASSERT_EQUAL(2, p.consumed);
+
+  TEST_ASSERT_EQUAL(BENCODE_VALUE_READY,
+                    bencode_feed(&p, third + p.consumed, 5 - p.consumed));
+  TEST_ASSERT_EQUAL(7, p.value.asInt);
+
+  free_push_parser(&p);
+}
+
+void test_push_parser_errors() {
+  PushParser p = new_push_parser();
+  TEST_ASSERT_EQUAL(BENCODE_ERROR, bencode_feed(&p, "di1ei2ee", 8));
+  TEST_ASSERT_EQUAL(BENCODE_ERROR, bencode_feed(&p, "i1e", 3));
+  free_push_parser(&p);
+
+  p = new_push_parser();
+  TEST_ASSERT_EQUAL(BENCODE_ERROR, bencode_feed(&p, "i1-2e", 5));
+  TEST_ASSERT_EQUAL(2, p.consumed);
+  TEST_ASSERT_EQUAL(BENCODE_ERR_BAD_INTEGER, p.error.code);
+  TEST_ASSERT_EQUAL(2, p.error.offset);
+  free_push_parser(&p);
+}
+
+void test_push_parser_limits() {
+  PushParser p = new_push_parser();
+  p.limits.max_string_len = 4;
+  TEST_ASSERT_EQUAL(BENCODE_NEED_MORE, bencode_feed(&p, "l4:spam", 7));
+  // Refused at the length prefix, before the buffer is allocated.
+  TEST_ASSERT_EQUAL(BENCODE_ERROR, bencode_feed(&p, "5:", 2));
+  TEST_ASSERT_EQUAL(BENCODE_ERR_STRING_LIMIT, p.error.code);
+  TEST_ASSERT_EQUAL(8, p.error.offset);
+  free_push_parser(&p);
+
+  // Without a limit, BENCODE_MAX_STRING_LEN still applies.
+  p = new_push_parser();
+  TEST_ASSERT_EQUAL(BENCODE_ERROR, bencode_feed(&p, "99999999999999:", 15));
+  TEST_ASSERT_EQUAL(BENCODE_ERR_STRING_LIMIT, p.error.code);
+  TEST_ASSERT_EQUAL(14, p.error.offset);
+  free_push_parser(&p);
+
+  p = new_push_parser();
+  p.limits.max_depth = 2;
+  TEST_ASSERT_EQUAL(BENCODE_ERROR, bencode_feed(&p, "lllee", 5));
+  TEST_ASSERT_EQUAL(BENCODE_ERR_DEPTH_LIMIT, p.error.code);
+  TEST_ASSERT_EQUAL(2, p.error.offset);
+  free_push_parser(&p);
+
+  p = new_push_parser();
+  p.limits.max_elements = 3;
+  TEST_ASSERT_EQUAL(BENCODE_ERROR, bencode_feed(&p, "li1ei2ei3ee", 11));
+  TEST_ASSERT_EQUAL(BENCODE_ERR_ELEMENT_LIMIT, p.error.code);
+  free_push_parser(&p);
+
+  p = new_push_parser();
+  p.limits.max_alloc_bytes = 64;
+  TEST_ASSERT_EQUAL(BENCODE_ERROR,
+                    bencode_feed(&p, "d1:a5:abcde1:b5:abcde1:c5:abcdee", 32));
+  TEST_ASSERT_EQUAL(BENCODE_ERR_ALLOC_LIMIT, p.error.code);
+  free_push_parser(&p);
+}
+
+void test_arena_parse() {
+  char *test = "d4:listli1ei2ei3ei4ei5ee3:str5:valuee";
+  BencodeArena arena = new_arena(0);
+
+  Parser p = get_parser(test);
+  p.arena = &arena;
+  BencodeType dict = parse_item(&p);
+
+  BencodeType *list = bencode_dict_get(dict.asDict, "list", 4);
+  TEST_ASSERT_NOT_NULL(list);
+  TEST_ASSERT_EQUAL(5, list->asList.len);
+  TEST_ASSERT_EQUAL(5, list->asList.values[4].asInt);
+
+  BencodeType *str = bencode_dict_get(dict.asDict, "str", 3);
+  TEST_ASSERT_NOT_NULL(str);
+  TEST_ASSERT_EQUAL_STRING("value", str->asString.str);
+
+  // A reset hands the same memory to the next document.
+  BencodeArenaBlock *block = arena.head;
+  arena_reset(&arena);
+  p = get_parser(test);
+  p.arena = &arena;
+  dict = parse_item(&p);
+  TEST_ASSERT_EQUAL_PTR(block, arena.head);
+  TEST_ASSERT_NULL(arena.head->next);
+  unsigned char *entries = (unsigned char *)dict.asDict->entries;
+  TEST_ASSERT_TRUE(entries >= arena.head->data &&
+                   entries < arena.head->data + arena.head->used);
+
+  free_arena(&arena);
+}
+
+void test_arena_large_allocation() {
+  BencodeArena arena = new_arena(64);
+  char *small = arena_alloc(&arena, 16);
+  char *large = arena_alloc(&arena, 1000);
+  memset(large, 'x', 1000);
+  TEST_ASSERT_NOT_NULL(small);
+  TEST_ASSERT_EQUAL(0, (size_t)large % 16);
+  TEST_ASSERT_EQUAL_PTR(arena.head->next, arena.current);
+  free_arena(&arena);
+}
+
+void test_bencode_free() {
+  char *test = "d4:listl1:a1:be4:dictd1:ki1eee";
+  Parser p = get_parser(test);
+  BencodeType dict = parse_item(&p);
+  TEST_ASSERT_EQUAL(DICTIONARY, dict.kind);
+
+  bencode_free(&dict, true);
+  TEST_ASSERT_EQUAL(ERROR, dict.kind);
+
+  PushParser pp = new_push_parser();
+  TEST_ASSERT_EQUAL(BENCODE_NEED_MORE, bencode_feed(&pp, "d1:al3:abc", 10));
+  free_push_parser(&pp);
+}
+
+void test_dict_entries_sorted() {
+  char *test = "d1:bi2e1:ai1e2:aai3e1:ci4ee";
+  Parser p = get_parser(test);
+  BencodeType dict = parse_item(&p);
+  TEST_ASSERT_EQUAL(DICTIONARY, dict.kind);
+  TEST_ASSERT_EQUAL(4, dict.asDict->len);
+
+  char *expected_keys[] = {"a", "aa", "b", "c"};
+  long expected_values[] = {1, 3, 2, 4};
+  for (size_t i = 0; i < ARRAY_LEN(expected_keys); i++) {
+    TEST_ASSERT_EQUAL_STRING(expected_keys[i], dict.asDict->entries[i].key.str);
+    TEST_ASSERT_EQUAL(expected_values[i], dict.asDict->entries[i].value.asInt);
+  }
+
+  TEST_ASSERT_NULL(bencode_dict_get(dict.asDict, "d", 1));
+  bencode_free(&dict, true);
+}
+
+void test_large_dict_lookup() {
+  // Enough keys to go through binary search and then the hash index.
+  char input[8192];
+  size_t n = 0;
+  input[n++] = 'd';
+  for (int i = 0; i < 200; i++) {
+    n += sprintf(input + n, "4:k%03di%de", i, i);
+  }
+  input[n++] = 'e';
+  input[n] = '\0';
+
+  for (int keys = 20; keys <= 200; keys += 180) {
+    Parser p = get_parser(input);
+    BencodeType dict = parse_item(&p);
+    TEST_ASSERT_EQUAL(200, dict.asDict->len);
+    // The parse already built the index, so lookups do not write.
+    TEST_ASSERT_NOT_NULL(dict.asDict->index);
+    // Shrink the dict and hide its index to exercise the binary search
+    // path first.
+    BencodeDict *d = dict.asDict;
+    size_t len = d->len;
+    hash_table_t *index = d->index;
+    d->len = d->sorted_len = keys;
+    if (keys < BENCODE_DICT_INDEX_THRESHOLD) {
+      d->index = NULL;
+    }
+
+    for (int i = 0; i < keys; i++) {
+      char key[5];
+      sprintf(key, "k%03d", i);
+      BencodeType *v = bencode_dict_get(dict.asDict, key, 4);
+      TEST_ASSERT_NOT_NULL(v);
+      TEST_ASSERT_EQUAL(i, v->asInt);
+    }
+    TEST_ASSERT_NULL(bencode_dict_get(dict.asDict, "k999", 4));
+
+    d->len = d->sorted_len = len;
+    d->index = index;
+    bencode_free(&dict, true);
+  }
+}
+
+void test_dict_incremental_index() {
+  // Keys added in reverse order, each followed by lookups, keep one index
+  // that grows with the dict instead of being rebuilt per lookup.
+  static char keys[300][5];
+  BencodeType dict = bencode_dict(NULL);
+  hash_table_t *index = NULL;
+  for (int i = 0; i < 300; i++) {
+    sprintf(keys[i], "k%03d", 299 - i);
+    TEST_ASSERT_TRUE(bencode_dict_set(&dict, keys[i], 4, bencode_int(i)));
+    if (i + 1 == BENCODE_DICT_INDEX_THRESHOLD) {
+      index = dict.asDict->index;
+      TEST_ASSERT_NOT_NULL(index);
+    }
+    TEST_ASSERT_TRUE(index == dict.asDict->index);
+
+    BencodeType *v = bencode_dict_get(dict.asDict, keys[i / 2], 4);
+    TEST_ASSERT_NOT_NULL(v);
+    TEST_ASSERT_EQUAL(i / 2, v->asInt);
+  }
+  TEST_ASSERT_EQUAL(1, dict.asDict->sorted_len);
+  TEST_ASSERT_NULL(bencode_dict_get(dict.asDict, "k300", 4));
+
+  // Sorting moves every entry, and the index follows.
+  bencode_dict_sort(dict.asDict);
+  TEST_ASSERT_EQUAL(300, dict.asDict->sorted_len);
+  TEST_ASSERT_EQUAL_STRING("k000", dict.asDict->entries[0].key.str);
+  TEST_ASSERT_NOT_NULL(dict.asDict->index);
+  for (int i = 0; i < 300; i++) {
+    BencodeType *v = bencode_dict_get(dict.asDict, keys[i], 4);
+    TEST_ASSERT_NOT_NULL(v);
+    TEST_ASSERT_EQUAL(i, v->asInt);
+  }
+  bencode_free(&dict, false);
+
+  // Below the index threshold, keys out of order are found after the
+  // sorted ones.
+  dict = bencode_dict(NULL);
+  for (int i = 0; i < 20; i++) {
+    bencode_dict_set(&dict, keys[299 - i * 2], 4, bencode_int(i));
+  }
+  bencode_dict_set(&dict, "a", 1, bencode_int(-1));
+  TEST_ASSERT_EQUAL(20, dict.asDict->sorted_len);
+  TEST_ASSERT_EQUAL(-1, bencode_dict_get(dict.asDict, "a", 1)->asInt);
+  TEST_ASSERT_EQUAL(3, bencode_dict_get(dict.asDict, keys[293], 4)->asInt);
+  bencode_free(&dict, false);
+}
+
+void test_interned_keys() {
+  char *test = "d5:filesld6:lengthi1e4:pathl1:aeed6:lengthi2e4:pathl1:beee"
+               "4:name1:xe";
+  BencodeInterner in = new_interner();
+  Parser p = get_parser(test);
+  p.interner = &in;
+  BencodeType dict = parse_item(&p);
+  TEST_ASSERT_EQUAL(0, p.error_index);
+
+  // Every "length" key is the interner's copy.
+  BencodeString length = interner_find(&in, "length", 6);
+  TEST_ASSERT_NOT_NULL(length.str);
+  BencodeList *files =
+      &bencode_dict_get_interned(dict.asDict, interner_find(&in, "files", 5))
+           ->asList;
+  TEST_ASSERT_EQUAL(2, files->len);
+  for (size_t i = 0; i < files->len; i++) {
+    BencodeDict *file = files->values[i].asDict;
+    TEST_ASSERT_EQUAL_PTR(length.str, file->entries[0].key.str);
+    BencodeType *v = bencode_dict_get_interned(file, length);
+    TEST_ASSERT_NOT_NULL(v);
+    TEST_ASSERT_EQUAL(i + 1, v->asInt);
+    TEST_ASSERT_EQUAL_PTR(v, bencode_dict_get(file, "length", 6));
+  }
+  // A key the interner never saw cannot be in any of its dicts.
+  TEST_ASSERT_NULL(interner_find(&in, "md5sum", 6).str);
+  TEST_ASSERT_NULL(bencode_dict_get_interned(
+      dict.asDict, interner_find(&in, "md5sum", 6)));
+  bencode_free(&dict, true);
+
+  // A frozen interner copies the keys it does not know, and lookups still
+  // find both kinds.
+  interner_freeze(&in);
+  p = get_parser("d6:lengthi3e6:md5sum1:fe");
+  p.interner = &in;
+  dict = parse_item(&p);
+  TEST_ASSERT_TRUE(dict.asDict->mixed_keys);
+  TEST_ASSERT_EQUAL_PTR(length.str, dict.asDict->entries[0].key.str);
+  TEST_ASSERT_EQUAL(3, bencode_dict_get_interned(dict.asDict, length)->asInt);
+  TEST_ASSERT_NOT_NULL(bencode_dict_get(dict.asDict, "md5sum", 6));
+  TEST_ASSERT_NULL(interner_find(&in, "md5sum", 6).str);
+  bencode_free(&dict, true);
+
+  // Large dicts look interned keys up through the index with their stored
+  // hash.
+  char input[8192];
+  size_t n = 0;
+  input[n++] = 'd';
+  for (int i = 0; i < 200; i++) {
+    n += sprintf(input + n, "4:k%03di%de", i, i);
+  }
+  input[n++] = 'e';
+  input[n] = '\0';
+
+  BencodeInterner big = new_interner();
+  p = get_parser(input);
+  p.interner = &big;
+  dict = parse_item(&p);
+  for (int i = 0; i < 200; i++) {
+    char key[5];
+    sprintf(key, "k%03d", i);
+    BencodeType *v =
+        bencode_dict_get_interned(dict.asDict, interner_find(&big, key, 4));
+    TEST_ASSERT_NOT_NULL(v);
+    TEST_ASSERT_EQUAL(i, v->asInt);
+  }
+  TEST_ASSERT_NOT_NULL(dict.asDict->index);
+  bencode_free(&dict, true);
+
+  free_interner(&big);
+  free_interner(&in);
+}
+
+void test_hash_table_distribution() {
+  // Keys that share a zero first byte used to all hash to the same slot.
+  char keys[2000][8];
+  hash_table_t table;
+  hash_table_init(&table);
+  for (int i = 0; i < 2000; i++) {
+    keys[i][0] = '\0';
+    sprintf(keys[i] + 1, "%06d", i);
+    hash_table_insert(&table, keys[i], 7, keys[i]);
+  }
+
+  for (int i = 0; i < 2000; i++) {
+    TEST_ASSERT_EQUAL_PTR(keys[i], hash_table_lookup(&table, keys[i], 7));
+  }
+  TEST_ASSERT_NULL(hash_table_lookup(&table, "\0999999", 7));
+
+  hash_probe_stats_t stats = hash_table_probe_stats(&table);
+  TEST_ASSERT_EQUAL(2000, stats.entries);
+  TEST_ASSERT_TRUE(stats.mean_probes < 2.0);
+  TEST_ASSERT_TRUE(stats.max_probes < 32);
+
+  hash_table_free(&table);
+}
+
+void test_hash_table_delete() {
+  probe_strategy strategies[] = {PROBE_LINEAR, PROBE_QUADRATIC,
+                                 PROBE_DOUBLE_HASH};
+  char keys[600][8];
+  for (int i = 0; i < 600; i++) {
+    sprintf(keys[i], "k%05d", i);
+  }
+
+  for (size_t s = 0; s < ARRAY_LEN(strategies); s++) {
+    hash_table_t table;
+    hash_table_init_ex(&table, (hash_options_t){
+                                   .strategy = strategies[s],
+                                   .size = 16,
+                               });
+    // Values are freed by hash_table_delete, so they must be heap allocated.
+    for (int round = 0; round < 3; round++) {
+      for (int i = 0; i < 600; i++) {
+        if (!hash_table_lookup(&table, keys[i], 6)) {
+          int *v = malloc(sizeof(int));
+          *v = i;
+          hash_table_insert(&table, keys[i], 6, v);
+        }
+      }
+      for (int i = round; i < 600; i += 3) {
+        hash_table_delete(&table, keys[i], 6);
+      }
+
+      for (int i = 0; i < 600; i++) {
+        int *v = hash_table_lookup(&table, keys[i], 6);
+        if ((i - round) % 3 == 0 && i >= round) {
+          TEST_ASSERT_NULL(v);
+        } else {
+          TEST_ASSERT_NOT_NULL(v);
+          TEST_ASSERT_EQUAL(i, *v);
+        }
+      }
+      TEST_ASSERT_EQUAL(400, table.used);
+    }
+    TEST_ASSERT_NULL(hash_table_lookup(&table, "missing", 7));
+
+    for (int i = 0; i < 600; i++) {
+      hash_table_delete(&table, keys[i], 6);
+    }
+    TEST_ASSERT_EQUAL(0, table.used);
+    hash_table_free(&table);
+  }
+}
+
+void test_hash_table_incremental_resize() {
+  static char keys[5000][8];
+  hash_table_t table;
+  hash_table_init_ex(&table, (hash_options_t){.incremental = true});
+  TEST_ASSERT_EQUAL(8, table.size);
+
+  bool resized_incrementally = false;
+  for (int i = 0; i < 5000; i++) {
+    sprintf(keys[i], "k%05d", i);
+    int *v = malloc(sizeof(int));
+    *v = i;
+    hash_table_insert(&table, keys[i], 6, v);
+    resized_incrementally |= table.old_values != NULL;
+
+    // Every key stays reachable while old and new arrays coexist, and
+    // deletes work on entries in either of them.
+    int *half = hash_table_lookup(&table, keys[i / 2], 6);
+    if (i / 2 % 5 == 0) {
+      if (half) {
+        hash_table_delete(&table, keys[i / 2], 6);
+      }
+    } else {
+      TEST_ASSERT_NOT_NULL(half);
+      TEST_ASSERT_EQUAL(i / 2, *half);
+    }
+  }
+  TEST_ASSERT_TRUE(resized_incrementally);
+
+  for (int i = 0; i < 5000; i++) {
+    int *v = hash_table_lookup(&table, keys[i], 6);
+    if (i % 5 == 0 && i < 2500) {
+      TEST_ASSERT_NULL(v);
+    } else {
+      TEST_ASSERT_NOT_NULL(v);
+      TEST_ASSERT_EQUAL(i, *v);
+    }
+  }
+  TEST_ASSERT_NULL(table.old_values);
+
+  for (int i = 0; i < 5000; i++) {
+    hash_table_delete(&table, keys[i], 6);
+  }
+  TEST_ASSERT_EQUAL(0, table.used);
+  hash_table_free(&table);
+}
+
+// Hands out slot arrays full of garbage, so nothing relies on the allocator
+// clearing them.
+void *garbage_alloc(void *ctx, size_t size) {
+  (void)ctx;
+  void *p = malloc(size);
+  if (p) {
+    memset(p, 0xa5, size);
+  }
+  return p;
+}
+
+void garbage_free(void *ctx, void *ptr) {
+  (void)ctx;
+  free(ptr);
+}
+
+void test_hash_table_incremental_resize_bounded() {
+  enum { KEYS = 1 << 16 };
+  static char keys[KEYS][8];
+  hash_table_t table;
+  hash_table_init_ex(&table, (hash_options_t){
+                                 .incremental = true,
+                                 .allocator = garbage_alloc,
+                                 .deallocator = garbage_free,
+                             });
+
+  size_t resizes = 0;
+  for (int i = 0; i < KEYS; i++) {
+    hash_position_t *next = table.next_values;
+    size_t zeroed = table.next_zeroed;
+    hash_position_t *old = table.old_values;
+    size_t migrated = table.old_migrated;
+
+    sprintf(keys[i], "k%05d", i);
+    int *v = malloc(sizeof(int));
+    *v = i;
+    TEST_ASSERT_TRUE(hash_table_insert(&table, keys[i], 6, v));
+
+    // No insert clears or moves more than a step's worth of slots, not
+    // even the one that starts a resize.
+    if (table.next_values) {
+      size_t before = table.next_values == next ? zeroed : 0;
+      TEST_ASSERT_TRUE(table.next_zeroed - before <= HASH_TABLE_REHASH_STEP);
+      resizes += table.next_values != next;
+    }
+    if (table.old_values) {
+      size_t before = table.old_values == old ? migrated : 0;
+      TEST_ASSERT_TRUE(table.old_migrated - before <= HASH_TABLE_REHASH_STEP);
+    }
+
+    int *half = hash_table_lookup(&table, keys[i / 2], 6);
+    TEST_ASSERT_NOT_NULL(half);
+    TEST_ASSERT_EQUAL(i / 2, *half);
+  }
+  TEST_ASSERT_TRUE(resizes >= 10);
+  TEST_ASSERT_TRUE(table.size >= KEYS);
+
+  for (int i = 0; i < KEYS; i++) {
+    int *v = hash_table_lookup(&table, keys[i], 6);
+    TEST_ASSERT_NOT_NULL(v);
+    TEST_ASSERT_EQUAL(i, *v);
+    hash_table_delete(&table, keys[i], 6);
+  }
+  TEST_ASSERT_EQUAL(0, table.used);
+  hash_table_free(&table);
+}
+
+void test_hash_table_reserve() {
+  hash_table_t table;
+  hash_table_init_ex(&table, (hash_options_t){.used = 1000});
+  TEST_ASSERT_TRUE(table.size * HASH_TABLE_LOAD_FACTOR_THRESHOLD >= 1000);
+  hash_table_free(&table);
+
+  hash_table_init(&table);
+  hash_table_reserve(&table, 10000);
+  hash_position_t *values = table.values;
+  static char keys[10000][8];
+  for (int i = 0; i < 10000; i++) {
+    sprintf(keys[i], "k%05d", i);
+    hash_table_insert(&table, keys[i], 6, keys[i]);
+  }
+  TEST_ASSERT_EQUAL_PTR(values, table.values);
+  for (int i = 0; i < 10000; i++) {
+    TEST_ASSERT_EQUAL_PTR(keys[i], hash_table_lookup(&table, keys[i], 6));
+  }
+  hash_table_free(&table);
+}
+
+void test_sha_digests() {
+  char hex[65];
+  unsigned char d1[20], d256[32];
+
+  bencode_sha1("abc", 3, d1);
+  TEST_ASSERT_EQUAL_STRING("a9993e364706816aba3e25717850c26c9cd0d89d",
+                           digest_hex(d1, 20, hex));
+  bencode_sha1("", 0, d1);
+  TEST_ASSERT_EQUAL_STRING("da39a3ee5e6b4b0d3255bfef95601890afd80709",
+                           digest_hex(d1, 20, hex));
+  bencode_sha256("abc", 3, d256);
+  TEST_ASSERT_EQUAL_STRING(
+      "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad",
+      digest_hex(d256, 32, hex));
+  bencode_sha256("", 0, d256);
+  TEST_ASSERT_EQUAL_STRING(
+      "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855",
+      digest_hex(d256, 32, hex));
+
+  // The selected kernel, fed in odd-sized pieces, must agree with the
+  // portable one on every length around the block and padding boundaries.
+  unsigned char data[300];
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = i * 7 + 3;
+  }
+  for (size_t n = 0; n <= sizeof(data); n++) {
+    BencodeSha1 c1;
+    BencodeSha256 c256;
+    sha1_init(&c1);
+    sha256_init(&c256);
+    for (size_t i = 0; i < n; i += 13) {
+      size_t k = n - i < 13 ? n - i : 13;
+      sha1_update(&c1, data + i, k);
+      sha256_update(&c256, data + i, k);
+    }
+    sha1_final(&c1, d1);
+    sha256_final(&c256, d256);
+
+    sha1_kernel_t k1 = sha1_kernel;
+    sha256_kernel_t k256 = sha256_kernel;
+    sha1_kernel = sha1_blocks_scalar;
+    sha256_kernel = sha256_blocks_scalar;
+    unsigned char s1[20], s256[32];
+    bencode_sha1(data, n, s1);
+    bencode_sha256(data, n, s256);
+    sha1_kernel = k1;
+    sha256_kernel = k256;
+
+    TEST_ASSERT_EQUAL_MEMORY(s1, d1, 20);
+    TEST_ASSERT_EQUAL_MEMORY(s256, d256, 32);
+  }
+}
+
+#define SPAN_DOC "d8:announce3:url4:infod6:lengthi5e4:name1:xe7:privatei1ee"
+
+BencodeSpan *span_requests(BencodeSpan spans[3]) {
+  spans[0] = (BencodeSpan){.key = "info", .key_len = 4,
+                           .hashes = BENCODE_SPAN_SHA1 | BENCODE_SPAN_SHA256};
+  spans[1] = (BencodeSpan){.key = "private", .key_len = 7};
+  spans[2] = (BencodeSpan){.key = "missing", .key_len = 7};
+  return spans;
+}
+
+void assert_spans(BencodeSpan spans[3]) {
+  char hex[65];
+  TEST_ASSERT_TRUE(spans[0].found);
+  TEST_ASSERT_EQUAL(22, spans[0].start);
+  TEST_ASSERT_EQUAL(44, spans[0].end);
+  TEST_ASSERT_EQUAL_STRING("6e009507d8cfcc2e20e0fbf08e9ad7fd21c2974d",
+                           digest_hex(spans[0].sha1, 20, hex));
+  TEST_ASSERT_EQUAL_STRING(
+      "22b0738c4d38a3717d47f76d7e082e3634f8377bbc48b1b7e27e005a096b9be6",
+      digest_hex(spans[0].sha256, 32, hex));
+
+  TEST_ASSERT_TRUE(spans[1].found);
+  TEST_ASSERT_EQUAL(53, spans[1].start);
+  TEST_ASSERT_EQUAL(56, spans[1].end);
+  TEST_ASSERT_FALSE(spans[2].found);
+}
+
+void test_parser_spans() {
+  BencodeSpan spans[3];
+  Parser p = get_parser(SPAN_DOC);
+  p.spans = span_requests(spans);
+  p.spans_len = 3;
+  BencodeType t = parse_item(&p);
+  TEST_ASSERT_EQUAL(0, p.error_index);
+  assert_spans(spans);
+  bencode_free(&t, true);
+}
+
+void test_push_parser_spans() {
+  const char *doc = SPAN_DOC;
+  size_t len = strlen(doc);
+  for (size_t chunk = 1; chunk <= len; chunk++) {
+    BencodeSpan spans[3];
+    PushParser p = new_push_parser();
+    p.spans = span_requests(spans);
+    p.spans_len = 3;
+
+    BencodeFeedResult r = BENCODE_NEED_MORE;
+    for (size_t i = 0; i < len && r == BENCODE_NEED_MORE; i += chunk) {
+      r = bencode_feed(&p, doc + i, len - i < chunk ? len - i : chunk);
+    }
+    TEST_ASSERT_EQUAL(BENCODE_VALUE_READY, r);
+    assert_spans(spans);
+
+    bencode_free(&p.value, true);
+    free_push_parser(&p);
+  }
+}
+
+void test_path_queries() {
+  const char *doc = "d8:announce3:url13:announce-listll2:t1el2:t22:t3ee"
+                    "4:infod6:lengthi-5e4:name4:file12:piece lengthi16e"
+                    "6:pieces4:abcdee";
+  size_t len = strlen(doc);
+
+  BencodeMatch m;
+  TEST_ASSERT_TRUE(bencode_get(doc, len, "announce", &m));
+  TEST_ASSERT_EQUAL(BYTESTRING, m.kind);
+  TEST_ASSERT_EQUAL(3, m.asString.len);
+  TEST_ASSERT_EQUAL_MEMORY("url", m.asString.str, 3);
+  // Strings are views into the buffer.
+  TEST_ASSERT_EQUAL_PTR(doc + 13, m.asString.str);
+
+  TEST_ASSERT_TRUE(bencode_get(doc, len, "info/piece length", &m));
+  TEST_ASSERT_EQUAL(INTEGER, m.kind);
+  TEST_ASSERT_EQUAL(16, m.asInt);
+
+  TEST_ASSERT_TRUE(bencode_get(doc, len, "announce-list/1/1", &m));
+  TEST_ASSERT_EQUAL_MEMORY("t3", m.asString.str, 2);
+
+  TEST_ASSERT_TRUE(bencode_get(doc, len, "info", &m));
+  TEST_ASSERT_EQUAL(DICTIONARY, m.kind);
+  TEST_ASSERT_EQUAL('d', doc[m.start]);
+  TEST_ASSERT_EQUAL(len - 1, m.end);
+
+  TEST_ASSERT_TRUE(bencode_get(doc, len, "", &m));
+  TEST_ASSERT_EQUAL(0, m.start);
+  TEST_ASSERT_EQUAL(len, m.end);
+
+  TEST_ASSERT_FALSE(bencode_get(doc, len, "info/missing", &m));
+  TEST_ASSERT_EQUAL(ERROR, m.kind);
+  TEST_ASSERT_FALSE(bencode_get(doc, len, "announce/x", &m));
+  TEST_ASSERT_FALSE(bencode_get(doc, len, "announce-list/2", &m));
+  TEST_ASSERT_FALSE(bencode_get(doc, len, "announce-list/x", &m));
+
+  BencodeQuery q[] = {
+      {.path = "info/name"},
+      {.path = "info/length"},
+      {.path = "nope"},
+      {.path = "announce"},
+      {.path = "info"},
+  };
+  TEST_ASSERT_EQUAL(4, bencode_query(doc, len, q, ARRAY_LEN(q)));
+  TEST_ASSERT_EQUAL_MEMORY("file", q[0].match.asString.str, 4);
+  TEST_ASSERT_EQUAL(-5, q[1].match.asInt);
+  TEST_ASSERT_FALSE(q[2].found);
+  TEST_ASSERT_TRUE(q[3].found);
+  TEST_ASSERT_TRUE(q[4].found);
+
+  // Lookups stop once everything is resolved, so damage after the last
+  // match does not matter, but damage before it does.
+  const char *broken = "d8:announce3:url4:infoi1x";
+  TEST_ASSERT_TRUE(bencode_get(broken, strlen(broken), "announce", &m));
+  TEST_ASSERT_FALSE(bencode_get(broken, strlen(broken), "info", &m));
+  const char *truncated = "d8:announce99:url";
+  TEST_ASSERT_FALSE(
+      bencode_get(truncated, strlen(truncated), "announce", &m));
+}
+
+typedef struct {
+  char trace[256];
+  size_t n;
+  bool want_value;
+  long found;
+  size_t ints_seen;
+} event_ctx;
+
+bool trace_int(void *ctx, long value) {
+  event_ctx *e = ctx;
+  e->ints_seen++;
+  e->n += sprintf(e->trace + e->n, "i%ld ", value);
+  if (e->want_value) {
+    e->found = value;
+    return false;
+  }
+  return true;
+}
+
+bool trace_string(void *ctx, BencodeString value) {
+  event_ctx *e = ctx;
+  e->n += sprintf(e->trace + e->n, "s%.*s ", (int)value.len, value.str);
+  return true;
+}
+
+bool trace_list_begin(void *ctx) {
+  event_ctx *e = ctx;
+  e->n += sprintf(e->trace + e->n, "[ ");
+  return true;
+}
+
+bool trace_list_end(void *ctx) {
+  event_ctx *e = ctx;
+  e->n += sprintf(e->trace + e->n, "] ");
+  return true;
+}
+
+bool trace_dict_begin(void *ctx) {
+  event_ctx *e = ctx;
+  e->n += sprintf(e->trace + e->n, "{ ");
+  return true;
+}
+
+bool trace_dict_end(void *ctx) {
+  event_ctx *e = ctx;
+  e->n += sprintf(e->trace + e->n, "} ");
+  return true;
+}
+
+bool trace_key(void *ctx, BencodeString key) {
+  event_ctx *e = ctx;
+  e->n += sprintf(e->trace + e->n, "k%.*s ", (int)key.len, key.str);
+  e->want_value = key.len == 8 && memcmp(key.str, "complete", 8) == 0;
+  return true;
+}
+
+#define METAINFO_FIELDS(X)                                                     \
+  X(STRING, announce, "announce")                                              \
+  X(RAW, info, "info")                                                         \
+  X(INT, creation_date, "creation date")
+BENCODE_SCHEMA(Metainfo, METAINFO_FIELDS)
+
+#define INFO_FIELDS(X)                                                         \
+  X(STRING, name, "name")                                                      \
+  X(INT, length, "length")                                                     \
+  X(INT, piece_length, "piece length")                                         \
+  X(RAW, files, "files")
+BENCODE_SCHEMA(Info, INFO_FIELDS)
+
+void test_schema_decoder() {
+  const char *doc = "d8:announce3:url7:comment5:hello4:infod5:filesli1ee"
+                    "4:name3:abc12:piece lengthi16384e6:pieces0:ee";
+  Metainfo m;
+  TEST_ASSERT_TRUE(Metainfo_decode(doc, strlen(doc), &m));
+  TEST_ASSERT_TRUE(m.has.announce);
+  TEST_ASSERT_EQUAL_STRING_LEN("url", m.announce.str, m.announce.len);
+  TEST_ASSERT_FALSE(m.has.creation_date);
+  TEST_ASSERT_TRUE(m.has.info);
+  TEST_ASSERT_EQUAL(doc + 38, m.info.str);
+  TEST_ASSERT_EQUAL(strlen(doc) - 39, m.info.len);
+
+  // Nested dicts come back raw and are decoded with their own schema.
+  Info info;
+  TEST_ASSERT_TRUE(Info_decode(m.info.str, m.info.len, &info));
+  TEST_ASSERT_EQUAL_STRING_LEN("abc", info.name.str, info.name.len);
+  TEST_ASSERT_EQUAL(16384, info.piece_length);
+  TEST_ASSERT_FALSE(info.has.length);
+  TEST_ASSERT_EQUAL_STRING_LEN("li1ee", info.files.str, info.files.len);
+
+  // A known key holding the wrong kind fails, an unknown one is skipped.
+  const char *wrong = "d8:announcei1ee";
+  TEST_ASSERT_FALSE(Metainfo_decode(wrong, strlen(wrong), &m));
+  const char *unknown = "d1:xli1ei2ee8:announce1:ue";
+  TEST_ASSERT_TRUE(Metainfo_decode(unknown, strlen(unknown), &m));
+  TEST_ASSERT_EQUAL_STRING_LEN("u", m.announce.str, m.announce.len);
+
+  const char *truncated = "d8:announce3:url";
+  TEST_ASSERT_FALSE(Metainfo_decode(truncated, strlen(truncated), &m));
+  TEST_ASSERT_FALSE(Metainfo_decode("le", 2, &m));
+}
+
+void test_announce_decoder() {
+  // Two compact IPv4 peers, one IPv6 peer and fields the decoder ignores.
+  const char compact[] =
+      "d8:completei12e10:incompletei3e8:intervali1800e"
+      "12:min intervali60e5:peers12:\x0a\x00\x00\x01\x1a\xe1"
+      "\xc0\xa8\x01\x02\x00\x50"
+      "6:peers618:\x20\x01\x0d\xb8\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00"
+      "\x00\x01\x1a\xe2"
+      "7:privatei1e10:tracker id3:abce";
+  struct sockaddr_in peers[4];
+  struct sockaddr_in6 peers6[4];
+  BencodeAnnounce a = {
+      .peers = peers,
+      .peers_cap = 4,
+      .peers6 = peers6,
+      .peers6_cap = 4,
+  };
+  TEST_ASSERT_TRUE(
+      bencode_decode_announce(compact, sizeof(compact) - 1, &a));
+  TEST_ASSERT_EQUAL(1800, a.interval);
+  TEST_ASSERT_EQUAL(60, a.min_interval);
+  TEST_ASSERT_EQUAL(12, a.complete);
+  TEST_ASSERT_EQUAL(3, a.incomplete);
+  TEST_ASSERT_EQUAL(3, a.tracker_id.len);
+  TEST_ASSERT_NULL(a.failure_reason.str);
+
+  TEST_ASSERT_EQUAL(2, a.peers_len);
+  char text[INET6_ADDRSTRLEN];
+  TEST_ASSERT_EQUAL(AF_INET, peers[0].sin_family);
+  inet_ntop(AF_INET, &peers[0].sin_addr, text, sizeof(text));
+  TEST_ASSERT_EQUAL_STRING("10.0.0.1", text);
+  TEST_ASSERT_EQUAL(6881, ntohs(peers[0].sin_port));
+  inet_ntop(AF_INET, &peers[1].sin_addr, text, sizeof(text));
+  TEST_ASSERT_EQUAL_STRING("192.168.1.2", text);
+  TEST_ASSERT_EQUAL(80, ntohs(peers[1].sin_port));
+
+  TEST_ASSERT_EQUAL(1, a.peers6_len);
+  TEST_ASSERT_EQUAL(AF_INET6, peers6[0].sin6_family);
+  inet_ntop(AF_INET6, &peers6[0].sin6_addr, text, sizeof(text));
+  TEST_ASSERT_EQUAL_STRING("2001:db8::1", text);
+  TEST_ASSERT_EQUAL(6882, ntohs(peers6[0].sin6_port));
+
+  // The original dict form; peers past the capacity and hostnames are only
+  // counted.
+  char *dicts = "d8:intervali900e5:peersl"
+                "d2:ip8:10.0.0.77:peer id20:aaaaaaaaaaaaaaaaaaaa4:porti1ee"
+                "d2:ip3:::14:porti2ee"
+                "d2:ip11:example.org4:porti3ee"
+                "d2:ip8:10.0.0.84:porti4ee"
+                "d2:ip8:10.0.0.94:porti5ee"
+                "ee";
+  a.peers_cap = 1;
+  TEST_ASSERT_TRUE(bencode_decode_announce(dicts, strlen(dicts), &a));
+  TEST_ASSERT_EQUAL(900, a.interval);
+  TEST_ASSERT_EQUAL(-1, a.complete);
+  TEST_ASSERT_EQUAL(1, a.peers_len);
+  inet_ntop(AF_INET, &peers[0].sin_addr, text, sizeof(text));
+  TEST_ASSERT_EQUAL_STRING("10.0.0.7", text);
+  TEST_ASSERT_EQUAL(1, ntohs(peers[0].sin_port));
+  TEST_ASSERT_EQUAL(1, a.peers6_len);
+  TEST_ASSERT_EQUAL(2, ntohs(peers6[0].sin6_port));
+  TEST_ASSERT_EQUAL(3, a.dropped);
+
+  char *failure = "d14:failure reason9:not founde";
+  TEST_ASSERT_TRUE(bencode_decode_announce(failure, strlen(failure), &a));
+  TEST_ASSERT_EQUAL(9, a.failure_reason.len);
+  TEST_ASSERT_EQUAL(0, a.peers_len);
+
+  // A compact list that is not a whole number of peers is malformed.
+  char *bad[] = {"d5:peers5:abcdee", "d5:peersld2:ipi1eeee", "d8:interval",
+                 "li1ee"};
+  for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+    TEST_ASSERT_FALSE_MESSAGE(bencode_decode_announce(bad[i], strlen(bad[i]),
+                                                      &a),
+                              bad[i]);
+  }
+}
+
+void count_bad_pieces(void *ctx, size_t piece, bool ok) {
+  (void)piece;
+  if (!ok) {
+    __atomic_fetch_add((size_t *)ctx, 1, __ATOMIC_RELAXED);
+  }
+}
+
+void test_torrent_verify() {
+  char root[] = "/tmp/bencode-verify-XXXXXX";
+  TEST_ASSERT_NOT_NULL(mkdtemp(root));
+  char path[128];
+  snprintf(path, sizeof(path), "%s/t", root);
+  TEST_ASSERT_EQUAL(0, mkdir(path, 0700));
+  snprintf(path, sizeof(path), "%s/t/sub", root);
+  TEST_ASSERT_EQUAL(0, mkdir(path, 0700));
+
+  // 35 bytes over three files, one of them empty, in 16 byte pieces.
+  const char *data = "0123456789abcdefghijklmnopqrstuvwxy";
+  const char *names[] = {"a", "e", "sub/b"};
+  size_t lengths[] = {10, 0, 25};
+  size_t at = 0;
+  for (size_t i = 0; i < 3; i++) {
+    snprintf(path, sizeof(path), "%s/t/%s", root, names[i]);
+    FILE *file = fopen(path, "w");
+    TEST_ASSERT_NOT_NULL(file);
+    fwrite(data + at, 1, lengths[i], file);
+    fclose(file);
+    at += lengths[i];
+  }
+
+  char info[512];
+  size_t len = sprintf(info, "d5:filesld6:lengthi10e4:pathl1:aee"
+                             "d6:lengthi0e4:pathl1:eee"
+                             "d6:lengthi25e4:pathl3:sub1:beee"
+                             "4:name1:t12:piece lengthi16e6:pieces60:");
+  for (size_t i = 0; i < 3; i++) {
+    size_t n = i < 2 ? 16 : 3;
+    bencode_sha1(data + i * 16, n, (unsigned char *)info + len);
+    len += 20;
+  }
+  info[len++] = 'e';
+
+  Parser p = new_parser(new_lexer_from_buffer(info, len));
+  BencodeType dict = parse_item(&p);
+  TEST_ASSERT_EQUAL(0, p.error_index);
+
+  BencodeTorrent t;
+  TEST_ASSERT_TRUE(torrent_from_info(&dict, root, &t));
+  TEST_ASSERT_EQUAL(3, t.pieces_len);
+  TEST_ASSERT_EQUAL(35, t.total_length);
+  TEST_ASSERT_EQUAL(3, t.files_len);
+  snprintf(path, sizeof(path), "%s/t/sub/b", root);
+  TEST_ASSERT_EQUAL_STRING(path, t.files[2].path);
+  TEST_ASSERT_EQUAL(10, t.files[2].offset);
+  TEST_ASSERT_EQUAL(0, torrent_file_at(&t, 9));
+  TEST_ASSERT_EQUAL(2, torrent_file_at(&t, 10));
+  TEST_ASSERT_EQUAL(2, torrent_file_at(&t, 34));
+
+  bool ok[3];
+  size_t bad = 0;
+  BencodeVerifyOptions opts = {
+      .threads = 2,
+      .on_piece = count_bad_pieces,
+      .ctx = &bad,
+  };
+  BencodeVerifyStats stats;
+  TEST_ASSERT_EQUAL(3, torrent_verify(&t, opts, ok, &stats));
+  TEST_ASSERT_EQUAL(0, bad);
+  TEST_ASSERT_EQUAL(3, stats.pieces_ok);
+  TEST_ASSERT_EQUAL(35, stats.bytes);
+
+  // Flip a byte of the second piece, which spans "a" and "sub/b".
+  FILE *file = fopen(path, "r+");
+  fseek(file, 8, SEEK_SET);
+  fputc('!', file);
+  fclose(file);
+  TEST_ASSERT_EQUAL(2, torrent_verify(&t, opts, ok, NULL));
+  TEST_ASSERT_TRUE(ok[0]);
+  TEST_ASSERT_FALSE(ok[1]);
+  TEST_ASSERT_TRUE(ok[2]);
+
+  // A short file fails the pieces it was meant to fill.
+  TEST_ASSERT_EQUAL(0, truncate(path, 20));
+  TEST_ASSERT_EQUAL(1, torrent_verify(&t, opts, ok, NULL));
+  TEST_ASSERT_TRUE(ok[0]);
+  TEST_ASSERT_FALSE(ok[2]);
+  free_torrent(&t);
+
+  for (size_t i = 3; i-- > 0;) {
+    snprintf(path, sizeof(path), "%s/t/%s", root, names[i]);
+    unlink(path);
+  }
+  snprintf(path, sizeof(path), "%s/t/sub", root);
+  rmdir(path);
+  snprintf(path, sizeof(path), "%s/t", root);
+  rmdir(path);
+  rmdir(root);
+  bencode_free(&dict, true);
+
+  // Paths that would leave the download directory are refused.
+  char *escape = "d6:lengthi1e4:name2:..12:piece lengthi16e6:pieces20:"
+                 "aaaaaaaaaaaaaaaaaaaae";
+  p = new_parser(new_lexer_from_buffer(escape, strlen(escape)));
+  dict = parse_item(&p);
+  TEST_ASSERT_FALSE(torrent_from_info(&dict, "/tmp", &t));
+  bencode_free(&dict, true);
+
+  // Negative lengths and totals that would wrap are refused.
+  char *bad_lengths[] = {
+      "d6:lengthi-1e4:name1:a12:piece lengthi16e6:pieces20:"
+      "aaaaaaaaaaaaaaaaaaaae",
+      "d5:filesld6:lengthi9000000000000000000e4:pathl1:aeed6:length"
+      "i9000000000000000000e4:pathl1:beed6:lengthi9000000000000000000e"
+      "4:pathl1:ceee4:name1:t12:piece lengthi16e6:pieces20:"
+      "aaaaaaaaaaaaaaaaaaaae",
+  };
+  for (size_t i = 0; i < sizeof(bad_lengths) / sizeof(bad_lengths[0]); i++) {
+    p = new_parser(
+        new_lexer_from_buffer(bad_lengths[i], strlen(bad_lengths[i])));
+    dict = parse_item(&p);
+    TEST_ASSERT_EQUAL(DICTIONARY, dict.kind);
+    TEST_ASSERT_FALSE(torrent_from_info(&dict, "/tmp", &t));
+    bencode_free(&dict, true);
+  }
+}
+
+void test_fail_fast_errors() {
+  struct {
+    char *input;
+    BencodeErrorCode code;
+    size_t offset;
+  } cases[] = {
+      {"li1ei2e", BENCODE_ERR_UNTERMINATED, 7},
+      {"d3:keyi1e", BENCODE_ERR_UNTERMINATED, 9},
+      {"li1e4:spamix", BENCODE_ERR_BAD_INTEGER, 11},
+      {"d1:ai1ei2ei3ee", BENCODE_ERR_KEY_NOT_STRING, 7},
+      {"l9:abce", BENCODE_ERR_BAD_STRING, 3},
+      {"lxe", BENCODE_ERR_UNEXPECTED_TOKEN, 1},
+      // BENCODE_HASH_INFO_DICT only hashes an info dict.
+      {"d4:infoi1ee", BENCODE_ERR_UNEXPECTED_TOKEN, 7},
+      {"d4:infoli1eee", BENCODE_ERR_UNEXPECTED_TOKEN, 7},
+  };
+
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    Parser p = get_parser(cases[i].input);
+    p.fail_fast = true;
+    BencodeType value = parse_item(&p);
+    TEST_ASSERT_EQUAL_MESSAGE(ERROR, value.kind, cases[i].input);
+    TEST_ASSERT_EQUAL_MESSAGE(cases[i].code, p.error.code, cases[i].input);
+    TEST_ASSERT_EQUAL_MESSAGE(cases[i].offset, p.error.offset, cases[i].input);
+    // Nothing was allocated for the error.
+    TEST_ASSERT_EQUAL(0, p.error_index);
+  }
+
+  // Without fail_fast, messages are still collected and the first error is
+  // reported the same way.
+  Parser p = get_parser("d1:ai1ei2ei3ee");
+  BencodeType value = parse_item(&p);
+  TEST_ASSERT_TRUE(p.error_index > 0);
+  TEST_ASSERT_EQUAL(BENCODE_ERR_KEY_NOT_STRING, p.error.code);
+  TEST_ASSERT_EQUAL_STRING("dictionary key is not a string",
+                           bencode_error_string(p.error.code));
+  bencode_free(&value, true);
+  free_parser_errors(&p);
+
+  // A malformed integer is one error, not one per check it failed.
+  p = get_parser("ixe");
+  value = parse_item(&p);
+  TEST_ASSERT_EQUAL(ERROR, value.kind);
+  TEST_ASSERT_EQUAL(1, p.error_index);
+  TEST_ASSERT_EQUAL(BENCODE_ERR_BAD_INTEGER, p.error.code);
+  TEST_ASSERT_EQUAL(1, p.error.offset);
+  free_parser_errors(&p);
+
+  p = get_parser("i12");
+  value = parse_item(&p);
+  TEST_ASSERT_EQUAL(1, p.error_index);
+  TEST_ASSERT_EQUAL(BENCODE_ERR_BAD_INTEGER, p.error.code);
+  free_parser_errors(&p);
+
+  // A key whose string is cut short ends the dict instead of being used.
+  char *bad_keys[] = {"d762:33:9044", "d3:ab"};
+  for (size_t i = 0; i < sizeof(bad_keys) / sizeof(bad_keys[0]); i++) {
+    BencodeInterner in = new_interner();
+    for (int interned = 0; interned < 2; interned++) {
+      p = get_parser(bad_keys[i]);
+      p.interner = interned ? &in : NULL;
+      value = parse_item(&p);
+      TEST_ASSERT_EQUAL(DICTIONARY, value.kind);
+      TEST_ASSERT_EQUAL(0, value.asDict->len);
+      TEST_ASSERT_EQUAL(1, p.error_index);
+      TEST_ASSERT_EQUAL(BENCODE_ERR_BAD_STRING, p.error.code);
+      bencode_free(&value, true);
+      free_parser_errors(&p);
+    }
+    free_interner(&in);
+  }
+
+  p = get_parser("3:ab");
+  value = parse_item(&p);
+  TEST_ASSERT_EQUAL(ERROR, value.kind);
+  TEST_ASSERT_EQUAL(BENCODE_ERR_BAD_STRING, p.error.code);
+  free_parser_errors(&p);
+}
+
+void test_parser_limits() {
+  // Limits stop the parse even without fail_fast.
+  Parser p = get_parser("lllleeee");
+  p.limits.max_depth = 3;
+  BencodeType value = parse_item(&p);
+  TEST_ASSERT_EQUAL(ERROR, value.kind);
+  TEST_ASSERT_EQUAL(BENCODE_ERR_DEPTH_LIMIT, p.error.code);
+  TEST_ASSERT_EQUAL(3, p.error.offset);
+  free_parser_errors(&p);
+
+  p = get_parser("lllleeee");
+  p.limits.max_depth = 4;
+  value = parse_item(&p);
+  TEST_ASSERT_EQUAL(LIST, value.kind);
+  TEST_ASSERT_EQUAL(BENCODE_OK, p.error.code);
+  bencode_free(&value, true);
+
+  p = get_parser("d3:key10:0123456789e");
+  p.fail_fast = true;
+  p.limits.max_string_len = 8;
+  value = parse_item(&p);
+  TEST_ASSERT_EQUAL(ERROR, value.kind);
+  TEST_ASSERT_EQUAL(BENCODE_ERR_STRING_LIMIT, p.error.code);
+  TEST_ASSERT_EQUAL(6, p.error.offset);
+
+  p = get_parser("li1ei2ei3ee");
+  p.fail_fast = true;
+  p.limits.max_elements = 3;
+  value = parse_item(&p);
+  TEST_ASSERT_EQUAL(ERROR, value.kind);
+  TEST_ASSERT_EQUAL(BENCODE_ERR_ELEMENT_LIMIT, p.error.code);
+  TEST_ASSERT_EQUAL(7, p.error.offset);
+
+  // Two strings and the list's first array fit, the third string does not.
+  p = get_parser("l5:abcde5:abcde5:abcdee");
+  p.fail_fast = true;
+  p.limits.max_alloc_bytes = 4 * sizeof(BencodeType) + 12;
+  value = parse_item(&p);
+  TEST_ASSERT_EQUAL(ERROR, value.kind);
+  TEST_ASSERT_EQUAL(BENCODE_ERR_ALLOC_LIMIT, p.error.code);
+  TEST_ASSERT_EQUAL(17, p.error.offset);
+
+  // The event walker enforces the same limits without building anything.
+  BencodeCallbacks cb = {0};
+  p = get_parser("d1:alli1eeee");
+  p.fail_fast = true;
+  p.limits.max_depth = 2;
+  TEST_ASSERT_FALSE(parse_events(&p, &cb));
+  TEST_ASSERT_EQUAL(BENCODE_ERR_DEPTH_LIMIT, p.error.code);
+  TEST_ASSERT_EQUAL(0, p.depth);
+}
+
+void test_out_of_memory() {
+  char *test = "d4:dictd1:ai1ee4:listli1ei2ei3ei4ei5ee3:str5:valuee";
+  size_t len = strlen(test);
+
+  // Fail each allocation of the parse in turn, until none is left to fail.
+  bool parsed = false;
+  for (long n = 0; !parsed; n++) {
+    Parser p = get_parser(test);
+    p.fail_fast = true;
+    fail_alloc_in = n;
+    BencodeType value = parse_item(&p);
+    parsed = fail_alloc_in >= 0;
+    fail_alloc_in = -1;
+
+    if (parsed) {
+      TEST_ASSERT_EQUAL(DICTIONARY, value.kind);
+      TEST_ASSERT_EQUAL(BENCODE_OK, p.error.code);
+      bencode_free(&value, true);
+    } else {
+      TEST_ASSERT_EQUAL(ERROR, value.kind);
+      TEST_ASSERT_EQUAL(BENCODE_ERR_OUT_OF_MEMORY, p.error.code);
+    }
+  }
+
+  parsed = false;
+  for (long n = 0; !parsed; n++) {
+    BencodeArena arena = new_arena(64);
+    Parser p = get_parser(test);
+    p.arena = &arena;
+    fail_alloc_in = n;
+    BencodeType value = parse_item(&p);
+    parsed = fail_alloc_in >= 0;
+    fail_alloc_in = -1;
+
+    TEST_ASSERT_EQUAL(parsed ? BENCODE_OK : BENCODE_ERR_OUT_OF_MEMORY,
+                      p.error.code);
+    TEST_ASSERT_EQUAL(parsed ? DICTIONARY : ERROR, value.kind);
+    free_parser_errors(&p);
+    free_arena(&arena);
+  }
+
+  parsed = false;
+  for (long n = 0; !parsed; n++) {
+    PushParser p = new_push_parser();
+    fail_alloc_in = n;
+    BencodeFeedResult r = BENCODE_NEED_MORE;
+    for (size_t i = 0; i < len && r == BENCODE_NEED_MORE; i++) {
+      r = bencode_feed(&p, test + i, 1);
+    }
+    parsed = fail_alloc_in >= 0;
+    fail_alloc_in = -1;
+
+    if (parsed) {
+      TEST_ASSERT_EQUAL(BENCODE_VALUE_READY, r);
+      bencode_free(&p.value, true);
+    } else {
+      TEST_ASSERT_EQUAL(BENCODE_ERROR, r);
+      TEST_ASSERT_EQUAL(BENCODE_ERR_OUT_OF_MEMORY, p.error.code);
+    }
+    free_push_parser(&p);
+  }
+
+  // A dict index that cannot be built falls back to a binary search. The
+  // last key takes the dict to the threshold, so its insert builds the index.
+  BencodeType big = bencode_dict(NULL);
+  char keys[BENCODE_DICT_INDEX_THRESHOLD][4];
+  for (int i = 0; i < BENCODE_DICT_INDEX_THRESHOLD; i++) {
+    snprintf(keys[i], sizeof(keys[i]), "k%02d", i);
+    fail_alloc_in = i == BENCODE_DICT_INDEX_THRESHOLD - 1 ? 0 : -1;
+    TEST_ASSERT_TRUE(bencode_dict_set(&big, keys[i], 3, bencode_int(i)));
+  }
+  fail_alloc_in = -1;
+  BencodeType *v = bencode_dict_get(big.asDict, "k42", 3);
+  TEST_ASSERT_NOT_NULL(v);
+  TEST_ASSERT_EQUAL(42, v->asInt);
+  TEST_ASSERT_NULL(big.asDict->index);
+  bencode_free(&big, false);
+}
+
+void test_parse_events() {
+  char *test = "d5:filesl3:abci-1ee8:completei5e4:restli9eee";
+  event_ctx ctx = {0};
+  BencodeCallbacks cb = {
+      .ctx = &ctx,
+      .on_int = trace_int,
+      .on_string = trace_string,
+      .on_list_begin = trace_list_begin,
+      .on_list_end = trace_list_end,
+      .on_dict_begin = trace_dict_begin,
+      .on_dict_end = trace_dict_end,
+  };
+
+  Parser p = get_parser(test);
+  TEST_ASSERT_TRUE(parse_events(&p, &cb));
+  TEST_ASSERT_EQUAL(0, p.error_index);
+  TEST_ASSERT_EQUAL_STRING("{ [ sabc i-1 ] i5 [ i9 ] } ", ctx.trace);
+
+  // Stop as soon as the value we are after has been seen.
+  ctx = (event_ctx){0};
+  cb.on_key = trace_key;
+  p = get_parser(test);
+  TEST_ASSERT_FALSE(parse_events(&p, &cb));
+  TEST_ASSERT_EQUAL(0, p.error_index);
+  TEST_ASSERT_EQUAL(5, ctx.found);
+  TEST_ASSERT_EQUAL(2, ctx.ints_seen);
+}
+
+void test_parse_events_malformed() {
+  BencodeCallbacks cb = {0};
+  Parser p = get_parser("li1e");
+  TEST_ASSERT_FALSE(parse_events(&p, &cb));
+  TEST_ASSERT_TRUE(p.error_index > 0);
+
+  p = get_parser("di1ei2ee");
+  TEST_ASSERT_FALSE(parse_events(&p, &cb));
+  TEST_ASSERT_TRUE(p.error_index > 0);
+}
+
+void test_tape_navigation() {
+  char *test = "d8:announce3:url4:infod6:lengthi42e4:name4:file6:piecesl"
+               "1:a1:bee3:zzzle1:xi-7ee";
+  BencodeTape tape;
+  TEST_ASSERT_TRUE(tape_build(&tape, test, strlen(test)));
+
+  BencodeCursor root = tape_root(&tape);
+  TEST_ASSERT_EQUAL(DICTIONARY, tape_kind(root));
+  TEST_ASSERT_EQUAL(8, tape.entries[0].len);
+
+  BencodeString announce = tape_as_string(tape_find_key(root, "announce", 8));
+  TEST_ASSERT_EQUAL(3, announce.len);
+  TEST_ASSERT_EQUAL_PTR(test + 13, announce.str);
+
+  BencodeCursor info = tape_find_key(root, "info", 4);
+  TEST_ASSERT_EQUAL(DICTIONARY, tape_kind(info));
+  TEST_ASSERT_EQUAL(42, tape_as_int(tape_find_key(info, "length", 6)));
+  TEST_ASSERT_EQUAL_STRING_LEN("file",
+                               tape_as_string(tape_find_key(info, "name", 4)).str,
+                               4);
+
+  BencodeCursor pieces = tape_find_key(info, "pieces", 6);
+  TEST_ASSERT_EQUAL(LIST, tape_kind(pieces));
+  size_t n = 0;
+  for (BencodeCursor c = tape_child(pieces); tape_valid(c);
+       c = tape_next_sibling(c)) {
+    n++;
+  }
+  TEST_ASSERT_EQUAL(2, n);
+
+  // Keys that only exist deeper in the document are not found at the top.
+  TEST_ASSERT_FALSE(tape_valid(tape_find_key(root, "length", 6)));
+  BencodeCursor zzz = tape_find_key(root, "zzz", 3);
+  TEST_ASSERT_EQUAL(LIST, tape_kind(zzz));
+  TEST_ASSERT_FALSE(tape_valid(tape_child(zzz)));
+  TEST_ASSERT_EQUAL(-7, tape_as_int(tape_find_key(root, "x", 1)));
+
+  free_tape(&tape);
+}
+
+void test_tape_malformed() {
+  char *bad[] = {"li1e", "di1ei2ee", "d1:ae", "5:abc", "i12", "e", "i-e"};
+  for (size_t i = 0; i < ARRAY_LEN(bad); i++) {
+    BencodeTape tape;
+    TEST_ASSERT_FALSE_MESSAGE(tape_build(&tape, bad[i], strlen(bad[i])),
+                              bad[i]);
+    TEST_ASSERT_EQUAL(0, tape.len);
+  }
+
+  BencodeTape tape;
+  TEST_ASSERT_TRUE(tape_build(&tape, "i1e3:abcle", 10));
+  BencodeCursor c = tape_root(&tape);
+  TEST_ASSERT_EQUAL(INTEGER, tape_kind(c));
+  c = tape_next_sibling(c);
+  TEST_ASSERT_EQUAL(BYTESTRING, tape_kind(c));
+  c = tape_next_sibling(c);
+  TEST_ASSERT_EQUAL(LIST, tape_kind(c));
+  TEST_ASSERT_FALSE(tape_valid(tape_next_sibling(c)));
+  free_tape(&tape);
+}
+
+void test_index_kernels() {
+  char block[64];
+  srand(1);
+  for (int round = 0; round < 1000; round++) {
+    for (size_t i = 0; i < sizeof(block); i++) {
+      // Bias towards the interesting bytes.
+      char interesting[] = "0123456789dlie:-/;Dx";
+      block[i] = round % 2 ? interesting[rand() % 20] : (char)rand();
+    }
+
+    uint64_t digits, structural;
+    index_block_scalar(block, &digits, &structural);
+
+    for (size_t i = 0; i < sizeof(block); i++) {
+      TEST_ASSERT_EQUAL(block[i] >= '0' && block[i] <= '9',
+                        (digits >> i) & 1);
+    }
+
+#ifdef BENCODE_X86_SIMD
+    uint64_t simd_digits, simd_structural;
+    index_block_sse2(block, &simd_digits, &simd_structural);
+    TEST_ASSERT_TRUE(digits == simd_digits);
+    TEST_ASSERT_TRUE(structural == simd_structural);
+
+    if (__builtin_cpu_supports("avx2")) {
+      index_block_avx2(block, &simd_digits, &simd_structural);
+      TEST_ASSERT_TRUE(digits == simd_digits);
+      TEST_ASSERT_TRUE(structural == simd_structural);
+    }
+#endif
+  }
+}
+
+void test_index_digit_runs() {
+  // Long enough that runs cross both block and window boundaries.
+  size_t len = BENCODE_INDEX_BLOCKS * 64 * 3 + 17;
+  char *buf = malloc(len);
+  memset(buf, '7', len);
+  buf[100] = ':';
+  buf[BENCODE_INDEX_BLOCKS * 64 + 5] = 'e';
+
+  BencodeIndex idx = {0};
+  TEST_ASSERT_EQUAL(100, index_digits_end(&idx, buf, len, 0));
+  TEST_ASSERT_EQUAL(100, index_digits_end(&idx, buf, len, 100));
+  TEST_ASSERT_EQUAL(BENCODE_INDEX_BLOCKS * 64 + 5,
+                    index_digits_end(&idx, buf, len, 101));
+  TEST_ASSERT_EQUAL(len, index_digits_end(&idx, buf, len, 4000 + 64 * 64));
+  TEST_ASSERT_TRUE(index_is_structural(&idx, buf, len, 100));
+  TEST_ASSERT_FALSE(index_is_structural(&idx, buf, len, 101));
+  TEST_ASSERT_EQUAL(100, index_next_structural(&idx, buf, len, 0));
+  TEST_ASSERT_EQUAL(BENCODE_INDEX_BLOCKS * 64 + 5,
+                    index_next_structural(&idx, buf, len, 101));
+  TEST_ASSERT_EQUAL(len, index_next_structural(&idx, buf, len,
+                                               BENCODE_INDEX_BLOCKS * 64 + 6));
+  free(buf);
+
+  // The lexer finds the end of an integer that crosses an index window.
+  char doc[BENCODE_INDEX_BLOCKS * 64 + 32];
+  size_t n = BENCODE_INDEX_BLOCKS * 64 - 12;
+  size_t at = sprintf(doc, "l%zu:", n);
+  memset(doc + at, 'x', n);
+  at += n;
+  sprintf(doc + at, "i1234567890123e4:spame");
+  TEST_ASSERT_TRUE(at < BENCODE_INDEX_BLOCKS * 64 &&
+                   at + 15 > BENCODE_INDEX_BLOCKS * 64);
+
+  Parser p = get_parser(doc);
+  BencodeType list = parse_item(&p);
+  TEST_ASSERT_EQUAL(LIST, list.kind);
+  TEST_ASSERT_EQUAL(3, list.asList.len);
+  TEST_ASSERT_EQUAL(1234567890123, list.asList.values[1].asInt);
+  TEST_ASSERT_EQUAL_STRING("spam", list.asList.values[2].asString.str);
+  bencode_free(&list, true);
+
+  p = get_parser("li12x4ee");
+  p.fail_fast = true;
+  list = parse_item(&p);
+  TEST_ASSERT_EQUAL(BENCODE_ERR_BAD_INTEGER, p.error.code);
+  TEST_ASSERT_EQUAL(2, p.error.offset);
+}
+
+typedef struct {
+  char *in;
+  bool allow_negative;
+  DecimalStatus status;
+  long expected;
+} decimal_test;
+
+void test_decimal_decode() {
+  decimal_test tests[] = {
+      {"0", true, DECIMAL_OK, 0},
+      {"7", false, DECIMAL_OK, 7},
+      {"12345678", false, DECIMAL_OK, 12345678},
+      {"123456789012", false, DECIMAL_OK, 123456789012},
+      {"-1234567890123456", true, DECIMAL_OK, -1234567890123456},
+      {"9223372036854775807", true, DECIMAL_OK, LONG_MAX},
+      {"-9223372036854775808", true, DECIMAL_OK, LONG_MIN},
+      {"9223372036854775808", true, DECIMAL_OVERFLOW, 0},
+      {"-9223372036854775809", true, DECIMAL_OVERFLOW, 0},
+      {"99999999999999999999", true, DECIMAL_OVERFLOW, 0},
+      {"", true, DECIMAL_EMPTY, 0},
+      {"-", true, DECIMAL_EMPTY, 0},
+      {"-0", true, DECIMAL_LEADING_ZERO, 0},
+      {"007", true, DECIMAL_LEADING_ZERO, 0},
+      {"-5", false, DECIMAL_INVALID, 0},
+      {"1-2", true, DECIMAL_INVALID, 0},
+      {"1234567a", true, DECIMAL_INVALID, 0},
+      {"123456789a", true, DECIMAL_INVALID, 0},
+  };
+
+  for (size_t i = 0; i < ARRAY_LEN(tests); i++) {
+    long value = 0;
+    DecimalStatus status = decimal_decode(tests[i].in, strlen(tests[i].in),
+                                          tests[i].allow_negative, &value);
+    TEST_ASSERT_EQUAL_MESSAGE(tests[i].status, status, tests[i].in);
+    if (status == DECIMAL_OK) {
+      TEST_ASSERT_TRUE_MESSAGE(tests[i].expected == value, tests[i].in);
+    }
+  }
+}
+
+void test_non_canonical_integers_rejected() {
+  char *bad[] = {"i-0e", "i03e", "i1-2e", "i9223372036854775808e", "03:abc",
+                 "i--1e"};
+  for (size_t i = 0; i < ARRAY_LEN(bad); i++) {
+    size_t len = strlen(bad[i]);
+
+    Parser p = get_parser(bad[i]);
+    parse_item(&p);
+    TEST_ASSERT_TRUE_MESSAGE(p.error_index > 0, bad[i]);
+
+    BencodeTape tape;
+    TEST_ASSERT_FALSE_MESSAGE(tape_build(&tape, bad[i], len), bad[i]);
+
+    PushParser pp = new_push_parser();
+    TEST_ASSERT_EQUAL_MESSAGE(BENCODE_ERROR, bencode_feed(&pp, bad[i], len),
+                              bad[i]);
+    free_push_parser(&pp);
+  }
+
+  Parser p = get_parser("i-9223372036854775808e");
+  BencodeType min = parse_item(&p);
+  TEST_ASSERT_EQUAL(0, p.error_index);
+  TEST_ASSERT_TRUE(LONG_MIN == min.asInt);
+
+  PushParser pp = new_push_parser();
+  TEST_ASSERT_EQUAL(BENCODE_VALUE_READY,
+                    bencode_feed(&pp, "i-9223372036854775808e", 22));
+  TEST_ASSERT_TRUE(LONG_MIN == pp.value.asInt);
+  free_push_parser(&pp);
+}
+
+void test_encode_roundtrip() {
+  char *inputs[] = {
+      "i0e",
+      "i-42e",
+      "0:",
+      "4:spam",
+      "le",
+      "de",
+      "d8:announce3:url4:infod6:lengthi9223372036854775807e4:name4:filee"
+      "4:listli1el1:aeee",
+  };
+
+  for (size_t i = 0; i < ARRAY_LEN(inputs); i++) {
+    Parser p = get_parser(inputs[i]);
+    p.zero_copy = true;
+    BencodeType t = parse_item(&p);
+
+    size_t n = bencode_encoded_size(&t);
+    TEST_ASSERT_EQUAL_MESSAGE(strlen(inputs[i]), n, inputs[i]);
+
+    char out[256];
+    TEST_ASSERT_EQUAL(n, bencode_encode(&t, out));
+    TEST_ASSERT_EQUAL_STRING_LEN_MESSAGE(inputs[i], out, n, inputs[i]);
+    bencode_free(&t, false);
+  }
+}
+
+void test_encode_builder_sorts_keys() {
+  BencodeType files = bencode_list();
+  bencode_list_append(NULL, &files.asList, bencode_str("a.txt", 5));
+  bencode_list_append(NULL, &files.asList, bencode_int(-3));
+
+  BencodeType d = bencode_dict(NULL);
+  bencode_dict_set(&d, "zeta", 4, bencode_int(1));
+  bencode_dict_set(&d, "files", 5, files);
+  bencode_dict_set(&d, "alpha", 5, bencode_int(2));
+  bencode_dict_set(&d, "zeta", 4, bencode_int(3));
+
+  BencodeBuffer b = {0};
+  bencode_encode_buffer(&b, &d);
+  char *expected = "d5:alphai2e5:filesl5:a.txti-3ee4:zetai3ee";
+  TEST_ASSERT_EQUAL(strlen(expected), b.len);
+  TEST_ASSERT_EQUAL_STRING_LEN(expected, b.data, b.len);
+
+  bencode_encode_buffer(&b, &files);
+  TEST_ASSERT_EQUAL(strlen(expected) + 13, b.len);
+
+  free_buffer(&b);
+  bencode_free(&d, false);
+}
+
+void test_encode_builder_many_keys() {
+  // Reverse-order keys stay in the unsorted tail; lookups and replacements
+  // must not sort or rebuild the index per call.
+  enum { KEYS = 20000 };
+  static char names[KEYS][8];
+  BencodeType d = bencode_dict(NULL);
+  for (int i = 0; i < KEYS; i++) {
+    snprintf(names[i], sizeof(names[i]), "k%05d", KEYS - 1 - i);
+    BencodeType v = bencode_list();
+    TEST_ASSERT_TRUE(bencode_list_append(NULL, &v.asList, bencode_int(i)));
+    TEST_ASSERT_TRUE(bencode_dict_set(&d, names[i], 6, v));
+  }
+  TEST_ASSERT_EQUAL(KEYS, d.asDict->len);
+
+  // Replacing frees the old list (checked by the sanitizer build).
+  for (int i = 0; i < KEYS; i += 2) {
+    TEST_ASSERT_TRUE(bencode_dict_set(&d, names[i], 6, bencode_int(-i)));
+  }
+  TEST_ASSERT_EQUAL(KEYS, d.asDict->len);
+  for (int i = 0; i < KEYS; i++) {
+    BencodeType *v = bencode_dict_get(d.asDict, names[i], 6);
+    TEST_ASSERT_NOT_NULL(v);
+    if (i % 2 == 0) {
+      TEST_ASSERT_EQUAL(-i, v->asInt);
+    } else {
+      TEST_ASSERT_EQUAL(LIST, v->kind);
+      TEST_ASSERT_EQUAL(i, v->asList.values[0].asInt);
+    }
+  }
+
+  BencodeBuffer b = {0};
+  TEST_ASSERT_TRUE(bencode_encode_buffer(&b, &d));
+  char *first = "d6:k00000li19999ee6:k00001i-19998e";
+  TEST_ASSERT_EQUAL_STRING_LEN(first, b.data, strlen(first));
+  TEST_ASSERT_EQUAL(d.asDict->len, d.asDict->sorted_len);
+
+  free_buffer(&b);
+  bencode_free(&d, false);
+}
+
+void test_encode_iov() {
+  char pieces[1000];
+  memset(pieces, 'p', sizeof(pieces));
+
+  BencodeType info = bencode_dict(NULL);
+  bencode_dict_set(&info, "pieces", 6, bencode_str(pieces, sizeof(pieces)));
+  bencode_dict_set(&info, "name", 4, bencode_str("x", 1));
+  BencodeType root = bencode_dict(NULL);
+  bencode_dict_set(&root, "info", 4, info);
+  bencode_dict_set(&root, "announce", 8, bencode_str("url", 3));
+
+  size_t n = bencode_encoded_size(&root);
+  char *flat = malloc(n);
+  TEST_ASSERT_EQUAL(n, bencode_encode(&root, flat));
+
+  BencodeIov v = {0};
+  bencode_encode_iov(&v, &root);
+  TEST_ASSERT_EQUAL(n, v.len);
+  TEST_ASSERT_EQUAL(3, v.iovcnt);
+  TEST_ASSERT_EQUAL_PTR(pieces, v.iov[1].iov_base);
+
+  size_t at = 0;
+  for (size_t i = 0; i < v.iovcnt; i++) {
+    TEST_ASSERT_EQUAL_MEMORY(flat + at, v.iov[i].iov_base, v.iov[i].iov_len);
+    at += v.iov[i].iov_len;
+  }
+  TEST_ASSERT_EQUAL(n, at);
+
+  free_iov(&v);
+  free(flat);
+  bencode_free(&root, false);
+}
+
+void test_parse_multiple_documents() {
+  char *test = "d1:ai1ee4:spamli1ei2eei-5e";
+  Parser p = get_parser(test);
+  BencodeList items = parse(&p);
+  TEST_ASSERT_EQUAL(0, p.error_index);
+  TEST_ASSERT_EQUAL(4, items.len);
+  TEST_ASSERT_EQUAL(DICTIONARY, items.values[0].kind);
+  TEST_ASSERT_EQUAL_STRING("spam", items.values[1].asString.str);
+  TEST_ASSERT_EQUAL(LIST, items.values[2].kind);
+  TEST_ASSERT_EQUAL(-5, items.values[3].asInt);
+
+  BencodeType all = {.kind = LIST, .asList = items};
+  bencode_free(&all, true);
+
+  // A truncated record stops the parse instead of looping on end of input.
+  p = get_parser("i1eli2e");
+  items = parse(&p);
+  TEST_ASSERT_EQUAL(1, items.len);
+  TEST_ASSERT_TRUE(p.error_index > 0);
+  free(items.values);
+}
+
+void test_parse_full_error_log() {
+  // With the message log already full, a record that fails partway, and
+  // still comes back as a dict, must stop the parse all the same.
+  Parser p = get_parser("i1ed3:ab");
+  p.error_index = ARRAY_LEN(p.errors);
+  BencodeList items = parse(&p);
+  TEST_ASSERT_EQUAL(1, items.len);
+  TEST_ASSERT_EQUAL(1, items.values[0].asInt);
+  TEST_ASSERT_EQUAL(BENCODE_ERR_BAD_STRING, p.error.code);
+  TEST_ASSERT_EQUAL(ARRAY_LEN(p.errors), p.error_index);
+  p.error_index = 0;
+  free(items.values);
+}
+
+void test_bencode_skip() {
+  char *test = "d4:data5:de:li3:xyzli1ei-2eee1:x";
+  size_t pos = 0;
+  TEST_ASSERT_TRUE(bencode_skip(test, strlen(test), &pos));
+  TEST_ASSERT_EQUAL(strlen(test) - 3, pos);
+  TEST_ASSERT_TRUE(bencode_skip(test, strlen(test), &pos));
+  TEST_ASSERT_EQUAL(strlen(test), pos);
+
+  pos = 0;
+  TEST_ASSERT_FALSE(bencode_skip("li1e", 4, &pos));
+  TEST_ASSERT_FALSE(bencode_skip("5:abc", 5, &pos));
+  TEST_ASSERT_EQUAL(0, pos);
+
+  // Dicts alternate string keys and values, at any depth.
+  char *bad[] = {"d1:de", "d3:0e2e", "dd1:lee", "di1e1:ae", "dl1:ae1:be",
+                 "ld1:ai1e1:bee"};
+  for (size_t i = 0; i < ARRAY_LEN(bad); i++) {
+    pos = 0;
+    TEST_ASSERT_FALSE_MESSAGE(bencode_skip(bad[i], strlen(bad[i]), &pos),
+                              bad[i]);
+
+    // A query that has to skip over the bad dict fails there too.
+    char doc[64];
+    int n = snprintf(doc, sizeof(doc), "d1:a%s1:bi1ee", bad[i]);
+    BencodeQuery q[] = {{.path = "a"}, {.path = "b"}};
+    TEST_ASSERT_EQUAL_MESSAGE(0, bencode_query(doc, n, q, ARRAY_LEN(q)),
+                              bad[i]);
+  }
+
+  // Past 64 levels the dict bits move to the heap.
+  enum { DEPTH = 1000 };
+  static char deep[DEPTH * 4 + 8];
+  size_t n = 0;
+  for (int i = 0; i < DEPTH; i++) {
+    n += sprintf(deep + n, i % 2 ? "l" : "d1:k");
+  }
+  deep[n++] = 'e';
+  for (int i = DEPTH - 1; i > 0; i--) {
+    deep[n++] = 'e';
+  }
+  pos = 0;
+  TEST_ASSERT_TRUE(bencode_skip(deep, n, &pos));
+  TEST_ASSERT_EQUAL(n, pos);
+  // The innermost dict, 999 levels down, gets an integer key.
+  memcpy(deep + (DEPTH - 2) / 2 * 5, "di0e", 4);
+  pos = 0;
+  TEST_ASSERT_FALSE(bencode_skip(deep, n, &pos));
+}
+
+void test_parse_parallel() {
+  size_t records = 1000;
+  char *buf = malloc(records * 64);
+  size_t len = 0;
+  for (size_t i = 0; i < records; i++) {
+    len += sprintf(buf + len, "d5:eventi%zue4:peer%zu:%.*se", i % 7,
+                   i % 10 + 1, (int)(i % 10 + 1), "xxxxxxxxxx");
+  }
+
+  BencodeParallelOptions opts = {.threads = 4};
+  BencodeList out;
+  TEST_ASSERT_TRUE(parse_parallel(buf, len, opts, &out));
+  TEST_ASSERT_EQUAL(records, out.len);
+
+  for (size_t i = 0; i < records; i++) {
+    BencodeType *event = bencode_dict_get(out.values[i].asDict, "event", 5);
+    TEST_ASSERT_NOT_NULL(event);
+    TEST_ASSERT_EQUAL(i % 7, event->asInt);
+    BencodeType *peer = bencode_dict_get(out.values[i].asDict, "peer", 4);
+    TEST_ASSERT_NOT_NULL(peer);
+    TEST_ASSERT_EQUAL(i % 10 + 1, peer->asString.len);
+  }
+
+  BencodeType all = {.kind = LIST, .asList = out};
+  bencode_free(&all, true);
+
+  // Trailing garbage is reported, but the records before it are kept.
+  strcpy(buf + len, "d5:event");
+  TEST_ASSERT_FALSE(parse_parallel(buf, len + 8, opts, &out));
+  TEST_ASSERT_EQUAL(records, out.len);
+  all = (BencodeType){.kind = LIST, .asList = out};
+  bencode_free(&all, true);
+
+  free(buf);
+}
+
+void count_files(void *ctx, BencodeBatchResult *r) {
+  if (r->ok) {
+    __atomic_fetch_add((size_t *)ctx, 1, __ATOMIC_RELAXED);
+  }
+}
+
+void test_parse_batch() {
+  char paths[4][32];
+  const char *path_ptrs[5];
+  char *contents[] = {"d4:infod4:name1:aee", "li1ei2ee", "d3:bad",
+                      "i1ei2e"};
+  for (size_t i = 0; i < ARRAY_LEN(contents); i++) {
+    strcpy(paths[i], "/tmp/bencode-batch-XXXXXX");
+    int fd = mkstemp(paths[i]);
+    TEST_ASSERT_TRUE(fd >= 0);
+    TEST_ASSERT_EQUAL(strlen(contents[i]),
+                      write(fd, contents[i], strlen(contents[i])));
+    close(fd);
+    path_ptrs[i] = paths[i];
+  }
+  path_ptrs[4] = "/tmp/bencode-batch-does-not-exist";
+
+  size_t seen = 0;
+  BencodeBatchOptions opts = {
+      .threads = 3,
+      .keep_values = true,
+      .on_file = count_files,
+      .ctx = &seen,
+  };
+  BencodeBatchResult results[5];
+  TEST_ASSERT_EQUAL(2, parse_batch(path_ptrs, 5, opts, results));
+  TEST_ASSERT_EQUAL(2, seen);
+
+  TEST_ASSERT_TRUE(results[0].ok);
+  TEST_ASSERT_EQUAL_PTR(path_ptrs[0], results[0].path);
+  BencodeType *info = bencode_dict_get(results[0].value.asDict, "info", 4);
+  TEST_ASSERT_NOT_NULL(info);
+  TEST_ASSERT_EQUAL_STRING(
+      "a", bencode_dict_get(info->asDict, "name", 4)->asString.str);
+
+  TEST_ASSERT_TRUE(results[1].ok);
+  TEST_ASSERT_EQUAL(8, results[1].bytes);
+  TEST_ASSERT_FALSE(results[2].ok);
+  TEST_ASSERT_FALSE(results[3].ok);
+  TEST_ASSERT_FALSE(results[4].ok);
+  TEST_ASSERT_EQUAL_STRING("No such file or directory", results[4].error);
+
+  for (size_t i = 0; i < 5; i++) {
+    bencode_free(&results[i].value, true);
+  }
+  for (size_t i = 0; i < ARRAY_LEN(contents); i++) {
+    unlink(paths[i]);
+  }
+}
+
+#ifdef BENCODE_STATS
+void test_parser_stats() {
+  const char *doc = "d1:ali1eli2eee1:b3:xyze";
+  Parser p = new_parser(new_lexer_from_buffer(doc, strlen(doc)));
+  BencodeType value = parse_item(&p);
+  TEST_ASSERT_EQUAL(DICTIONARY, value.kind);
+
+  BencodeStats *s = &p.stats;
+  TEST_ASSERT_EQUAL(1, s->tokens[DICT_START]);
+  TEST_ASSERT_EQUAL(2, s->tokens[LIST_START]);
+  TEST_ASSERT_EQUAL(2, s->tokens[INT_START]);
+  TEST_ASSERT_EQUAL(3, s->tokens[STRING]);
+  TEST_ASSERT_EQUAL(3, s->max_depth);
+  // Both keys and "xyz" are copied, without their terminators.
+  TEST_ASSERT_EQUAL(5, s->bytes_copied);
+  TEST_ASSERT_EQUAL(p.allocated, s->bytes_allocated);
+  TEST_ASSERT_TRUE(s->allocations >= 4);
+  TEST_ASSERT_TRUE(s->lex_cycles > 0);
+  TEST_ASSERT_TRUE(s->build_cycles > 0);
+  bencode_free(&value, true);
+
+  hash_table_t table;
+  hash_table_init_ex(&table, (hash_options_t){.size = 8});
+  char keys[16][4];
+  for (size_t i = 0; i < 16; i++) {
+    snprintf(keys[i], sizeof(keys[i]), "k%zu", i);
+    hash_table_insert(&table, keys[i], strlen(keys[i]), keys[i]);
+  }
+  for (size_t i = 0; i < 16; i++) {
+    TEST_ASSERT_EQUAL_PTR(keys[i],
+                          hash_table_lookup(&table, keys[i], strlen(keys[i])));
+  }
+
+  hash_table_stats_t *h = &table.stats;
+  TEST_ASSERT_EQUAL(16, h->inserts);
+  TEST_ASSERT_EQUAL(16, h->lookups);
+  TEST_ASSERT_TRUE(h->rehashes >= 1);
+  size_t searches = 0;
+  for (size_t i = 0; i < HASH_TABLE_PROBE_BUCKETS; i++) {
+    searches += h->probes[i];
+  }
+  TEST_ASSERT_EQUAL(16, searches);
+  hash_table_free(&table);
+}
+#endif
+
 int main() {
   UNITY_BEGIN();
   RUN_TEST(test_lexer);
@@ -323,5 +2264,55 @@ int main() {
   RUN_TEST(test_dict_lexer_positions);
   RUN_TEST(test_get_info_dict_digest);
   RUN_TEST(test_string_with_numbers);
+  RUN_TEST(test_zero_copy_strings);
+  RUN_TEST(test_lexer_from_buffer);
+  RUN_TEST(test_lexer_mmap);
+  RUN_TEST(test_push_parser_byte_at_a_time);
+  RUN_TEST(test_push_parser_multiple_values_per_chunk);
+  RUN_TEST(test_push_parser_errors);
+  RUN_TEST(test_push_parser_limits);
+  RUN_TEST(test_arena_parse);
+  RUN_TEST(test_arena_large_allocation);
+  RUN_TEST(test_bencode_free);
+  RUN_TEST(test_dict_entries_sorted);
+  RUN_TEST(test_large_dict_lookup);
+  RUN_TEST(test_dict_incremental_index);
+  RUN_TEST(test_interned_keys);
+  RUN_TEST(test_hash_table_distribution);
+  RUN_TEST(test_hash_table_delete);
+  RUN_TEST(test_hash_table_incremental_resize);
+  RUN_TEST(test_hash_table_incremental_resize_bounded);
+  RUN_TEST(test_hash_table_reserve);
+  RUN_TEST(test_sha_digests);
+  RUN_TEST(test_parser_spans);
+  RUN_TEST(test_push_parser_spans);
+  RUN_TEST(test_path_queries);
+  RUN_TEST(test_announce_decoder);
+  RUN_TEST(test_schema_decoder);
+  RUN_TEST(test_torrent_verify);
+  RUN_TEST(test_fail_fast_errors);
+  RUN_TEST(test_parser_limits);
+  RUN_TEST(test_out_of_memory);
+  RUN_TEST(test_node_layout);
+#ifdef BENCODE_STATS
+  RUN_TEST(test_parser_stats);
+#endif
+  RUN_TEST(test_parse_events);
+  RUN_TEST(test_parse_events_malformed);
+  RUN_TEST(test_tape_navigation);
+  RUN_TEST(test_tape_malformed);
+  RUN_TEST(test_index_kernels);
+  RUN_TEST(test_index_digit_runs);
+  RUN_TEST(test_decimal_decode);
+  RUN_TEST(test_non_canonical_integers_rejected);
+  RUN_TEST(test_encode_roundtrip);
+  RUN_TEST(test_encode_builder_sorts_keys);
+  RUN_TEST(test_encode_builder_many_keys);
+  RUN_TEST(test_encode_iov);
+  RUN_TEST(test_parse_multiple_documents);
+  RUN_TEST(test_parse_full_error_log);
+  RUN_TEST(test_bencode_skip);
+  RUN_TEST(test_parse_parallel);
+  RUN_TEST(test_parse_batch);
   return UNITY_END();
 }